@@ -0,0 +1,24 @@
+-- benchmark creation of big strings from buffers (io.read, string.rep etc.)
+-- usage: luajit bigstr.lua [file]  (file should hold a few megabytes)
+
+local clock, rep, concat = os.clock, string.rep, table.concat
+local fn = arg and arg[1]
+local N = 200
+
+local function bench(name, f)
+  local t0 = clock()
+  for i = 1, N do f(i) end
+  print(string.format("%-10s %7.2f ms", name, (clock() - t0) * 1000 / N))
+end
+
+if fn then
+  -- read at shifting offsets, so every payload is a distinct string
+  bench("read(a)", function(i)
+    local fp = assert(io.open(fn, "rb")); fp:seek("set", i)
+    local s = fp:read("*a"); fp:close()
+  end)
+end
+bench("rep", function(i) local s = rep("abcdefgh", 1000000, tostring(i)) end)
+local parts = {}
+for i = 1, 1000 do parts[i] = rep("x", 8000) end
+bench("concat", function(i) local s = concat(parts, tostring(i)) end)
@@ -0,0 +1,64 @@
+-- benchmark the longest time-budgeted GC step with a busy mutator
+-- Many big tables are written in between, weak tables and objects with
+-- __gc keep the atomic phase busy. Checks that weak entries and
+-- finalizers still behave.
+local fmt = string.format
+local NTAB, N, ROUNDS, USEC = 64, 10000, 5000, 200
+
+local big = {}
+for j = 1, NTAB do
+  local t = {}
+  for i = 1, N do t[i] = {i} end
+  for i = 1, N/4 do t["k"..i] = i end
+  big[j] = t
+end
+
+local wkeys = setmetatable({}, {__mode = "k"})
+local wvals = setmetatable({}, {__mode = "v"})
+local keep, KEEP = {}, 1000
+local fins, nfin = 0, 0
+local fin_mt = {__gc = function() fins = fins + 1 end}
+
+collectgarbage("stop")
+collectgarbage("maxpause", 1)
+local cycles = 0
+for r = 1, ROUNDS do
+  -- Write into a big table, which makes it gray again.
+  local t = big[(r * 7) % NTAB + 1]
+  local i = (r * 31) % N + 1
+  t[i] = {r}
+  t["k"..i] = t[i]
+  -- Weak entries: the last key is kept alive for a while.
+  for i = 1, 4 do
+    local k = {r, i}
+    wkeys[k] = i
+    wvals[(r % 100) * 4 + i] = k
+    if i == 4 then keep[r % KEEP + 1] = k end
+  end
+  -- Objects to be finalized.
+  for i = 1, 5 do setmetatable({}, fin_mt); nfin = nfin + 1 end
+  if collectgarbage("step", {usec = USEC}) then cycles = cycles + 1 end
+end
+local maxpause = collectgarbage("maxpause")
+
+collectgarbage("restart")
+collectgarbage("collect")
+collectgarbage("collect")
+local alive, nalive = {}, 0
+for _, k in pairs(keep) do alive[k] = true; nalive = nalive + 1 end
+local nk = 0
+for k, v in pairs(wkeys) do
+  assert(alive[k] and k[2] == v)
+  nk = nk + 1
+end
+for k, v in pairs(wvals) do
+  assert(alive[v] and k == (v[1] % 100) * 4 + v[2])
+end
+assert(nk == nalive)
+assert(fins == nfin)
+for j = 1, NTAB do
+  local t = big[j]
+  for i = 1, N, 997 do assert(type(t[i][1]) == "number") end
+end
+print(fmt("%-8s %6d us (budget %d us, %d cycles)", "maxpause",
+	  maxpause, USEC, cycles))
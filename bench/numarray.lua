@@ -0,0 +1,62 @@
+-- benchmark full GC cycles with big numeric arrays, and stores into them
+local clock = os.clock
+local fmt = string.format
+local N, REPS = 1000000, 20
+
+local arrs = {}
+for j = 1, 8 do
+  local a = {}
+  for i = 1, N do a[i] = i + 0.5 end
+  arrs[j] = a
+end
+
+local function bench(name, reps, f)
+  local t0 = clock()
+  local s = 0
+  for r = 1, reps do s = s + f(r) end
+  print(fmt("%-8s %9.2f us", name, (clock() - t0) * 1e6 / reps))
+  return s
+end
+
+local function gc()
+  collectgarbage("collect")
+  return 0
+end
+
+local function store(r)
+  local s = 0
+  for j = 1, #arrs do
+    local a = arrs[j]
+    for i = 1, N, 4 do a[i] = i + r; s = s + a[i] end
+  end
+  return s
+end
+
+bench("gc", REPS, gc)
+bench("store", REPS, store)
+bench("gc", REPS, gc)
+
+-- Arrays which got a collectable value must keep it alive.
+for j = 1, #arrs, 2 do arrs[j][N/2] = { j } end
+bench("gc/mixed", REPS, gc)
+for j = 1, #arrs, 2 do
+  assert(arrs[j][N/2][1] == j)
+  arrs[j][N/2] = j
+end
+bench("gc", REPS, gc)
+for j = 1, #arrs do
+  local a = arrs[j]
+  assert(a[N] == N + 0.5 and a[1] == 1 + REPS and a[2] == 2.5)
+end
+
+-- Stores through __newindex to a table, into existing and nil slots.
+local t = {}
+for i = 1, 100 do t[i] = i + 0.5 end
+t[50] = nil
+collectgarbage()
+local p = setmetatable({}, { __newindex = t })
+for i = 1, 100 do p[i] = { i } end
+collectgarbage()
+local junk = {}
+for i = 1, 1000 do junk[i] = { -i } end
+for i = 1, 100 do assert(t[i][1] == i) end
@@ -0,0 +1,18 @@
+-- benchmark number to string conversion
+local clock = os.clock
+local fmt = string.format
+local nums = {}
+math.randomseed(42)
+for i = 1, 1000 do nums[i] = math.random() * 10^math.random(-20, 20) end
+local function bench(name, f)
+  local t0, n = clock(), 0
+  for k = 1, 1000 do for i = 1, #nums do n = n + #f(nums[i]) end end
+  print(string.format("%-10s %7.1f ns", name, (clock() - t0) * 1e9 / (1000 * #nums)))
+  assert(n > 0)
+end
+bench("tostring", tostring)
+bench("concat", function(x) return x .. "" end)
+bench("g14", function(x) return fmt("%.14g", x) end)
+bench("g17", function(x) return fmt("%.17g", x) end)
+bench("r", function(x) return fmt("%r", x) end)
+bench("short", function(x) return tostring(x * 1e3 - x * 1e3 % 1) end)
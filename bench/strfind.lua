@@ -0,0 +1,14 @@
+-- benchmark plain string.find with rare and frequent first chars
+
+local find, rep, clock = string.find, string.rep, os.clock
+
+local function bench(name, s, p, N)
+  local t0 = clock()
+  for i = 1, N do assert(find(s, p, i % 7 + 1, true)) end
+  print(string.format("%-10s %8.1f us", name, (clock() - t0) * 1e6 / N))
+end
+
+local line = "2016-01-01 12:00:00 INFO request served in 12 ms\n"
+bench("log", rep(line, 20000) .. "ERROR x", "ERROR", 200)
+bench("spaces", rep("a ", 500000) .. " b", "  b", 200)
+bench("delims", rep(";;;;;;;:", 100000) .. ";x", ";x", 200)
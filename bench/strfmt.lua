@@ -0,0 +1,17 @@
+-- benchmark string.format with non-string arguments
+local clock = os.clock
+local fmt = string.format
+local t, f = {}, function() end
+local function bench(name, g)
+  local t0 = clock()
+  local n = 0
+  for i = 1, 1000000 do n = n + #g(i) end
+  print(string.format("%-10s %7.1f ns", name, (clock() - t0) * 1e3))
+  assert(n > 0)
+end
+bench("int", function(i) return fmt("%s", i) end)
+bench("num", function(i) return fmt("%s", i + 0.5) end)
+bench("bool", function(i) return fmt("x=%s", i % 2 == 0) end)
+bench("table", function(i) return fmt("%s", t) end)
+bench("func", function(i) return fmt("%s", f) end)
+bench("ptr", function(i) return fmt("%p", t) end)
@@ -0,0 +1,25 @@
+-- benchmark compiled gsub and gmatch loops
+-- compare with -joff, or with an older build which stitches around them
+local clock = os.clock
+local line = "GET /index.html?user=alice&lang=en HTTP/1.1 200 5120"
+local escapes = { ["&"] = "&amp;", ["<"] = "&lt;", [">"] = "&gt;", ['"'] = "&quot;" }
+local N = 200000
+local function bench(name, f)
+  local t0 = clock()
+  local x = 0
+  for i = 1, N do x = x + f(line) end
+  print(string.format("%-10s %7.1f ns", name, (clock() - t0) * 1e9 / N))
+end
+bench("gsubstr", function(s) local r, n = s:gsub("%s+", "_") return n end)
+bench("gsubcap", function(s) return #s:gsub("(%w+)=(%w+)", "%2:%1") end)
+bench("gsubtab", function(s) return #s:gsub('[&<>"]', escapes) end)
+bench("gmatch", function(s)
+  local n = 0
+  for k, v in s:gmatch("(%w+)=(%w+)") do n = n + #k + #v end
+  return n
+end)
+bench("words", function(s)
+  local n = 0
+  for w in s:gmatch("%S+") do n = n + 1 end
+  return n
+end)
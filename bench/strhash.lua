@@ -0,0 +1,38 @@
+-- benchmark string interning and hash flooding
+-- compare a default build against one with -DLUAJIT_SECURE_STRHASH
+
+local clock, sub, rep, char = os.clock, string.sub, string.rep, string.char
+
+-- interning new strings of typical key lengths
+local N = 2000000
+for _, len in ipairs{4, 8, 16, 32, 64, 256} do
+  local base = rep("abcdefghijklmnopqrstuvwxyz0123456789", 8)
+  local src, keep = sub(base, 1, len - 2), {}
+  local t0 = clock()
+  for i = 1, N do
+    keep[i % 4096] = src .. char(i % 64 + 32, i / 64 % 64 + 32)  -- new string
+  end
+  local t1 = clock()
+  for i = 1, N do
+    keep[i % 4096] = sub(base, 1 + i % 16, len + i % 16)  -- existing string
+  end
+  local t2 = clock()
+  print(string.format("len %4d  new %6.1f ns  existing %6.1f ns", len,
+    (t1 - t0) * 1e9 / N, (t2 - t1) * 1e9 / N))
+end
+
+-- keys which only differ outside the words sampled by the default hash
+local function flood(n)
+  local t, fill = {}, rep("x", 32)
+  local t0 = clock()
+  for i = 1, n do
+    local v = string.format("%06d", i)
+    local k = sub(fill, 1, 4) .. sub(v, 1, 3) .. sub(fill, 1, 11) ..
+	      sub(v, 4, 6) .. sub(fill, 1, 11)
+    t[k] = i
+  end
+  return clock() - t0
+end
+for _, n in ipairs{5000, 10000, 20000} do
+  print(string.format("flood %6d keys  %.3f s", n, flood(n)))
+end
@@ -0,0 +1,17 @@
+-- benchmark Lua patterns typical for log parsing
+local clock = os.clock
+local line = "2016-01-01 12:00:00 [worker-7] INFO request /api/v1/items?id=42 served in 12 ms status=200"
+local lines = {}
+for i = 1, 1000 do lines[i] = line:gsub("42", tostring(i)) end
+local function bench(name, f)
+  local t0 = clock()
+  for k = 1, 100 do for i = 1, #lines do f(lines[i]) end end
+  print(string.format("%-10s %7.1f ns", name, (clock() - t0) * 1e9 / (100 * #lines)))
+end
+bench("match", function(s) return s:match("status=(%d+)") end)
+bench("date", function(s) return s:match("^(%d+)%-(%d+)%-(%d+)") end)
+bench("find", function(s) return s:find("[%[%]]") end)
+bench("word", function(s) return s:match("%[([%w%-]+)%]") end)
+bench("gmatch", function(s) local n = 0 for w in s:gmatch("%a+") do n = n + 1 end return n end)
+bench("gsub", function(s) return s:gsub("%d", "#") end)
+bench("gsubkv", function(s) return s:gsub("(%w+)=(%w+)", "%2=%1") end)
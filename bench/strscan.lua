@@ -0,0 +1,53 @@
+-- benchmark string to number conversion
+local clock = os.clock
+local fmt = string.format
+-- Hard cases first: halfway points, denormals and range limits.
+local hard = {
+  { "0.1", "0x1.999999999999ap-4" },
+  { "3.14159", "0x1.921f9f01b866ep+1" },
+  { "1e23", "0x1.52d02c7e14af6p+76" },
+  { "8.98846567431158e307", "0x1p+1023" },
+  { "9007199254740993", "0x1p+53" },
+  { "9007199254740992.5", "0x1p+53" },
+  { "9007199254740995", "0x1.0000000000002p+53" },
+  { "123456789012345678e-5", "0x1.1f71fb04cb74fp+40" },
+  { "2.2250738585072011e-308", "0x0.fffffffffffffp-1022" },
+  { "2.2250738585072014e-308", "0x1p-1022" },
+  { "4.35679828e-309", "0x0.3220410e967a7p-1022" },
+  { "4.9406564584124654e-324", "0x0.0000000000001p-1022" },
+  { "2.4703282292062327e-324", "0" },
+  { "2.4703282292062328e-324", "0x0.0000000000001p-1022" },
+  { "1.7976931348623157e308", "0x1.fffffffffffffp+1023" },
+  { "1.7976931348623158e308", "0x1.fffffffffffffp+1023" },
+  { "1e-350", "0" },
+}
+for _, c in ipairs(hard) do
+  assert(tonumber(c[1]) == tonumber(c[2]), c[1])
+  assert(tonumber("-"..c[1]) == -tonumber(c[2]), c[1])
+end
+assert(tonumber("1e310") == math.huge)
+math.randomseed(1)
+for i = 1, 100000 do
+  local x = math.random() * 2^math.random(-1074, 1023)
+  assert(tonumber(fmt("%.17g", x)) == x)
+end
+
+local sets = { short = {}, g14 = {}, g17 = {}, exp = {} }
+math.randomseed(42)
+for i = 1, 1000 do
+  local x = math.random() * 10^math.random(-20, 20)
+  sets.short[i] = fmt("%.3f", math.random() * 1000)
+  sets.g14[i] = fmt("%.14g", x)
+  sets.g17[i] = fmt("%.17g", x)
+  sets.exp[i] = fmt("%.6e", math.random() * 10^math.random(-300, 300))
+end
+local function bench(name, t)
+  local t0, n = clock(), 0
+  for k = 1, 1000 do for i = 1, #t do n = n + tonumber(t[i]) end end
+  print(fmt("%-10s %7.1f ns", name, (clock() - t0) * 1e9 / (1000 * #t)))
+  assert(n == n)
+end
+bench("short", sets.short)
+bench("g14", sets.g14)
+bench("g17", sets.g17)
+bench("exp", sets.exp)
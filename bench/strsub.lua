@@ -0,0 +1,15 @@
+-- benchmark tokenizer-style string.sub of single characters
+
+local function count(s)
+  local n, w = 0, 0
+  for i = 1, #s do
+    local c = s:sub(i, i)  -- only escapes into snapshots
+    if c == " " then w = w + 1 elseif c == "x" then n = n + 1 end
+  end
+  return n, w
+end
+
+local s, N = string.rep("ab x cdx ", 100000), 20
+local t0 = os.clock()
+for k = 1, N do local n, w = count(s); assert(n == 200000 and w == 300000) end
+print(string.format("%.1f ns/char", (os.clock() - t0) * 1e9 / (N * #s)))
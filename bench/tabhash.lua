@@ -0,0 +1,77 @@
+-- benchmark hash part lookups, hits and misses, with string and object keys
+local clock = os.clock
+local fmt = string.format
+local N, BIG = 1000, 1000000
+
+local keys, miss, objs = {}, {}, {}
+for i = 1, BIG do keys[i] = "key"..i end
+for i = 1, N do
+  miss[i] = "nokey"..i
+  objs[i] = {}
+end
+
+local function fill(n)
+  local t = {}
+  for i = 1, n do t[keys[i]] = i end
+  for i = 1, math.min(n, N) do t[objs[i]] = i end
+  -- Leave some dead keys behind.
+  for i = 1, n, 7 do t[keys[i]] = nil; t[keys[i]] = i end
+  return t
+end
+
+local function bench(name, n, f, arg)
+  local t = fill(n)
+  local t0, s = clock(), 0
+  local reps = 2e7 / N
+  for r = 1, reps do s = s + f(t, arg) end
+  print(fmt("%-8s %7d %7.2f ns", name, n, (clock() - t0) * 1e9 / (reps * N)))
+  return s
+end
+
+local function hit(t)
+  local s = 0
+  for i = 1, N do s = s + t[keys[i]] end
+  return s
+end
+
+local function nothit(t)
+  local s = 0
+  for i = 1, N do if t[miss[i]] == nil then s = s + 1 end end
+  return s
+end
+
+local function obj(t)
+  local s = 0
+  for i = 1, N do s = s + t[objs[i]] end
+  return s
+end
+
+local function field(t)
+  local s = 0
+  for i = 1, N do s = s + t.key1 + t.key500 + (t.nokey or 0) end
+  return s
+end
+
+-- Random keys out of a big table: dominated by cache misses.
+local rkeys, ro = {}, 0
+math.randomseed(1)
+for i = 1, BIG do rkeys[i] = math.random(BIG) end
+local function random(t, n)
+  local s = 0
+  for i = ro + 1, ro + N do s = s + t[keys[rkeys[i] % n + 1]] end
+  ro = (ro + N) % BIG
+  return s
+end
+
+assert(bench("hit", N, hit) == 2e7 / N * N * (N + 1) / 2)
+assert(bench("miss", N, nothit) == 2e7)
+bench("miss", 15, nothit)
+assert(bench("object", N, obj) == 2e7 / N * N * (N + 1) / 2)
+bench("field", N, field)
+bench("random", 10000, random, 10000)
+bench("random", 100000, random, 100000)
+bench("random", BIG, random, BIG)
+
+local t0 = clock()
+for r = 1, 200 do fill(N) end
+print(fmt("%-8s %7d %7.2f ns", "insert", N, (clock() - t0) * 1e9 / (200 * 2 * N)))
@@ -0,0 +1,46 @@
+-- benchmark field access on records built by the same table constructor
+local clock = os.clock
+local fmt = string.format
+local N, REPS = 1000, 20000
+
+local function point(x, y, z)
+  return { x = x, y = y, z = z, w = 0, name = "p" }
+end
+
+local pts = {}
+for i = 1, N do pts[i] = point(i, 2*i, 3*i) end
+
+local function bench(name, f)
+  local t0, s = clock(), 0
+  for r = 1, REPS do s = s + f() end
+  print(fmt("%-8s %7.2f ns", name, (clock() - t0) * 1e9 / (REPS * N)))
+  return s
+end
+
+local function sum()
+  local s = 0
+  for i = 1, N do local p = pts[i]; s = s + p.x + p.y + p.z + p.w end
+  return s
+end
+
+local function update()
+  for i = 1, N do local p = pts[i]; p.w = p.x + p.y end
+  return 0
+end
+
+local function create()
+  local s = 0
+  for i = 1, N do local p = point(i, i, i); s = s + p.x + p.z end
+  return s
+end
+
+assert(bench("sum", sum) == REPS * 6 * N * (N + 1) / 2)
+bench("update", update)
+assert(sum() == 9 * N * (N + 1) / 2)
+assert(bench("create", create) == REPS * N * (N + 1))
+
+-- Records which grew a new key or lost their layout must still work.
+for i = 1, N, 3 do pts[i].extra = i end
+for i = 2, N, 3 do pts[i] = { y = 2*i, x = i, z = 3*i, w = 3*i } end
+for i = 3, N, 3 do pts[i].x = nil; pts[i].x = i end
+assert(sum() == 9 * N * (N + 1) / 2)
@@ -0,0 +1,22 @@
+-- benchmark closing upvalues of closures created and returned in loops
+local clock = os.clock
+local fmt = string.format
+local N, REPS = 300, 20000
+
+local function make()
+  local ws = {}
+  for i = 1, N do
+    local function g(a) local n = a; return function() return n + i end end
+    ws[i] = g(1)
+  end
+  return ws
+end
+
+local t0, s = clock(), 0
+for r = 1, REPS do
+  local ws = make()
+  -- The array grows at 65, 129 and 257, which exits the trace after UCLO.
+  for i = 1, N do s = s + ws[i]() - i - 1 end
+end
+print(fmt("%-8s %7.2f ns", "uclo", (clock() - t0) * 1e9 / (REPS * N)))
+assert(s == 0)
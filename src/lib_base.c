@@ -21,6 +21,7 @@
 #include "lj_debug.h"
 #include "lj_str.h"
 #include "lj_tab.h"
+#include "lj_func.h"
 #include "lj_meta.h"
 #include "lj_state.h"
 #if LJ_HASFFI
@@ -129,11 +130,8 @@ LJLIB_ASM(setmetatable)		LJLIB_REC(.)
   if (!tvisnil(lj_meta_lookup(L, L->base, MM_metatable)))
     lj_err_caller(L, LJ_ERR_PROTMT);
   setgcref(t->metatable, obj2gco(mt));
-  if (mt) { 
-#if !LJ_51
-    if (lj_meta_fast(L, mt, MM_gc))
-      lj_gc_tab_finalized(L, (GCobj*)t);
-#endif
+  if (mt) {
+    lj_gc_checkfinalizer(L, t);
     lj_gc_objbarriert(L, t, mt);
   }
   settabV(L, L->base-1-LJ_FR2, t);
@@ -152,7 +150,10 @@ LJLIB_CF(getfenv)		LJLIB_REC(.)
     if (LJ_FR2) o--;
   }
   fn = &gcval(o)->fn;
-  settabV(L, L->top++, isluafunc(fn) ? tabref(fn->l.env) : tabref(L->env));
+  if (isluafunc(fn))
+    copyTV(L, L->top++, funcenv(fn));
+  else
+    settabV(L, L->top++, tabref(L->env));
   return 1;
 }
 
@@ -176,8 +177,7 @@ LJLIB_CF(setfenv)
   fn = &gcval(o)->fn;
   if (!isluafunc(fn))
     lj_err_caller(L, LJ_ERR_SETFENV);
-  setgcref(fn->l.env, obj2gco(t));
-  lj_gc_objbarrier(L, obj2gco(fn), t);
+  lj_func_setenv(L, fn, t);
   setfuncV(L, L->top++, fn);
   return 1;
 }
@@ -451,8 +451,20 @@ LJLIB_CF(gcinfo)
 LJLIB_CF(collectgarbage)
 {
   int opt = lj_lib_checkopt(L, 1, LUA_GCCOLLECT,  /* ORDER LUA_GC* */
-    "\4stop\7restart\7collect\5count\1\377\4step\10setpause\12setstepmul\1\377\11isrunning");
-  int32_t data = lj_lib_optint(L, 2, 0);
+    "\4stop\7restart\7collect\5count\1\377\4step\10setpause\12setstepmul"
+    "\13setmajorinc\11isrunning\14generational\13incremental\1\377"
+    "\10maxpause");
+  int32_t data;
+  if (opt == LUA_GCSTEP && L->base+1 < L->top && tvistab(L->base+1)) {
+    /* Time-budgeted step: collectgarbage("step", {usec = n}). */
+    cTValue *tv = lj_tab_getstr(tabV(L->base+1), lj_str_newlit(L, "usec"));
+    if (!tv || !tvisnumber(tv))
+      lj_err_arg(L, 2, LJ_ERR_INVOPT);
+    opt = LUA_GCSTEPUSEC;
+    data = lj_num2int(numberVnum(tv));
+  } else {
+    data = lj_lib_optint(L, 2, 0);
+  }
   if (opt == LUA_GCCOUNT) {
     int kb = lua_gc(L, opt, data);
     int kleft = lua_gc(L, LUA_GCCOUNTB, 0);
@@ -461,7 +473,7 @@ LJLIB_CF(collectgarbage)
     return 2;
   } else {
     int res = lua_gc(L, opt, data);
-    if (opt == LUA_GCSTEP || opt == LUA_GCISRUNNING)
+    if (opt == LUA_GCSTEP || opt == LUA_GCSTEPUSEC || opt == LUA_GCISRUNNING)
       setboolV(L->top, res);
     else
       setintV(L->top, res);
@@ -251,6 +251,8 @@ LJLIB_CF(debug_upvaluejoin)
       lj_err_arg(L, 2*i+2, LJ_ERR_IDXRNG);
     p[i] = &fn[i]->l.uvptr[n];
   }
+  if (gcref(*p[0]) == gcref(fn[0]->l.env))  /* Joining _ENV: move env cell. */
+    setgcrefr(fn[0]->l.env, *p[1]);
   setgcrefr(*p[0], *p[1]);
   lj_gc_objbarrier(L, fn[0], gcref(*p[1]));
   return 0;
@@ -142,6 +142,15 @@ static int io_file_readnum(lua_State *L, FILE *fp)
   }
 }
 
+/* Push the first n bytes of the temporary buffer as a string. */
+static void io_file_pushbuf(lua_State *L, char *buf, MSize n)
+{
+  SBuf *sb = &G(L)->tmpbuf;
+  setsbufP(sb, buf+n);
+  setstrV(L, L->top++, lj_buf_str(L, sb));
+  lj_gc_check(L);
+}
+
 static int io_file_readline(lua_State *L, FILE *fp, MSize chop)
 {
   MSize m = LUAL_BUFFERSIZE, n = 0, ok = 0;
@@ -154,8 +163,7 @@ static int io_file_readline(lua_State *L, FILE *fp, MSize chop)
     if (n && buf[n-1] == '\n') { n -= chop; break; }
     if (n >= m - 64) m += m;
   }
-  setstrV(L, L->top++, lj_str_new(L, buf, (size_t)n));
-  lj_gc_check(L);
+  io_file_pushbuf(L, buf, n);
   return (int)ok;
 }
 
@@ -166,8 +174,7 @@ static void io_file_readall(lua_State *L, FILE *fp)
     char *buf = lj_buf_tmp(L, m);
     n += (MSize)fread(buf+n, 1, m-n, fp);
     if (n != m) {
-      setstrV(L, L->top++, lj_str_new(L, buf, (size_t)n));
-      lj_gc_check(L);
+      io_file_pushbuf(L, buf, n);
       return;
     }
   }
@@ -178,8 +185,7 @@ static int io_file_readlen(lua_State *L, FILE *fp, MSize m)
   if (m) {
     char *buf = lj_buf_tmp(L, m);
     MSize n = (MSize)fread(buf, 1, m, fp);
-    setstrV(L, L->top++, lj_str_new(L, buf, (size_t)n));
-    lj_gc_check(L);
+    io_file_pushbuf(L, buf, n);
     return (n > 0 || m == 0);
   } else {
     int c = getc(fp);
@@ -22,6 +22,7 @@
 #include "lj_buf.h"
 #include "lj_str.h"
 #include "lj_tab.h"
+#include "lj_func.h"
 #include "lj_meta.h"
 #include "lj_state.h"
 #include "lj_ff.h"
@@ -143,11 +144,24 @@ LJLIB_CF(string_dump)
 
 #define L_ESC		'%'
 
+/* Throw a pattern error. A call from a trace only flags it and makes all
+** pending match() calls fail. The trace exits and the interpreter throws.
+*/
+static void match_error(MatchState *ms, ErrMsg em)
+{
+  if (!ms->errdefer)
+    lj_err_caller(ms->L, em);
+  ms->errdefer = 2;
+  ms->backtracks = LJ_MAX_MSBT;
+}
+
 static int check_capture(MatchState *ms, int l)
 {
   l -= '1';
-  if (l < 0 || l >= ms->level || ms->capture[l].len == CAP_UNFINISHED)
-    lj_err_caller(ms->L, LJ_ERR_STRCAPI);
+  if (l < 0 || l >= ms->level || ms->capture[l].len == CAP_UNFINISHED) {
+    match_error(ms, LJ_ERR_STRCAPI);
+    return -1;
+  }
   return l;
 }
 
@@ -156,22 +170,26 @@ static int capture_to_close(MatchState *ms)
   int level = ms->level;
   for (level--; level>=0; level--)
     if (ms->capture[level].len == CAP_UNFINISHED) return level;
-  lj_err_caller(ms->L, LJ_ERR_STRPATC);
-  return 0;  /* unreachable */
+  match_error(ms, LJ_ERR_STRPATC);
+  return -1;
 }
 
 static const char *classend(MatchState *ms, const char *p)
 {
   switch (*p++) {
   case L_ESC:
-    if (p == ms->p_end)
-      lj_err_caller(ms->L, LJ_ERR_STRPATE);
+    if (p == ms->p_end) {
+      match_error(ms, LJ_ERR_STRPATE);
+      return p;
+    }
     return p+1;
   case '[':
     if (*p == '^') p++;
     do {  /* look for a `]' */
-      if (p == ms->p_end)
-	lj_err_caller(ms->L, LJ_ERR_STRPATM);
+      if (p == ms->p_end) {
+	match_error(ms, LJ_ERR_STRPATM);
+	return p;
+      }
       if (*(p++) == L_ESC && p < ms->p_end)
 	p++;  /* skip escapes (e.g. `%]') */
     } while (*p != ']');
@@ -224,6 +242,151 @@ static int matchbracketclass(int c, const char *p, const char *ec)
   return !sig;
 }
 
+/* -- Compiled patterns --------------------------------------------------- */
+
+#define pat_test(set, c)	(((set)[(c) >> 5] >> ((c) & 31)) & 1)
+
+/* End of a class at p or NULL if it's malformed. */
+static const char *pat_classend(const char *p, const char *pe)
+{
+  if (*p++ == L_ESC)
+    return p < pe ? p+1 : NULL;
+  if (p < pe && *p == '^') p++;
+  do {  /* Same as classend(). */
+    if (p >= pe) return NULL;
+    if (*p++ == L_ESC && p < pe) p++;
+  } while (p >= pe || *p != ']');
+  return p+1;
+}
+
+/* Build the bitmap for a '%x' or '[...]' class. */
+static void pat_classmap(uint32_t *set, const char *p, const char *ep)
+{
+  int c;
+  memset(set, 0, 8*sizeof(uint32_t));
+  for (c = 0; c < 256; c++)
+    if (*p == '[' ? matchbracketclass(c, p, ep-1) : match_class(c, uchar(p[1])))
+      set[c >> 5] |= 1u << (c & 31);
+}
+
+/* Compile a pattern. Stops at malformed parts and leaves them to match(). */
+static void pat_compile(PatCache *pc, const char *p, MSize len)
+{
+  const char *p0 = p, *pe = p + len, *ep;
+  int ncls = 0, item = 0;
+  memcpy(pc->pat, p, len);
+  memset(pc->idx, 0, sizeof(pc->idx));
+  pc->len = len;
+  pc->firstc = -1;
+  pc->first = 0;
+  pc->anchor = (*p == '^');
+  p += pc->anchor;
+  while (p < pe) {
+    int isfirst = !item++;
+    switch (*p) {
+    case '(':
+      p += (p+1 < pe && p[1] == ')') ? 2 : 1;
+      item--;  /* Captures don't consume chars. */
+      continue;
+    case ')': case '.':
+      p++;
+      continue;
+    case '$':
+      if (p+1 == pe) return;
+      ep = p+1;
+      break;
+    case L_ESC:
+      if (p+1 >= pe) return;
+      if (p[1] == 'b') {
+	if (p+4 > pe) return;
+	if (isfirst) { pc->firstc = uchar(p[2]); pc->first = 1; }
+	p += 4;
+	continue;
+      } else if (p[1] == 'f') {
+	p += 2;
+	isfirst = 0;
+	if (p >= pe || *p != '[') return;
+      } else if (lj_char_isdigit(uchar(p[1]))) {
+	p += 2;
+	continue;
+      }
+      /* fallthrough */
+    case '[':
+      if (!(ep = pat_classend(p, pe))) return;
+      if (ncls < PAT_MAXCLS) {
+	pat_classmap(pc->cls[ncls], p, ep);
+	pc->idx[p - p0] = (uint8_t)++ncls;
+	if (isfirst && !(ep < pe && (*ep == '*' || *ep == '?' || *ep == '-'))) {
+	  memcpy(pc->firstset, pc->cls[ncls-1], sizeof(pc->firstset));
+	  pc->first = 1;
+	}
+      }
+      p = ep;
+      continue;
+    default:
+      ep = p+1;
+      break;
+    }
+    /* Single literal char. */
+    if (isfirst && !(ep < pe && (*ep == '*' || *ep == '?' || *ep == '-'))) {
+      pc->firstc = uchar(*p);
+      pc->first = 1;
+    }
+    p = ep;
+  }
+}
+
+/* Get the compiled pattern for a pattern string. */
+static const PatCache *pat_get(lua_State *L, GCstr *ps)
+{
+  global_State *g = G(L);
+  PatCache *pc = mref(g->patcache, PatCache);
+  MSize len = ps->len;
+  if (len == 0 || len > PAT_MAXLEN)
+    return NULL;
+  if (LJ_UNLIKELY(!pc)) {
+    pc = lj_mem_newvec(L, PAT_CACHE, PatCache);
+    memset(pc, 0, PAT_CACHE*sizeof(PatCache));
+    setmref(g->patcache, pc);
+  }
+  pc += ps->hash & (PAT_CACHE-1);
+  if (pc->len != len || memcmp(pc->pat, strdata(ps), len))
+    pat_compile(pc, strdata(ps), len);
+  return pc;
+}
+
+/* Skip to the first position where a match may start or past the end. */
+static const char *pat_skip(const PatCache *pc, const char *s, const char *e)
+{
+  if (pc->firstc >= 0) {
+    s = (const char *)memchr(s, pc->firstc, (size_t)(e - s));
+    return s ? s : e+1;
+  }
+  for (; s < e; s++)
+    if (pat_test(pc->firstset, uchar(*s)))
+      return s;
+  return e+1;
+}
+
+/* Set up the match state for a pattern. */
+static void pat_init(MatchState *ms, lua_State *L, GCstr *ps)
+{
+  ms->L = L;
+  ms->pc = pat_get(L, ps);
+  ms->p_init = strdata(ps);
+  ms->errdefer = 0;
+}
+
+/* Match a char against the class at p. Uses its bitmap, if compiled. */
+static int classmatch(MatchState *ms, int c, const char *p, const char *ep)
+{
+  const PatCache *pc = ms->pc;
+  int k = pc ? pc->idx[p - ms->p_init] : 0;
+  if (k) return pat_test(pc->cls[k-1], c);
+  if (*p == '[') return matchbracketclass(c, p, ep-1);
+  return match_class(c, uchar(*(p+1)));
+}
+
 static int singlematch(MatchState *ms, const char *s, const char *p, const char *ep)
 {
   int c = uchar(*s);
@@ -231,8 +394,7 @@ static int singlematch(MatchState *ms, const char *s, const char *p, const char
     return 0;
   switch (*p) {
   case '.': return 1;  /* matches any char */
-  case L_ESC: return match_class(c, uchar(*(p+1)));
-  case '[': return matchbracketclass(c, p, ep-1);
+  case L_ESC: case '[': return classmatch(ms, c, p, ep);
   default:  return (uchar(*p) == c);
   }
 }
@@ -241,8 +403,12 @@ static const char *match(MatchState *ms, const char *s, const char *p);
 
 static const char *matchbalance(MatchState *ms, const char *s, const char *p)
 {
-  if (p >= ms->p_end - 1)
-    lj_err_callerv(ms->L, LJ_ERR_STRPATPB);
+  if (p >= ms->p_end - 1) {
+    if (!ms->errdefer)  /* Needs formatting for the escaped '%'. */
+      lj_err_callerv(ms->L, LJ_ERR_STRPATPB);
+    match_error(ms, LJ_ERR_STRPATPB);
+    return NULL;
+  }
   if (*s != *p) {
     return NULL;
   } else {
@@ -294,7 +460,10 @@ static const char *start_capture(MatchState *ms, const char *s,
 {
   const char *res;
   int level = ms->level;
-  if (level >= LUA_MAXCAPTURES) lj_err_caller(ms->L, LJ_ERR_STRCAPN);
+  if (level >= LUA_MAXCAPTURES) {
+    match_error(ms, LJ_ERR_STRCAPN);
+    return NULL;
+  }
   setmref(ms->capture[level].init, s);
   ms->capture[level].len = what;
   ms->level = level+1;
@@ -310,6 +479,7 @@ static const char *end_capture(MatchState *ms, const char *s,
 {
   int l = capture_to_close(ms);
   const char *res;
+  if (l < 0) return NULL;
   ms->capture[l].len = s - mref(ms->capture[l].init, char);  /* close capture */
   if ((res = match(ms, s, p)) == NULL)  /* match failed? */
     ms->capture[l].len = CAP_UNFINISHED;  /* undo capture */
@@ -320,6 +490,7 @@ static const char *match_capture(MatchState *ms, const char *s, int l)
 {
   size_t len;
   l = check_capture(ms, l);
+  if (l < 0) return NULL;
   len = (size_t)ms->capture[l].len;
   if ((size_t)(ms->src_end-s) >= len &&
       memcmp(mref(ms->capture[l].init, char), s, len) == 0)
@@ -330,8 +501,10 @@ static const char *match_capture(MatchState *ms, const char *s, int l)
 
 static const char *match(MatchState *ms, const char *s, const char *p)
 {
-  if (++ms->depth > LJ_MAX_XLEVEL || ++ms->backtracks > LJ_MAX_MSBT)
-    lj_err_caller(ms->L, LJ_ERR_STRPATX);
+  if (++ms->depth > LJ_MAX_XLEVEL || ++ms->backtracks > LJ_MAX_MSBT) {
+    match_error(ms, LJ_ERR_STRPATX);
+    return NULL;
+  }
   init: /* using goto's to optimize tail recursion */
   if (p != ms->p_end) switch (*p) {
   case '(':  /* start capture */
@@ -353,12 +526,14 @@ static const char *match(MatchState *ms, const char *s, const char *p)
     case 'f': {  /* frontier? */
       const char *ep; char previous;
       p += 2;
-      if (*p != '[')
-	lj_err_caller(ms->L, LJ_ERR_STRPATB);
+      if (*p != '[') {
+	match_error(ms, LJ_ERR_STRPATB);
+	s = NULL; break;
+      }
       ep = classend(ms, p);  /* points to what is next */
       previous = (s == ms->src_init) ? '\0' : *(s-1);
-      if (matchbracketclass(uchar(previous), p, ep-1) ||
-	 !matchbracketclass(uchar(*s), p, ep-1)) { s = NULL; break; }
+      if (classmatch(ms, uchar(previous), p, ep) ||
+	 !classmatch(ms, uchar(*s), p, ep)) { s = NULL; break; }
       p=ep;
       goto init;  /* else s = match(ms, s, ep); */
       }
@@ -441,10 +616,14 @@ static int push_captures(MatchState *ms, const char *s, const char *e)
   return nlevels;  /* number of strings pushed */
 }
 
-MatchState * ljx_str_match(lua_State *L, const char *s, const char *p,
-		MSize slen, MSize plen, int32_t start)
+/* Match called from a trace. Errors are deferred and return fail, which
+** is chosen by the recorder to make the guard on the result fail.
+*/
+MatchState * ljx_str_match(lua_State *L, const char *s, GCstr *pat,
+		MSize slen, int32_t start, MatchState *fail)
 {
   MatchState *ms = &G(L)->ms;
+  const char *p = strdata(pat);
   int anchor = 0;
   MSize st;
   const char *sstr;
@@ -455,14 +634,20 @@ MatchState * ljx_str_match(lua_State *L, const char *s, const char *p,
     return NULL;
   sstr = s + start;
   if (*p == '^') { p++; anchor = 1; }
-  ms->L = L;
+  pat_init(ms, L, pat);
+  ms->errdefer = 1;
   ms->src_init = s;
   ms->src_end = s + slen;
-  ms->p_end = p + plen - anchor;
+  ms->p_end = p + pat->len - anchor;
   do {  /* Loop through string and try to match the pattern. */
     const char *q;
+    if (!anchor && ms->pc && ms->pc->first &&
+	(sstr = pat_skip(ms->pc, sstr, ms->src_end)) > ms->src_end)
+      break;
     ms->level = ms->depth = ms->backtracks = 0;
     q = match(ms, sstr, p);
+    if (LJ_UNLIKELY(ms->errdefer > 1))
+      return fail;
     if (q) {
       /* No capture - simulate one return capture. */
       lua_assert(sstr>=s);
@@ -511,12 +696,15 @@ static int str_find_aux(lua_State *L, int find)
     sstr = strdata(s) + st;
     anchor = 0;
     if (*pstr == '^') { pstr++; anchor = 1; }
-    ms.L = L;
+    pat_init(&ms, L, p);
     ms.src_init = strdata(s);
     ms.src_end = strdata(s) + s->len;
     ms.p_end = pstr + p->len - anchor;
     do {  /* Loop through string and try to match the pattern. */
       const char *q;
+      if (!anchor && ms.pc && ms.pc->first &&
+	  (sstr = pat_skip(ms.pc, sstr, ms.src_end)) > ms.src_end)
+	break;
       ms.level = ms.depth = ms.backtracks = 0;
       q = match(&ms, sstr, pstr);
       if (q) {
@@ -544,85 +732,255 @@ LJLIB_CF(string_match)		LJLIB_REC(string_findmatch 0)
   return str_find_aux(L, 0);
 }
 
-LJLIB_NOREG LJLIB_CF(string_gmatch_aux)
+/* Find the next match of a gmatch iterator. Returns its start or NULL. */
+static const char *gmatch_next(MatchState *ms, GCfuncC *fn, const char **ep)
 {
-  GCstr *pstr = strV(lj_lib_upvalue(L, 2));
-  GCstr *str = strV(lj_lib_upvalue(L, 1));
+  GCstr *str = strV(&fn->upvalue[0]);
   const char *s = strdata(str);
-  const char *p = strdata(pstr);
-  TValue *tvpos = lj_lib_upvalue(L, 3);
-  const char *src = s + tvpos->u32.lo;
-  MatchState ms;
-  ms.L = L;
-  ms.src_init = s;
-  ms.src_end = s + str->len;
-  ms.p_end = p + pstr->len;
-  for (; src <= ms.src_end; src++) {
+  const char *p = ms->p_init;
+  const char *src = s + fn->upvalue[2].u32.lo;
+  ms->src_init = s;
+  ms->src_end = s + str->len;
+  ms->p_end = p + strV(&fn->upvalue[1])->len;
+  for (; src <= ms->src_end; src++) {
     const char *e;
-    ms.level = ms.depth = ms.backtracks = 0;
-    if ((e = match(&ms, src, p)) != NULL) {
-      int32_t pos = (int32_t)(e - s);
-      if (e == src) pos++;  /* Ensure progress for empty match. */
-      tvpos->u32.lo = (uint32_t)pos;
-      return push_captures(&ms, src, e);
+    /* Note: a leading '^' is a plain char for gmatch. */
+    if (ms->pc && ms->pc->first && !ms->pc->anchor &&
+	(src = pat_skip(ms->pc, src, ms->src_end)) > ms->src_end)
+      break;
+    ms->level = ms->depth = ms->backtracks = 0;
+    e = match(ms, src, p);
+    if (LJ_UNLIKELY(ms->errdefer > 1))
+      break;
+    if (e) {
+      *ep = e;
+      return src;
     }
   }
+  return NULL;
+}
+
+/* Advance the position of a gmatch iterator past a match. */
+static void gmatch_setpos(GCfuncC *fn, const char *s, const char *src,
+			  const char *e)
+{
+  int32_t pos = (int32_t)(e - s);
+  if (e == src) pos++;  /* Ensure progress for empty match. */
+  fn->upvalue[2].u32.lo = (uint32_t)pos;
+}
+
+/* gmatch iterator called from a trace. Like ljx_str_match(), but the
+** pattern is checked, too. The position is only advanced if the result
+** doesn't make the guard fail.
+*/
+MatchState * ljx_str_gmatch(lua_State *L, GCfuncC *fn, GCstr *pat,
+			    MatchState *fail)
+{
+  MatchState *ms = &G(L)->ms;
+  const char *src, *e;
+  if (strV(&fn->upvalue[1]) != pat)  /* Trace specialized to another one? */
+    return fail;
+  pat_init(ms, L, pat);
+  ms->errdefer = 1;
+  src = gmatch_next(ms, fn, &e);
+  if (!src)
+    return ms->errdefer > 1 ? fail : NULL;
+  if (fail != ms)
+    gmatch_setpos(fn, ms->src_init, src, e);
+  if (!ms->level) {  /* No capture - simulate one return capture. */
+    setmref(ms->capture[0].init, src);
+    ms->capture[0].len = (MSize)(e - src);
+    ms->level = 1;
+  }
+  return ms;
+}
+
+LJLIB_NOREG LJLIB_CF(string_gmatch_aux)	LJLIB_REC(.)
+{
+  GCfuncC *fn = &curr_func(L)->c;
+  const char *src, *e;
+  MatchState ms;
+  pat_init(&ms, L, strV(&fn->upvalue[1]));
+  src = gmatch_next(&ms, fn, &e);
+  if (src) {
+    gmatch_setpos(fn, ms.src_init, src, e);
+    return push_captures(&ms, src, e);
+  }
   return 0;  /* not found */
 }
 
-LJLIB_CF(string_gmatch)
+/* Create a gmatch iterator. Also called from traces. */
+GCfunc *ljx_str_gmatch_new(lua_State *L, GCstr *str, GCstr *pat)
 {
-  lj_lib_checkstr(L, 1);
-  lj_lib_checkstr(L, 2);
-  L->top = L->base+3;
-  (L->top-1)->u64 = 0;
-  lj_lib_pushcc(L, lj_cf_string_gmatch_aux, FF_string_gmatch_aux, 3);
+  GCfunc *fn = lj_func_newC(L, 3, tabref(L->env));
+  fn->c.f = lj_cf_string_gmatch_aux;
+  fn->c.ffid = FF_string_gmatch_aux;
+  setmref(fn->c.pc, &G(L)->bc_cfunc_int);
+  /* NOBARRIER: The GCfunc is new (marked white). */
+  setstrV(L, &fn->c.upvalue[0], str);
+  setstrV(L, &fn->c.upvalue[1], pat);
+  fn->c.upvalue[2].u64 = 0;  /* Position. */
+  return fn;
+}
+
+LJLIB_CF(string_gmatch)		LJLIB_REC(.)
+{
+  GCstr *str = lj_lib_checkstr(L, 1);
+  GCstr *pat = lj_lib_checkstr(L, 2);
+  setfuncV(L, L->top++, ljx_str_gmatch_new(L, str, pat));
+  lj_gc_check(L);
   return 1;
 }
 
-static void add_s(MatchState *ms, luaL_Buffer *b, const char *s, const char *e)
+/* Get capture i of a match as a string or CAP_POSITION. 0 on error. */
+static int get_onecapture(MatchState *ms, int i, const char *s,
+			  const char *e, const char **cs, MSize *cl)
 {
-  size_t l, i;
-  const char *news = lua_tolstring(ms->L, 3, &l);
-  for (i = 0; i < l; i++) {
-    if (news[i] != L_ESC) {
-      luaL_addchar(b, news[i]);
-    } else {
+  if (i >= ms->level) {
+    if (i != 0) {
+      match_error(ms, LJ_ERR_STRCAPI);
+      return 0;
+    }
+    *cs = s;  /* whole match */
+    *cl = (MSize)(e - s);
+  } else {
+    *cs = mref(ms->capture[i].init, char);
+    *cl = ms->capture[i].len;
+    if (*cl == CAP_UNFINISHED) {
+      match_error(ms, LJ_ERR_STRCAPU);
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Append the replacement for a match from a string or a plain table. */
+static int gsub_put(MatchState *ms, SBuf *sb, GCobj *repl,
+		    const char *s, const char *e)
+{
+  const char *cs;
+  MSize cl;
+  if (repl->gch.gct == ~LJ_TSTR) {
+    const char *news = strdata(gco2str(repl));
+    MSize i, l = gco2str(repl)->len;
+    for (i = 0; i < l; i++) {
+      if (news[i] != L_ESC) {
+	lj_buf_putb(sb, news[i]);
+	continue;
+      }
       i++;  /* skip ESC */
       if (!lj_char_isdigit(uchar(news[i]))) {
-	luaL_addchar(b, news[i]);
+	lj_buf_putb(sb, news[i]);
+	continue;
       } else if (news[i] == '0') {
-	luaL_addlstring(b, s, (size_t)(e - s));
-      } else {
-	push_onecapture(ms, news[i] - '1', s, e);
-	luaL_addvalue(b);  /* add capture to accumulated result */
+	cs = s; cl = (MSize)(e - s);
+      } else if (!get_onecapture(ms, news[i] - '1', s, e, &cs, &cl)) {
+	return 0;
       }
+      if (cl == CAP_POSITION)
+	lj_strfmt_putint(sb, (int32_t)(cs - ms->src_init + 1));
+      else
+	lj_buf_putmem(sb, cs, cl);
+    }
+  } else {
+    lua_State *L = ms->L;
+    TValue key;
+    cTValue *tv;
+    lua_assert(!gcref(gco2tab(repl)->metatable));
+    if (!get_onecapture(ms, 0, s, e, &cs, &cl))
+      return 0;
+    if (cl == CAP_POSITION)
+      setintV(&key, (int32_t)(cs - ms->src_init + 1));
+    else
+      setstrV(L, &key, lj_str_new(L, cs, cl));
+    tv = lj_tab_get(L, gco2tab(repl), &key);
+    if (!tvistruecond(tv)) {
+      lj_buf_putmem(sb, s, (MSize)(e - s));  /* keep original text */
+    } else if (tvisstr(tv)) {
+      lj_buf_putmem(sb, strVdata(tv), strV(tv)->len);
+    } else if (tvisnumber(tv)) {
+      GCstr *str = lj_strfmt_number(L, tv);
+      lj_buf_putmem(sb, strdata(str), str->len);
+    } else {
+      if (!ms->errdefer)
+	lj_err_callerv(L, LJ_ERR_STRGSRV, lj_typename(tv));
+      ms->errdefer = 2;
+      return 0;
     }
   }
+  return 1;
 }
 
-static void add_value(MatchState *ms, luaL_Buffer *b,
-		      const char *s, const char *e)
+/* Substitute all matches with a string or a table without metatable.
+** Appends the result to sb. Returns the number of matches or -1 on error.
+*/
+static int32_t str_gsub(MatchState *ms, SBuf *sb, GCstr *str, GCstr *ps,
+			GCobj *repl, int32_t max_s)
 {
-  lua_State *L = ms->L;
-  switch (lua_type(L, 3)) {
-    case LUA_TNUMBER:
-    case LUA_TSTRING: {
-      add_s(ms, b, s, e);
-      return;
+  const char *src = strdata(str);
+  const char *p = strdata(ps);
+  int anchor = (*p == '^') ? (p++, 1) : 0;
+  int32_t n = 0;
+  ms->src_init = src;
+  ms->src_end = src + str->len;
+  ms->p_end = p + ps->len - anchor;
+  while (n < max_s) {
+    const char *e;
+    if (!anchor && ms->pc && ms->pc->first) {  /* Copy chars up to a match. */
+      const char *q = pat_skip(ms->pc, src, ms->src_end);
+      if (q > ms->src_end)
+	break;
+      lj_buf_putmem(sb, src, (MSize)(q - src));
+      src = q;
     }
-    case LUA_TFUNCTION: {
-      int n;
-      lua_pushvalue(L, 3);
-      n = push_captures(ms, s, e);
-      lua_call(L, n, 1);
-      break;
+    ms->level = ms->depth = ms->backtracks = 0;
+    e = match(ms, src, p);
+    if (LJ_UNLIKELY(ms->errdefer > 1))
+      return -1;
+    if (e) {
+      n++;
+      if (!gsub_put(ms, sb, repl, src, e))
+	return -1;
     }
-    case LUA_TTABLE: {
-      push_onecapture(ms, 0, s, e);
-      lua_gettable(L, 3);
+    if (e && e>src) /* non empty match? */
+      src = e;  /* skip it */
+    else if (src < ms->src_end)
+      lj_buf_putb(sb, *src++);
+    else
+      break;
+    if (anchor)
       break;
-    }
+  }
+  lj_buf_putmem(sb, src, (MSize)(ms->src_end - src));
+  return n;
+}
+
+/* gsub called from a trace. The count is returned in ms->findret1 and is
+** negative on errors.
+*/
+SBuf *ljx_str_gsub(SBuf *sb, GCstr *str, GCstr *pat, GCobj *repl,
+		   int32_t max_s)
+{
+  lua_State *L = sbufL(sb);
+  MatchState *ms = &G(L)->ms;
+  pat_init(ms, L, pat);
+  ms->errdefer = 1;
+  ms->findret1 = (uint32_t)str_gsub(ms, sb, str, pat, repl, max_s);
+  return sb;
+}
+
+static void add_value(MatchState *ms, luaL_Buffer *b,
+		      const char *s, const char *e)
+{
+  lua_State *L = ms->L;
+  if (lua_type(L, 3) == LUA_TFUNCTION) {
+    int n;
+    lua_pushvalue(L, 3);
+    n = push_captures(ms, s, e);
+    lua_call(L, n, 1);
+  } else {
+    push_onecapture(ms, 0, s, e);
+    lua_gettable(L, 3);
   }
   if (!lua_toboolean(L, -1)) {  /* nil or false? */
     lua_pop(L, 1);
@@ -633,13 +991,14 @@ static void add_value(MatchState *ms, luaL_Buffer *b,
   luaL_addvalue(b);  /* add result to accumulator */
 }
 
-LJLIB_CF(string_gsub)
+LJLIB_CF(string_gsub)		LJLIB_REC(.)
 {
-  size_t srcl, pl;
-  const char *src = luaL_checklstring(L, 1, &srcl);
-  const char *p = luaL_checklstring(L, 2, &pl);
+  GCstr *str = lj_lib_checkstr(L, 1);
+  GCstr *ps = lj_lib_checkstr(L, 2);
+  const char *src = strdata(str);
+  const char *p = strdata(ps);
   int  tr = lua_type(L, 3);
-  int max_s = luaL_optint(L, 4, (int)(srcl+1));
+  int max_s = luaL_optint(L, 4, (int)(str->len+1));
   int anchor = (*p == '^') ? (p++, 1) : 0;
   int n = 0;
   MatchState ms;
@@ -647,18 +1006,39 @@ LJLIB_CF(string_gsub)
   if (!(tr == LUA_TNUMBER || tr == LUA_TSTRING ||
 	tr == LUA_TFUNCTION || tr == LUA_TTABLE))
     lj_err_arg(L, 3, LJ_ERR_NOSFT);
+  pat_init(&ms, L, ps);
+  if (tr != LUA_TFUNCTION &&
+      !(tr == LUA_TTABLE && gcref(tabV(L->base+2)->metatable))) {
+    /* No callbacks: substitute straight into a string buffer. */
+    GCobj *repl = tr == LUA_TTABLE ? obj2gco(tabV(L->base+2)) :
+				     obj2gco(lj_lib_checkstr(L, 3));
+    SBuf *sb = lj_buf_tmp_(L);
+    n = str_gsub(&ms, sb, str, ps, repl, max_s);
+    setstrV(L, L->top++, lj_buf_str(L, sb));
+    setintV(L->top++, n);
+    lj_gc_check(L);
+    return 2;
+  }
   luaL_buffinit(L, &b);
-  ms.L = L;
   ms.src_init = src;
-  ms.src_end = src+srcl;
-  ms.p_end = p+pl-anchor;
+  ms.src_end = src+str->len;
+  ms.p_end = p+ps->len-anchor;
   while (n < max_s) {
     const char *e;
+    if (!anchor && ms.pc && ms.pc->first) {  /* Copy chars up to a match. */
+      const char *q = pat_skip(ms.pc, src, ms.src_end);
+      if (q > ms.src_end)
+	break;
+      luaL_addlstring(&b, src, (size_t)(q - src));
+      src = q;
+    }
     ms.level = ms.depth = ms.backtracks = 0;
     e = match(&ms, src, p);
     if (e) {
       n++;
       add_value(&ms, &b, src, e);
+      /* The callback may have evicted the compiled pattern. */
+      ms.pc = pat_get(L, ps);
     }
     if (e && e>src) /* non empty match? */
       src = e;  /* skip it */
@@ -275,6 +275,7 @@ LJLIB_CF(table_pack)
   GCtab *t = lj_tab_new(L, n ? n+1 : 0, 1);
   /* NOBARRIER: The table is new (marked white). */
   setintV(lj_tab_setstr(L, t, strV(lj_lib_upvalue(L, 1))), (int32_t)n);
+  clearnumarr(t);
   for (array = tvref(t->array) + 1, i = 0; i < n; i++)
     copyTV(L, &array[i], &base[i]);
   settabV(L, base, t);
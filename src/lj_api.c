@@ -29,6 +29,7 @@
 #include "lj_strscan.h"
 #include "lj_strfmt.h"
 #include "lj_char.h"
+#include "ljx_bitwise.h"
 
 /* -- Common helper functions --------------------------------------------- */
 
@@ -39,7 +40,9 @@ static TValue *index2adr(lua_State *L, int idx)
 {
 #if LJ_ABIVER!=51
   if (idx == LUA_GLOBALSINDEX) {
-    return (TValue*)lj_tab_getint(tabV(registry(L)), LUA_RIDX_GLOBALS);
+    GCtab *reg = tabV(registry(L));
+    clearnumarr(reg);  /* lua_replace() may store to the slot. */
+    return (TValue*)lj_tab_getint(reg, LUA_RIDX_GLOBALS);
   } else
 #endif
   if (idx > 0) {
@@ -87,7 +90,13 @@ static TValue *stkindex2adr(lua_State *L, int idx)
 static GCtab *getcurrenv(lua_State *L)
 {
   GCfunc *fn = curr_func(L);
-  return fn->c.gct == ~LJ_TFUNC ? tabref(fn->c.env) : tabref(L->env);
+  if (fn->c.gct == ~LJ_TFUNC) {
+    if (!isluafunc(fn))
+      return tabref(fn->c.env);
+    if (tvistab(funcenv(fn)))
+      return tabV(funcenv(fn));
+  }
+  return tabref(L->env);
 }
 
 /* -- Miscellaneous API functions ----------------------------------------- */
@@ -209,8 +218,12 @@ LUA_API void lua_replace(lua_State *L, int idx)
     if (fn->c.gct != ~LJ_TFUNC)
       lj_err_msg(L, LJ_ERR_NOENV);
     api_check(L, tvistab(L->top-1));
-    setgcref(fn->c.env, obj2gco(tabV(L->top-1)));
-    lj_gc_barrier(L, fn, L->top-1);
+    if (isluafunc(fn)) {
+      lj_func_setenv(L, fn, tabV(L->top-1));
+    } else {
+      setgcref(fn->c.env, obj2gco(tabV(L->top-1)));
+      lj_gc_barrier(L, fn, L->top-1);
+    }
   } else
 #endif
   {
@@ -454,6 +467,15 @@ LUA_API lua_Integer lua_tointegerx(lua_State *L, int idx, int *succ)
     return intV(o);
   } else if (LJ_LIKELY(tvisnum(o))) {
     n = numV(o);
+#if LJ_53 && LJ_HASFFI && LJ_64
+  } else if (tviscdata(o)) {
+    int64_t i;
+    if (!ljx_toint64(L, o, &i)) {
+      if (succ) *succ = 0;
+      return 0;
+    }
+    return (lua_Integer)i;
+#endif
   } else {
     if (!(tvisstr(o) && lj_strscan_number(strV(o), &tmp))) {
       if (succ) *succ = 0;
@@ -494,6 +516,13 @@ LUALIB_API lua_Integer luaL_checkinteger(lua_State *L, int idx)
     return intV(o);
   } else if (LJ_LIKELY(tvisnum(o))) {
     n = numV(o);
+#if LJ_53 && LJ_HASFFI && LJ_64
+  } else if (tviscdata(o)) {
+    int64_t i;
+    if (!ljx_toint64(L, o, &i))
+      lj_err_argt(L, idx, LUA_TNUMBER);
+    return (lua_Integer)i;
+#endif
   } else {
     if (!(tvisstr(o) && lj_strscan_number(strV(o), &tmp)))
       lj_err_argt(L, idx, LUA_TNUMBER);
@@ -519,6 +548,13 @@ LUALIB_API lua_Integer luaL_optinteger(lua_State *L, int idx, lua_Integer def)
     n = numV(o);
   } else if (tvisnil(o)) {
     return def;
+#if LJ_53 && LJ_HASFFI && LJ_64
+  } else if (tviscdata(o)) {
+    int64_t i;
+    if (!ljx_toint64(L, o, &i))
+      lj_err_argt(L, idx, LUA_TNUMBER);
+    return (lua_Integer)i;
+#endif
   } else {
     if (!(tvisstr(o) && lj_strscan_number(strV(o), &tmp)))
       lj_err_argt(L, idx, LUA_TNUMBER);
@@ -690,7 +726,11 @@ LUA_API void lua_pushnumber(lua_State *L, lua_Number n)
 
 LUA_API void lua_pushinteger(lua_State *L, lua_Integer n)
 {
+#if LJ_53 && LJ_64
+  ljx_setint64(L, L->top, (int64_t)n);  /* Spills to int64 cdata >2^53. */
+#else
   setintptrV(L->top, n);
+#endif
   incr_top(L);
 }
 
@@ -979,7 +1019,10 @@ LUA_API void lua_getfenv(lua_State *L, int idx)
   cTValue *o = index2adr(L, idx);
   api_checkvalidindex(L, o);
   if (tvisfunc(o)) {
-    settabV(L, L->top, tabref(funcV(o)->c.env));
+    if (isluafunc(funcV(o)))
+      copyTV(L, L->top, funcenv(funcV(o)));
+    else
+      settabV(L, L->top, tabref(funcV(o)->c.env));
   } else if (tvisudata(o)) {
     getuservalue(L, udataV(o), L->top);
   } else if (tvisthread(o)) {
@@ -1048,6 +1091,8 @@ LUA_API void lua_upvaluejoin(lua_State *L, int idx1, int n1, int idx2, int n2)
   n1--; n2--;
   api_check(L, isluafunc(fn1) && (uint32_t)n1 < fn1->l.nupvalues);
   api_check(L, isluafunc(fn2) && (uint32_t)n2 < fn2->l.nupvalues);
+  if (gcref(fn1->l.uvptr[n1]) == gcref(fn1->l.env))  /* Move env cell. */
+    setgcrefr(fn1->l.env, fn2->l.uvptr[n2]);
   setgcrefr(fn1->l.uvptr[n1], fn2->l.uvptr[n2]);
   lj_gc_objbarrier(L, fn1, gcref(fn1->l.uvptr[n1]));
 }
@@ -1197,10 +1242,7 @@ LUA_API int lua_setmetatable(lua_State *L, int idx)
   if (tvistab(o)) {
     setgcref(tabV(o)->metatable, obj2gco(mt));
     if (mt) {
-#if !LJ_51
-      if (lj_meta_fast(L, mt, MM_gc))
-        lj_gc_tab_finalized(L, gcval(o));
-#endif
+      lj_gc_checkfinalizer(L, tabV(o));
       lj_gc_objbarriert(L, tabV(o), mt);
     }
   } else if (tvisudata(o)) {
@@ -1243,7 +1285,10 @@ LUA_API int lua_setfenv(lua_State *L, int idx)
     api_check(L, tvistab(L->top-1));
     t = tabV(L->top-1);
     if (tvisfunc(o)) {
-      setgcref(funcV(o)->c.env, obj2gco(t));
+      if (isluafunc(funcV(o)))
+	lj_func_setenv(L, funcV(o), t);
+      else
+	setgcref(funcV(o)->c.env, obj2gco(t));
     } else if (tvisthread(o)) {
       setgcref(threadV(o)->env, obj2gco(t));
     } else {
@@ -1280,22 +1325,12 @@ LUA_API void lua_setuservalue(lua_State *L, int idx)
 LUA_API const char *lua_setupvalue(lua_State *L, int idx, int n)
 {
   cTValue *f = index2adr(L, idx);
-  GCfunc *fn = funcV(f);
   TValue *val;
   const char *name;
   api_checknelems(L, 1);
   name = lj_debug_uvnamev(f, (uint32_t)(n-1), &val);
   if (name) {
     L->top--;
-    /* Is it global env uv? XXX move to lj_func */
-    if (isluafunc(fn) && tvistab(L->top) && (gcref(fn->l.uvptr[n-1])->uv.flags & UV_ENV)) {
-      GCfunc *pfn;
-      /* Then scan linked closures and set their _ENV too */
-      for (pfn = &obj2gco(gcref(fn->l.next_ENV))->fn; pfn != fn; pfn = &obj2gco(gcref(pfn->l.next_ENV))->fn) {
-        setgcref(pfn->l.env, obj2gco(tabV(L->top)));
-        lj_gc_barrier(L, pfn, L->top);
-      }
-    }
     copyTV(L, val, L->top);
     lj_gc_barrier(L, funcV(f), L->top);
   }
@@ -1557,9 +1592,26 @@ LUA_API int lua_gc(lua_State *L, int what, int data)
     res = (int)(g->gc.stepmul);
     g->gc.stepmul = (MSize)data;
     break;
+  case LUA_GCSETMAJORINC:
+    res = (int)(g->gc.majorinc);
+    g->gc.majorinc = (MSize)data;
+    break;
   case LUA_GCISRUNNING:
     res = (g->gc.threshold != LJ_MAX_MEM);
     break;
+  case LUA_GCGEN:
+    lj_gc_changemode(L, GCKgen);
+    break;
+  case LUA_GCINC:
+    lj_gc_changemode(L, GCKinc);
+    break;
+  case LUA_GCSTEPUSEC:
+    res = lj_gc_steptime(L, data > 0 ? (uint32_t)data : 0);
+    break;
+  case LUA_GCMAXPAUSE:
+    res = (int)(g->gc.maxpause);
+    if (data) g->gc.maxpause = 0;
+    break;
   default:
     res = -1;  /* Invalid option. */
   }
@@ -487,6 +487,40 @@
 #define LJ_HASFFI		1
 #endif
 
+/* Seeded hash over the full contents of strings. */
+#if defined(LUAJIT_SECURE_STRHASH)
+#define LJ_STRHASH_SEEDED	1
+#else
+#define LJ_STRHASH_SEEDED	0
+#endif
+
+/* Open-addressing hash part with SSE2-probed control bytes. */
+#if defined(LUAJIT_ENABLE_SWISSTAB)
+#if !LJ_TARGET_X64
+#error "No support for the SSE2-probed hash part on this architecture"
+#endif
+#define LJ_SWISSTAB		1
+#else
+#define LJ_SWISSTAB		0
+#endif
+
+/* Tables share the hash part layout of their constructor template. */
+#if defined(LUAJIT_ENABLE_TABSHAPE) && LJ_HASJIT
+#define LJ_TABSHAPE		1
+#else
+#define LJ_TABSHAPE		0
+#endif
+
+/* Flag for array parts which hold only numbers and nil. */
+#if defined(LUAJIT_ENABLE_NUMARRAY)
+#if !LJ_TARGET_X64 || !LJ_GC64
+#error "No support for numeric array parts on this architecture"
+#endif
+#define LJ_NUMARRAY		1
+#else
+#define LJ_NUMARRAY		0
+#endif
+
 #if defined(LUAJIT_DISABLE_PROFILE)
 #define LJ_HASPROFILE		0
 #elif LJ_TARGET_POSIX
@@ -858,7 +858,12 @@ static void asm_snap_alloc1(ASMState *as, IRRef ref)
 	  asm_snap_alloc1(as, (ir+1)->op2);
       } else
 #endif
-      {  /* Allocate stored values for TNEW, TDUP and CNEW. */
+      if (ir->o == IR_FNEW) {  /* Allocate parent closure of FNEW. */
+	asm_snap_alloc1(as, IR(ir->op1)->op1);
+      } else if (ir->o == IR_SNEW) {  /* Allocate pointer and length. */
+	asm_snap_alloc1(as, ir->op1);
+	asm_snap_alloc1(as, ir->op2);
+      } else {  /* Allocate stored values for TNEW, TDUP and CNEW. */
 	IRIns *irs;
 	lua_assert(ir->o == IR_TNEW || ir->o == IR_TDUP || ir->o == IR_CNEW);
 	for (irs = IR(as->snapref-1); irs > ir; irs--)
@@ -989,7 +994,11 @@ static uint32_t ir_khash(IRIns *ir)
   } else {
     lua_assert(irt_isgcv(ir->t));
     lo = u32ptr(ir_kgc(ir));
+#if LJ_GC64
+    hi = (uint32_t)(u64ptr(ir_kgc(ir)) >> 32) | (irt_toitype(ir->t) << 15);
+#else
     hi = lo + HASH_BIAS;
+#endif
   }
   return hashrot(lo, hi);
 }
@@ -1034,6 +1043,21 @@ static void asm_tdup(ASMState *as, IRIns *ir)
   asm_gencall(as, ci, args);
 }
 
+static void asm_fnew(ASMState *as, IRIns *ir)
+{
+  const CCallInfo *ci = &lj_ir_callinfo[IRCALL_lj_func_newL_jit];
+  IRIns *irc = IR(ir->op1);
+  IRRef args[4];
+  lua_assert(irc->o == IR_CARG);
+  args[0] = ASMREF_L;   /* lua_State *L     */
+  args[1] = ir->op2;    /* GCproto *pt      */
+  args[2] = irc->op1;   /* GCfuncL *parent  */
+  args[3] = irc->op2;   /* TValue *base     */
+  as->gcsteps++;
+  asm_setupresult(as, ir, ci);  /* GCfunc * */
+  asm_gencall(as, ci, args);
+}
+
 static void asm_gc_check(ASMState *as);
 
 /* Explicit GC step. */
@@ -1041,7 +1065,7 @@ static void asm_gcstep(ASMState *as, IRIns *ir)
 {
   IRIns *ira;
   for (ira = IR(as->stopins+1); ira < ir; ira++)
-    if ((ira->o == IR_TNEW || ira->o == IR_TDUP ||
+    if ((ira->o == IR_TNEW || ira->o == IR_TDUP || ira->o == IR_FNEW ||
 	 (LJ_HASFFI && (ira->o == IR_CNEW || ira->o == IR_CNEWI))) &&
 	ra_used(ira))
       as->gcsteps++;
@@ -1670,6 +1694,7 @@ static void asm_ir(ASMState *as, IRIns *ir)
   case IR_SNEW: case IR_XSNEW: asm_snew(as, ir); break;
   case IR_TNEW: asm_tnew(as, ir); break;
   case IR_TDUP: asm_tdup(as, ir); break;
+  case IR_FNEW: asm_fnew(as, ir); break;
   case IR_CNEW: case IR_CNEWI: asm_cnew(as, ir); break;
 
   /* Buffer operations. */
@@ -2107,6 +2132,11 @@ static void asm_setup_regsp(ASMState *as)
     case IR_SNEW: case IR_XSNEW: case IR_NEWREF: case IR_BUFPUT:
       if (REGARG_NUMGPR < 3 && as->evenspill < 3)
 	as->evenspill = 3;  /* lj_str_new and lj_tab_newkey need 3 args. */
+      if (0) {
+    case IR_FNEW:
+	if (REGARG_NUMGPR < 4 && as->evenspill < 4)
+	  as->evenspill = 4;  /* lj_func_newL_jit needs 4 args. */
+      }
 #if LJ_TARGET_X86 && LJ_HASFFI
       if (0) {
     case IR_CNEW:
@@ -218,7 +218,7 @@ static void asm_fuseahuref(ASMState *as, IRRef ref, RegSet allow)
       break;
     default:
       lua_assert(ir->o == IR_HREF || ir->o == IR_NEWREF || ir->o == IR_UREFO ||
-		 ir->o == IR_KKPTR);
+		 ir->o == IR_KKPTR || ir->o == IR_ADD);
       break;
     }
   }
@@ -474,8 +474,11 @@ static Reg asm_fuseload(ASMState *as, IRRef ref, RegSet allow)
 	asm_fusexref(as, ir->op1, xallow);
 	return RID_MRM;
       }
-    } else if (ir->o == IR_VLOAD && !(LJ_GC64 && irt_isaddr(ir->t))) {
+    } else if (ir->o == IR_VLOAD && !(LJ_GC64 && irt_isaddr(ir->t)) &&
+	       (IR(ir->op1)->o != IR_ADD ||  /* Table traversal load? */
+		noconflict(as, ref, IR_HSTORE, 0))) {
       asm_fuseahuref(as, ir->op1, xallow);
+      as->mrm.ofs += 8*ir->op2;
       return RID_MRM;
     }
   }
@@ -1101,6 +1104,41 @@ static void asm_aref(ASMState *as, IRIns *ir)
 **   } while ((n = nextnode(n)));
 **   return niltv(L);
 */
+/* Hash a non-constant, non-string key into dest. */
+static void asm_hrefhash(ASMState *as, IRIns *irkey, Reg dest, Reg key, Reg tmp)
+{
+  checkmclim(as);
+  /* Must match with hashrot() in lj_tab.c. */
+  emit_rr(as, XO_ARITH(XOg_SUB), dest, tmp);
+  emit_shifti(as, XOg_ROL, tmp, HASH_ROT3);
+  emit_rr(as, XO_ARITH(XOg_XOR), dest, tmp);
+  emit_shifti(as, XOg_ROL, dest, HASH_ROT2);
+  emit_rr(as, XO_ARITH(XOg_SUB), tmp, dest);
+  emit_shifti(as, XOg_ROL, dest, HASH_ROT1);
+  emit_rr(as, XO_ARITH(XOg_XOR), tmp, dest);
+  if (irt_isnum(irkey->t)) {
+    emit_rr(as, XO_ARITH(XOg_ADD), dest, dest);
+#if LJ_64
+    emit_shifti(as, XOg_SHR|REX_64, dest, 32);
+    emit_rr(as, XO_MOV, tmp, dest);
+    emit_rr(as, XO_MOVDto, key|REX_64, dest);
+#else
+    emit_rmro(as, XO_MOV, dest, RID_ESP, ra_spill(as, irkey)+4);
+    emit_rr(as, XO_MOVDto, key, tmp);
+#endif
+  } else {
+    emit_rr(as, XO_MOV, tmp, key);
+#if LJ_GC64
+    /* The hash covers the tagged key, like hashgcref() in lj_tab.c. */
+    emit_gri(as, XG_ARITHi(XOg_XOR), dest, irt_toitype(irkey->t) << 15);
+    emit_shifti(as, XOg_SHR|REX_64, dest, 32);
+    emit_rr(as, XO_MOV, dest|REX_64, key|REX_64);
+#else
+    emit_rmro(as, XO_LEA, dest, key, HASH_BIAS);
+#endif
+  }
+}
+
 static void asm_href(ASMState *as, IRIns *ir, IROp merge)
 {
   RegSet allow = RSET_GPR;
@@ -1113,6 +1151,10 @@ static void asm_href(ASMState *as, IRIns *ir, IROp merge)
   IRType1 kt = irkey->t;
   uint32_t khash;
   MCLabel l_end, l_loop, l_next;
+#if LJ_SWISSTAB
+  Reg pos, mask, ctrl, h2, grp;
+  MCLabel l_match, l_group;
+#endif
 
   if (!isk) {
     rset_clear(allow, tab);
@@ -1121,6 +1163,47 @@ static void asm_href(ASMState *as, IRIns *ir, IROp merge)
       tmp = ra_scratch(as, rset_exclude(allow, key));
   }
 
+#if LJ_SWISSTAB
+  /* Scratch registers for the probe: group position, match mask, control
+  ** bytes and the broadcast control byte plus the current group.
+  */
+  {
+    RegSet fallow = RSET_FPR;
+    rset_clear(allow, tab);
+    if (ra_hasreg(key)) { rset_clear(allow, key); rset_clear(fallow, key); }
+    if (ra_hasreg(tmp)) rset_clear(allow, tmp);
+    pos = ra_scratch(as, allow);
+    mask = ra_scratch(as, rset_clear(allow, pos));
+    ctrl = ra_scratch(as, rset_clear(allow, mask));
+    h2 = ra_scratch(as, fallow);
+    grp = ra_scratch(as, rset_clear(fallow, h2));
+  }
+  checkmclim(as);
+
+  /* Key not found in probe sequence: jump to exit (if merged) or load niltv.
+  ** Only reached with ZF=0, so the guard is really unconditional.
+  */
+  l_end = emit_label(as);
+  if (merge == IR_NE)
+    asm_guardcc(as, CC_NZ);  /* XI_JMP is not found by lj_asm_patchexit. */
+  else if (destused)
+    emit_loada(as, dest, niltvg(J2G(as->J)));
+
+  /* No empty node in the group: continue with the next group. */
+  l_loop = emit_sjcc_label(as, CC_Z);
+  emit_rr(as, XO_TEST, mask, mask);
+  emit_rr(as, XO_PMOVMSKB, mask, grp);
+  emit_rmro(as, XO_ARITH(XOg_AND), pos, tab, offsetof(GCtab, hmask));
+  emit_gri(as, XG_ARITHi(XOg_ADD), pos, HCTRL_GROUP);
+  emit_rmrxo(as, XO_MOVDQU, grp, ctrl, pos, XM_SCALE1, HCTRL_GROUP);
+  l_group = emit_label(as);
+  checkmclim(as);
+
+  /* Try the next matching node of the group. */
+  l_match = emit_sjcc_label(as, CC_NZ);
+  emit_rr(as, XO_TEST, mask, mask);
+  l_next = emit_label(as);
+#else
   /* Key not found in chain: jump to exit (if merged) or load niltv. */
   l_end = emit_label(as);
   if (merge == IR_NE)
@@ -1133,6 +1216,7 @@ static void asm_href(ASMState *as, IRIns *ir, IROp merge)
   emit_rr(as, XO_TEST, dest|REX_GC64, dest);
   emit_rmro(as, XO_MOV, dest|REX_GC64, dest, offsetof(Node, next));
   l_next = emit_label(as);
+#endif
 
   /* Type and value comparison. */
   if (merge == IR_EQ)
@@ -1197,6 +1281,24 @@ static void asm_href(ASMState *as, IRIns *ir, IROp merge)
     emit_rmro(as, XO_ARITHi8, XOg_CMP, dest, offsetof(Node, key.it));
 #endif
   }
+#if LJ_SWISSTAB
+  checkmclim(as);
+  /* Get the node for the lowest set bit of the match mask and clear it. */
+  emit_rmro(as, XO_ARITH(XOg_ADD), dest|REX_GC64, tab, offsetof(GCtab,node));
+  emit_shifti(as, XOg_SHL, dest, 4);
+  emit_rmro(as, XO_ARITH(XOg_AND), dest, tab, offsetof(GCtab, hmask));
+  emit_rr(as, XO_ARITH(XOg_ADD), dest, pos);
+  emit_rr(as, XO_BTR, dest, mask);
+  emit_rr(as, XO_BSF, dest, mask);
+  emit_sfixup(as, l_match);
+
+  /* Match the control bytes of the group. */
+  emit_sjcc(as, CC_Z, l_group);
+  emit_rr(as, XO_TEST, mask, mask);
+  emit_rr(as, XO_PMOVMSKB, mask, grp);
+  emit_rr(as, XO_PCMPEQB, grp, h2);
+  emit_rmrxo(as, XO_MOVDQU, grp, ctrl, pos, XM_SCALE1, HCTRL_GROUP);
+#endif
   emit_sfixup(as, l_loop);
   checkmclim(as);
 #if LJ_GC64
@@ -1206,6 +1308,38 @@ static void asm_href(ASMState *as, IRIns *ir, IROp merge)
   }
 #endif
 
+#if LJ_SWISSTAB
+  /* Control bytes follow the nodes. The first group starts at HCTRL_GROUP. */
+  emit_rr(as, XO_ARITH(XOg_ADD), ctrl|REX_GC64, mask|REX_GC64);
+  emit_shifti(as, XOg_SHL, mask, 4);
+  emit_rmro(as, XO_MOV, mask, tab, offsetof(GCtab, hmask));
+  /* Prefetch the node at the main position while the group is matched. */
+  emit_rmrxo(as, XO_PREFETCH, XOg_PREFETCHT0, ctrl, mask, XM_SCALE1, 0);
+  emit_shifti(as, XOg_SHL, mask, 4);
+  emit_rr(as, XO_MOV, mask, pos);
+  emit_rmro(as, XO_MOV, ctrl|REX_GC64, tab, offsetof(GCtab, node));
+  checkmclim(as);
+  /* Broadcast the control byte for the hash. Start at its main position. */
+  emit_i8(as, 0);
+  emit_rr(as, XO_PSHUFD, h2, h2);
+  emit_rr(as, XO_MOVD, h2, dest);
+  emit_i32(as, 0x01010101);
+  emit_rr(as, XO_IMULi, dest, dest);
+  emit_shifti(as, XOg_SHR, dest, 25);
+  emit_rmro(as, XO_ARITH(XOg_AND), pos, tab, offsetof(GCtab, hmask));
+  emit_rr(as, XO_MOV, pos, dest);
+
+  checkmclim(as);
+  /* Load the full hash into dest. */
+  if (isk) {
+    khash = ir_khash(irkey);
+    emit_loadi(as, dest, (int32_t)khash);
+  } else if (irt_isstr(kt)) {
+    emit_rmro(as, XO_MOV, dest, key, offsetof(GCstr, hash));
+  } else {
+    asm_hrefhash(as, irkey, dest, key, tmp);
+  }
+#else
   /* Load main position relative to tab->node into dest. */
   khash = isk ? ir_khash(irkey) : 1;
   if (khash == 0) {
@@ -1225,31 +1359,12 @@ static void asm_href(ASMState *as, IRIns *ir, IROp merge)
     } else if (irt_isstr(kt)) {
       emit_rmro(as, XO_ARITH(XOg_AND), dest, key, offsetof(GCstr, hash));
       emit_rmro(as, XO_MOV, dest, tab, offsetof(GCtab, hmask));
-    } else {  /* Must match with hashrot() in lj_tab.c. */
+    } else {
       emit_rmro(as, XO_ARITH(XOg_AND), dest, tab, offsetof(GCtab, hmask));
-      emit_rr(as, XO_ARITH(XOg_SUB), dest, tmp);
-      emit_shifti(as, XOg_ROL, tmp, HASH_ROT3);
-      emit_rr(as, XO_ARITH(XOg_XOR), dest, tmp);
-      emit_shifti(as, XOg_ROL, dest, HASH_ROT2);
-      emit_rr(as, XO_ARITH(XOg_SUB), tmp, dest);
-      emit_shifti(as, XOg_ROL, dest, HASH_ROT1);
-      emit_rr(as, XO_ARITH(XOg_XOR), tmp, dest);
-      if (irt_isnum(kt)) {
-	emit_rr(as, XO_ARITH(XOg_ADD), dest, dest);
-#if LJ_64
-	emit_shifti(as, XOg_SHR|REX_64, dest, 32);
-	emit_rr(as, XO_MOV, tmp, dest);
-	emit_rr(as, XO_MOVDto, key|REX_64, dest);
-#else
-	emit_rmro(as, XO_MOV, dest, RID_ESP, ra_spill(as, irkey)+4);
-	emit_rr(as, XO_MOVDto, key, tmp);
-#endif
-      } else {
-	emit_rr(as, XO_MOV, tmp, key);
-	emit_rmro(as, XO_LEA, dest, key, HASH_BIAS);
-      }
+      asm_hrefhash(as, irkey, dest, key, tmp);
     }
   }
+#endif
 }
 
 static void asm_hrefk(ASMState *as, IRIns *ir)
@@ -1273,6 +1388,8 @@ static void asm_hrefk(ASMState *as, IRIns *ir)
       emit_rr(as, XO_MOV, dest|REX_GC64, node);
     }
   }
+  if (!irt_isguard(ir->t))  /* Key location known: TDUP or shape guard. */
+    return;
   asm_guardcc(as, CC_NE);
 #if LJ_64
   if (!irt_ispri(irkey->t)) {
@@ -1501,6 +1618,7 @@ static void asm_ahuvload(ASMState *as, IRIns *ir)
     Reg dest = asm_load_lightud64(as, ir, 1);
     if (ra_hasreg(dest)) {
       asm_fuseahuref(as, ir->op1, RSET_GPR);
+      as->mrm.ofs += 8*(ir->o == IR_VLOAD ? ir->op2 : 0);
       emit_mrm(as, XO_MOV, dest|REX_64, RID_MRM);
     }
     return;
@@ -1510,6 +1628,7 @@ static void asm_ahuvload(ASMState *as, IRIns *ir)
     RegSet allow = irt_isnum(ir->t) ? RSET_FPR : RSET_GPR;
     Reg dest = ra_dest(as, ir, allow);
     asm_fuseahuref(as, ir->op1, RSET_GPR);
+    as->mrm.ofs += 8*(ir->o == IR_VLOAD ? ir->op2 : 0);
 #if LJ_GC64
     if (irt_isaddr(ir->t)) {
       emit_shifti(as, XOg_SHR|REX_64, dest, 17);
@@ -1537,6 +1656,7 @@ static void asm_ahuvload(ASMState *as, IRIns *ir)
     }
 #endif
     asm_fuseahuref(as, ir->op1, gpr);
+    as->mrm.ofs += 8*(ir->o == IR_VLOAD ? ir->op2 : 0);
   }
   /* Always do the type check, even if the load result is unused. */
   as->mrm.ofs += 4;
@@ -1647,8 +1767,8 @@ static void asm_sload(ASMState *as, IRIns *ir)
   Reg base;
   lua_assert(!(ir->op2 & IRSLOAD_PARENT));  /* Handled by asm_head_side(). */
   lua_assert(irt_isguard(t) || !(ir->op2 & IRSLOAD_TYPECHECK));
-  lua_assert(LJ_DUALNUM ||
-	     !irt_isint(t) || (ir->op2 & (IRSLOAD_CONVERT|IRSLOAD_FRAME)));
+  lua_assert(LJ_DUALNUM || !irt_isint(t) ||
+	     (ir->op2 & (IRSLOAD_CONVERT|IRSLOAD_FRAME|IRSLOAD_KEYINDEX)));
   if ((ir->op2 & IRSLOAD_CONVERT) && irt_isguard(t) && irt_isint(t)) {
     Reg left = ra_scratch(as, RSET_FPR);
     asm_tointg(as, ir, left);  /* Frees dest reg. Do this before base alloc. */
@@ -1713,7 +1833,11 @@ static void asm_sload(ASMState *as, IRIns *ir)
   if ((ir->op2 & IRSLOAD_TYPECHECK)) {
     /* Need type check, even if the load result is unused. */
     asm_guardcc(as, irt_isnum(t) ? CC_AE : CC_NE);
-    if (LJ_64 && irt_type(t) >= IRT_NUM) {
+    if ((ir->op2 & IRSLOAD_KEYINDEX)) {
+      lua_assert(irt_isint(t));
+      emit_u32(as, LJ_KEYINDEX);
+      emit_rmro(as, XO_ARITHi, XOg_CMP, base, ofs+4);
+    } else if (LJ_64 && irt_type(t) >= IRT_NUM) {
       lua_assert(irt_isinteger(t) || irt_isnum(t));
 #if LJ_GC64
       emit_u32(as, LJ_TISNUM << 15);
@@ -1745,7 +1869,7 @@ static void asm_sload(ASMState *as, IRIns *ir)
       emit_i8(as, irt_toitype(t));
       emit_rr(as, XO_ARITHi8, XOg_CMP, tmp);
       emit_shifti(as, XOg_SAR|REX_64, tmp, 47);
-      emit_rmro(as, XO_MOV, tmp|REX_64, base, ofs+4);
+      emit_rmro(as, XO_MOV, tmp|REX_64, base, ofs);
 #else
     } else {
       emit_i8(as, irt_toitype(t));
@@ -2712,11 +2836,14 @@ static void asm_stack_restore(ASMState *as, SnapShot *snap)
       emit_rmro(as, XO_MOVSDto, src, RID_BASE, ofs);
     } else {
       lua_assert(irt_ispri(ir->t) || irt_isaddr(ir->t) ||
-		 (LJ_DUALNUM && irt_isinteger(ir->t)));
+		 (LJ_DUALNUM && irt_isinteger(ir->t)) ||
+		 (sn & SNAP_KEYINDEX));
       if (!irref_isk(ref)) {
 	Reg src = ra_alloc1(as, ref, rset_exclude(RSET_GPR, RID_BASE));
 #if LJ_GC64
-	if (irt_is64(ir->t)) {
+	if ((sn & SNAP_KEYINDEX)) {
+	  emit_movmroi(as, RID_BASE, ofs+4, (int32_t)LJ_KEYINDEX);
+	} else if (irt_is64(ir->t)) {
 	  /* TODO: 64 bit store + 32 bit load-modify-store is suboptimal. */
 	  emit_u32(as, irt_toitype(ir->t) << 15);
 	  emit_rmro(as, XO_ARITHi, XOg_OR, RID_BASE, ofs+4);
@@ -2731,7 +2858,10 @@ static void asm_stack_restore(ASMState *as, SnapShot *snap)
       } else {
 	TValue k;
 	lj_ir_kvalue(as->J->L, &k, ir);
-	if (tvisnil(&k)) {
+	if ((sn & SNAP_KEYINDEX)) {
+	  emit_movmroi(as, RID_BASE, ofs+4, (int32_t)LJ_KEYINDEX);
+	  emit_movmroi(as, RID_BASE, ofs, ir->i);
+	} else if (tvisnil(&k)) {
 	  emit_i32(as, -1);
 	  emit_rmro(as, XO_MOVmi, REX_64, RID_BASE, ofs);
 	} else {
@@ -2749,6 +2879,8 @@ static void asm_stack_restore(ASMState *as, SnapShot *snap)
 	  emit_movmroi(as, RID_BASE, ofs+4, (int32_t)(*flinks--));
 #endif
 #if !LJ_GC64
+      } else if ((sn & SNAP_KEYINDEX)) {
+	emit_movmroi(as, RID_BASE, ofs+4, (int32_t)LJ_KEYINDEX);
       } else {
 	if (!(LJ_64 && irt_islightud(ir->t)))
 	  emit_movmroi(as, RID_BASE, ofs+4, irt_toitype(ir->t));
@@ -205,6 +205,7 @@ static GCtab *bcread_ktab(LexState *ls)
   if (narray) {  /* Read array entries. */
     MSize i;
     TValue *o = tvref(t->array);
+    clearnumarr(t);
     for (i = 0; i < narray; i++, o++)
       bcread_ktabk(ls, o);
   }
@@ -16,13 +16,20 @@
 
 /* -- Buffer management --------------------------------------------------- */
 
+/* The memory block of a buffer has room for a string header in front and
+** for the terminating zero. So the contents can be taken as a string.
+*/
+#define sbufmem(sb)	(sbufB(sb) ? sbufB(sb) - sizeof(GCstr) : NULL)
+#define sbufmemsz(sz)	((sz) ? (sz) + (MSize)sizeof(GCstr) + 1 : 0)
+
 static void buf_grow(SBuf *sb, MSize sz)
 {
   MSize osz = sbufsz(sb), len = sbuflen(sb), nsz = osz;
   char *b;
   if (nsz < LJ_MIN_SBUF) nsz = LJ_MIN_SBUF;
   while (nsz < sz) nsz += nsz;
-  b = (char *)lj_mem_realloc(sbufL(sb), sbufB(sb), osz, nsz);
+  b = (char *)lj_mem_realloc(sbufL(sb), sbufmem(sb), sbufmemsz(osz),
+			     sbufmemsz(nsz)) + sizeof(GCstr);
   setmref(sb->b, b);
   setmref(sb->p, b + len);
   setmref(sb->e, b + nsz);
@@ -53,7 +60,8 @@ void LJ_FASTCALL lj_buf_shrink(lua_State *L, SBuf *sb)
   MSize osz = (MSize)(sbufE(sb) - b);
   if (osz > 2*LJ_MIN_SBUF) {
     MSize n = (MSize)(sbufP(sb) - b);
-    b = lj_mem_realloc(L, b, osz, (osz >> 1));
+    b = (char *)lj_mem_realloc(L, sbufmem(sb), sbufmemsz(osz),
+			       sbufmemsz(osz >> 1)) + sizeof(GCstr);
     setmref(sb->b, b);
     setmref(sb->p, b + n);
     setmref(sb->e, b + (osz >> 1));
@@ -206,6 +214,19 @@ GCstr * LJ_FASTCALL lj_buf_tostr(SBuf *sb)
   return lj_str_new(sbufL(sb), sbufB(sb), sbuflen(sb));
 }
 
+/* Take the buffer memory as a string. Leaves an empty buffer. */
+GCstr *lj_buf_takestr(lua_State *L, SBuf *sb)
+{
+  MSize len = sbuflen(sb);
+  GCstr *s;
+  if (len >= LJ_MAX_STR)
+    lj_err_msg(L, LJ_ERR_STROV);
+  s = (GCstr *)lj_mem_realloc(L, sbufmem(sb), sbufmemsz(sbufsz(sb)),
+			      sbufmemsz(len));  /* Shrink to fit. */
+  setmref(sb->p, NULL); setmref(sb->e, NULL); setmref(sb->b, NULL);
+  return lj_str_intern(L, s, len);
+}
+
 /* Concatenate two strings. */
 GCstr *lj_buf_cat2str(lua_State *L, GCstr *s1, GCstr *s2)
 {
@@ -48,7 +48,8 @@ static LJ_AINLINE SBuf *lj_buf_tmp_(lua_State *L)
 
 static LJ_AINLINE void lj_buf_free(global_State *g, SBuf *sb)
 {
-  lj_mem_free(g, sbufB(sb), sbufsz(sb));
+  if (sbufB(sb))
+    lj_mem_free(g, sbufB(sb) - sizeof(GCstr), sbufsz(sb) + sizeof(GCstr) + 1);
 }
 
 static LJ_AINLINE char *lj_buf_need(SBuf *sb, MSize sz)
@@ -92,11 +93,15 @@ LJ_FUNC SBuf *lj_buf_puttab(SBuf *sb, GCtab *t, GCstr *sep,
 
 /* Miscellaneous buffer operations */
 LJ_FUNCA GCstr * LJ_FASTCALL lj_buf_tostr(SBuf *sb);
+LJ_FUNC GCstr *lj_buf_takestr(lua_State *L, SBuf *sb);
 LJ_FUNC GCstr *lj_buf_cat2str(lua_State *L, GCstr *s1, GCstr *s2);
 LJ_FUNC uint32_t LJ_FASTCALL lj_buf_ruleb128(const char **pp);
 
+/* Create a string from the buffer. Big ones take over the buffer memory. */
 static LJ_AINLINE GCstr *lj_buf_str(lua_State *L, SBuf *sb)
 {
+  if (LJ_UNLIKELY(sbuflen(sb) >= LJ_MIN_SBUFSTR))
+    return lj_buf_takestr(L, sb);
   return lj_str_new(L, sbufB(sb), sbuflen(sb));
 }
 
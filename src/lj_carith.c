@@ -17,6 +17,7 @@
 #include "lj_cdata.h"
 #include "lj_carith.h"
 #include "lj_strscan.h"
+#include "ljx_bitwise.h"
 
 /* -- C data arithmetic --------------------------------------------------- */
 
@@ -158,13 +159,22 @@ static int carith_ptr(lua_State *L, CTState *cts, CDArith *ca, MMS mm)
 static int carith_int64(lua_State *L, CTState *cts, CDArith *ca, MMS mm)
 {
   if (ctype_isnum(ca->ct[0]->info) && ca->ct[0]->size <= 8 &&
-      ctype_isnum(ca->ct[1]->info) && ca->ct[1]->size <= 8) {
+      ctype_isnum(ca->ct[1]->info) && ca->ct[1]->size <= 8 &&
+      mm != MM_len && mm != MM_concat) {
     CTypeID id = (((ca->ct[0]->info & CTF_UNSIGNED) && ca->ct[0]->size == 8) ||
 		  ((ca->ct[1]->info & CTF_UNSIGNED) && ca->ct[1]->size == 8)) ?
 		 CTID_UINT64 : CTID_INT64;
     CType *ct = ctype_get(cts, id);
     GCcdata *cd;
     uint64_t u0, u1, *up;
+#if LJ_53
+    if (mm >= MM_bnot) {  /* Same as for plain integers, floats must fit. */
+      if (ljx_vm_foldbit(L, L->top-1, L->base,
+			 mm == MM_bnot ? L->base : L->base+1, mm) < 0)
+	lj_err_msg(L, LJ_ERR_NOINTREP);
+      return 1;
+    }
+#endif
     lj_cconv_ct_ct(cts, ct, ca->ct[0], (uint8_t *)&u0, ca->p[0], 0);
     if (mm != MM_unm)
       lj_cconv_ct_ct(cts, ct, ca->ct[1], (uint8_t *)&u1, ca->p[1], 0);
@@ -197,7 +207,11 @@ static int carith_int64(lua_State *L, CTState *cts, CDArith *ca, MMS mm)
       break;
     case MM_mod:
       if (id == CTID_INT64)
+#if LJ_53
+	*up = (uint64_t)lj_carith_imodi64((int64_t)u0, (int64_t)u1);
+#else
 	*up = (uint64_t)lj_carith_modi64((int64_t)u0, (int64_t)u1);
+#endif
       else
 	*up = lj_carith_modu64(u0, u1);
       break;
@@ -373,6 +387,19 @@ int64_t lj_carith_divi64(int64_t a, int64_t b)
   return a / b;
 }
 
+#if LJ_53
+/* Signed 64 bit floor division (Lua 5.3 //). */
+int64_t lj_carith_idivi64(int64_t a, int64_t b)
+{
+  int64_t q;
+  if (b == 0 || (a == (int64_t)U64x(80000000,00000000) && b == -1))
+    return U64x(80000000,00000000);
+  q = a / b;
+  if ((a ^ b) < 0 && q * b != a) q--;
+  return q;
+}
+#endif
+
 /* Unsigned 64 bit modulo. */
 uint64_t lj_carith_modu64(uint64_t a, uint64_t b)
 {
@@ -380,6 +407,19 @@ uint64_t lj_carith_modu64(uint64_t a, uint64_t b)
   return a % b;
 }
 
+#if LJ_53
+/* Signed 64 bit floor modulo (Lua 5.3 %). */
+int64_t lj_carith_imodi64(int64_t a, int64_t b)
+{
+  int64_t r;
+  if (b == 0) return U64x(80000000,00000000);
+  if (b == -1) return 0;
+  r = a % b;
+  if (r != 0 && (r ^ b) < 0) r += b;
+  return r;
+}
+#endif
+
 /* Signed 64 bit modulo. */
 int64_t lj_carith_modi64(int64_t a, int64_t b)
 {
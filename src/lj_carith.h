@@ -27,8 +27,14 @@ LJ_FUNC int64_t lj_carith_mul64(int64_t x, int64_t k);
 #endif
 LJ_FUNC uint64_t lj_carith_divu64(uint64_t a, uint64_t b);
 LJ_FUNC int64_t lj_carith_divi64(int64_t a, int64_t b);
+#if LJ_53
+LJ_FUNC int64_t lj_carith_idivi64(int64_t a, int64_t b);
+#endif
 LJ_FUNC uint64_t lj_carith_modu64(uint64_t a, uint64_t b);
 LJ_FUNC int64_t lj_carith_modi64(int64_t a, int64_t b);
+#if LJ_53
+LJ_FUNC int64_t lj_carith_imodi64(int64_t a, int64_t b);
+#endif
 LJ_FUNC uint64_t lj_carith_powu64(uint64_t x, uint64_t k);
 LJ_FUNC int64_t lj_carith_powi64(int64_t x, int64_t k);
 
@@ -35,6 +35,7 @@
 #include "lj_crecord.h"
 #include "lj_dispatch.h"
 #include "lj_strfmt.h"
+#include "ljx_bitwise.h"
 
 /* Some local macros to save typing. Undef'd at the end. */
 #define IR(ref)			(&J->cur.ir[(ref)])
@@ -1252,7 +1253,8 @@ void LJ_FASTCALL recff_cdata_call(jit_State *J, RecordFFData *rd)
 
 static TRef crec_arith_int64(jit_State *J, TRef *sp, CType **s, MMS mm)
 {
-  if (ctype_isnum(s[0]->info) && ctype_isnum(s[1]->info)) {
+  if (ctype_isnum(s[0]->info) && ctype_isnum(s[1]->info) &&
+      mm != MM_len && mm != MM_concat) {
     IRType dt;
     CTypeID id;
     TRef tr;
@@ -1298,6 +1300,10 @@ static TRef crec_arith_int64(jit_State *J, TRef *sp, CType **s, MMS mm)
       lj_ir_set(J, IRTG(op, dt), sp[0], sp[1]);
       J->postproc = LJ_POST_FIXGUARD;
       return TREF_TRUE;
+#if LJ_53
+    } else if (mm == MM_mod && dt == IRT_I64) {  /* Floor modulo. */
+      tr = lj_ir_call(J, IRCALL_lj_carith_imodi64, sp[0], sp[1]);
+#endif
     } else {
       tr = emitir(IRT(mm+(int)IR_ADD-(int)MM_add, dt), sp[0], sp[1]);
     }
@@ -1410,6 +1416,18 @@ void LJ_FASTCALL recff_cdata_arith(jit_State *J, RecordFFData *rd)
   TRef sp[2];
   CType *s[2];
   MSize i;
+#if LJ_53
+  if ((MMS)rd->data >= MM_bnot) {  /* Same as for the bytecodes. */
+    MSize j = (MMS)rd->data == MM_bnot ? 0 : 1;
+    TRef tr = J->base[0] && J->base[j] ?
+      ljx_rec_bitwise(J, J->base[0], J->base[j], &rd->argv[0], &rd->argv[j],
+		      (MMS)rd->data) : 0;
+    if (!tr)  /* The interpreter throws. */
+      lj_trace_err(J, LJ_TRERR_BADTYPE);
+    J->base[0] = tr;
+    return;
+  }
+#endif
   for (i = 0; i < 2; i++) {
     TRef tr = J->base[i];
     CType *ct = ctype_get(cts, CTID_DOUBLE);
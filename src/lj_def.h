@@ -79,6 +79,7 @@ typedef unsigned int uintptr_t;
 #define LJ_MIN_REGISTRY	2		/* Min. registry size (hbits). ORDER LUA_RIDX_COUNT. */
 #define LJ_MIN_STRTAB	256		/* Min. string table size (pow2). */
 #define LJ_MIN_SBUF	32		/* Min. string buffer length. */
+#define LJ_MIN_SBUFSTR	32768		/* Min. length to take a buffer as string. */
 #define LJ_MIN_VECSZ	8		/* Min. size for growable vectors. */
 #define LJ_MIN_IRSZ	32		/* Min. size for growable IR. */
 #define LJ_MIN_K64SZ	16		/* Min. size for chained K64Array. */
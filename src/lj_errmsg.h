@@ -36,6 +36,8 @@ ERRDEF(OPINDEX,	"index")
 ERRDEF(OPARITH,	"perform arithmetic on")
 ERRDEF(OPCAT,	"concatenate")
 ERRDEF(OPLEN,	"get length of")
+ERRDEF(NOINTREP,	"number has no integer representation")
+ERRDEF(IDIVZERO,	"attempt to perform " LUA_QL("n//0"))
 
 /* Type checks. */
 ERRDEF(BADSELF,	"calling " LUA_QS " on bad self (%s)")
@@ -931,6 +931,13 @@ static void LJ_FASTCALL recff_string_op(jit_State *J, RecordFFData *rd)
   J->base[0] = emitir(IRT(IR_BUFSTR, IRT_STR), tr, hdr);
 }
 
+/* Constant offset for pointer arithmetic on IRT_PGC. */
+#if LJ_GC64
+#define recff_kpgcofs(J, k)	lj_ir_kint64(J, (uint64_t)(k))
+#else
+#define recff_kpgcofs(J, k)	lj_ir_kint(J, (int32_t)(k))
+#endif
+
 static int recff_emit_captures(jit_State *J, const MatchState *ms,
 				TRef tr, int off, TRef sptr)
 {
@@ -944,25 +951,29 @@ static int recff_emit_captures(jit_State *J, const MatchState *ms,
   if (!ms->level)
     return 0;
 
-  captures = emitir(IRT(IR_ADD, IRT_P32), tr, /* IRFL_ not really applicable. */
-                    lj_ir_kint(J, capoff));
+  captures = emitir(IRT(IR_ADD, IRT_PGC), tr, /* IRFL_ not really applicable. */
+                    recff_kpgcofs(J, capoff));
   for (i = 0; i < ms->level; i++) {
     int init = i*capsize+initoff;
     if (ms->capture[i].len == CAP_POSITION) {
-      J->base[off+i] =
-        emitir(IRT(IR_SUB, IRT_INT),
-          emitir(IRT(IR_XLOAD, IRT_P32),
-            emitir(IRT(IR_ADD, IRT_P32), captures, lj_ir_kint(J, init)), 0),
-          emitir(IRT(IR_SUB, IRT_P32), sptr, lj_ir_kint(J, 1))
-        ); /* IR_SUB */
+      TRef trpos = emitir(IRT(IR_XLOAD, IRT_PGC),
+        emitir(IRT(IR_ADD, IRT_PGC), captures, recff_kpgcofs(J, init)), 0);
+      lua_assert(sptr);
+#if LJ_GC64
+      trpos = emitir(IRTI(IR_CONV), emitir(IRT(IR_SUB, IRT_I64), trpos, sptr),
+		     (IRT_INT<<5)|IRT_I64);
+#else
+      trpos = emitir(IRTI(IR_SUB), trpos, sptr);
+#endif
+      J->base[off+i] = emitir(IRTI(IR_ADD), trpos, lj_ir_kint(J, 1));
     } else {
       int len = i*capsize+lenoff;
       J->base[off+i] =
         emitir(IRT(IR_SNEW, IRT_STR),
-          emitir(IRT(IR_XLOAD, IRT_P32),
-            emitir(IRT(IR_ADD, IRT_P32), captures, lj_ir_kint(J, init)), 0),
+          emitir(IRT(IR_XLOAD, IRT_PGC),
+            emitir(IRT(IR_ADD, IRT_PGC), captures, recff_kpgcofs(J, init)), 0),
           emitir(IRT(IR_XLOAD, IRT_INT),
-            emitir(IRT(IR_ADD, IRT_P32), captures, lj_ir_kint(J, len)), 0)
+            emitir(IRT(IR_ADD, IRT_PGC), captures, recff_kpgcofs(J, len)), 0)
         ); /* IR_SNEW */
     }
   }
@@ -979,6 +990,7 @@ static void LJ_FASTCALL recff_string_findmatch(jit_State *J, RecordFFData *rd)
   GCstr *pat = argv2str(J, &rd->argv[1]);
   TRef kpat = 0;
   int rawfind = 0;
+  MatchState *ms = NULL;
 
   J->needsnap = 1;
 
@@ -995,16 +1007,25 @@ static void LJ_FASTCALL recff_string_findmatch(jit_State *J, RecordFFData *rd)
     start = argv2int(J, &rd->argv[2]);
   }
 
+  rawfind = find && J->base[2] && tref_istruecond(J->base[3]);
+  if (!rawfind && lj_str_haspattern(pat)) {
+    ms = ljx_str_match(J->L, strdata(str), pat, str->len, start, NULL);
+    if (J2G(J)->ms.errdefer > 1) {  /* Let the interpreter throw. */
+      recff_nyiu(J, rd);
+      return;
+    }
+  }
+
   /* Specialize on pattern only if no raw flag is specified. */
-  if (!find || !(rawfind = (J->base[2] && tref_istruecond(J->base[3])))) {
+  if (!rawfind) {
     kpat = lj_ir_kstr(J, pat);
     emitir(IRTG(IR_EQ, IRT_STR), trpat, kpat);
     trpat = kpat;
   }
 
-  trsptr = emitir(IRT(IR_STRREF, IRT_P32), trstr, tr0);
+  trsptr = emitir(IRT(IR_STRREF, IRT_PGC), trstr, tr0);
   trslen = emitir(IRTI(IR_FLOAD), trstr, IRFL_STR_LEN);
-  trpptr = emitir(IRT(IR_STRREF, IRT_P32), trpat, tr0);
+  trpptr = emitir(IRT(IR_STRREF, IRT_PGC), trpat, tr0);
   trplen = emitir(IRTI(IR_FLOAD), trpat, IRFL_STR_LEN);
 
   if (rawfind || !lj_str_haspattern(pat)) {
@@ -1026,14 +1047,13 @@ static void LJ_FASTCALL recff_string_findmatch(jit_State *J, RecordFFData *rd)
       J->base[0] = TREF_NIL;
     }
   } else {
-    TRef tr = lj_ir_call(J, IRCALL_ljx_str_match,
-		    trsptr, trpptr, trslen, trplen, trstart);
+    /* A deferred error returns the value which fails the guard. */
     TRef trp0 = lj_ir_kkptr(J, NULL);
-    MatchState *ms = ljx_str_match(J->L, strdata(str), strdata(pat),
-		    str->len, pat->len, start);
+    TRef tr = lj_ir_call(J, IRCALL_ljx_str_match, trsptr, trpat, trslen,
+			 trstart, ms ? trp0 : lj_ir_kkptr(J, &J2G(J)->ms));
     if (ms) {
       int rpos = 0;
-      emitir(IRTG(IR_NE, IRT_P32), tr, trp0);
+      emitir(IRTG(IR_NE, IRT_PGC), tr, trp0);
       if (find) {
         J->base[0] = emitir(IRTI(IR_FLOAD), tr, IRFL_MS_FINDRET1);
         J->base[1] = emitir(IRTI(IR_FLOAD), tr, IRFL_MS_FINDRET2);
@@ -1047,6 +1067,105 @@ static void LJ_FASTCALL recff_string_findmatch(jit_State *J, RecordFFData *rd)
   }
 }
 
+/* Position captures need the subject, which only the closure knows. */
+static int recff_haspos(const MatchState *ms)
+{
+  uint32_t i;
+  for (i = 0; i < ms->level; i++)
+    if (ms->capture[i].len == CAP_POSITION)
+      return 1;
+  return 0;
+}
+
+static void LJ_FASTCALL recff_string_gmatch(jit_State *J, RecordFFData *rd)
+{
+  TRef trstr = lj_ir_tostr(J, J->base[0]);
+  TRef trpat = lj_ir_tostr(J, J->base[1]);
+  J->base[0] = lj_ir_call(J, IRCALL_ljx_str_gmatch_new, trstr, trpat);
+  UNUSED(rd);
+}
+
+static void LJ_FASTCALL recff_string_gmatch_aux(jit_State *J, RecordFFData *rd)
+{
+  GCfuncC *fn = &J->fn->c;
+  GCstr *pat = strV(&fn->upvalue[1]);
+  MatchState *ms = &J2G(J)->ms;
+  TRef trp0 = lj_ir_kkptr(J, NULL), tr;
+  /* Passing ms as the fail value leaves the position to the interpreter. */
+  MatchState *m = ljx_str_gmatch(J->L, fn, pat, ms);
+  if (ms->errdefer > 1 || (m && recff_haspos(ms))) {
+    recff_nyiu(J, rd);
+    return;
+  }
+  J->needsnap = 1;
+  /* The helper checks the pattern, so the captures can be specialized. */
+  tr = lj_ir_call(J, IRCALL_ljx_str_gmatch, J->base[-1-LJ_FR2],
+		  lj_ir_kstr(J, pat), m ? trp0 : lj_ir_kkptr(J, ms));
+  if (m) {
+    emitir(IRTG(IR_NE, IRT_PGC), tr, trp0);
+    rd->nres = recff_emit_captures(J, ms, tr, 0, 0);
+  } else {
+    emitir(IRTG(IR_EQ, IRT_PGC), tr, trp0);
+    J->base[0] = TREF_NIL;
+  }
+}
+
+static void LJ_FASTCALL recff_string_gsub(jit_State *J, RecordFFData *rd)
+{
+  TRef trstr = lj_ir_tostr(J, J->base[0]);
+  TRef trpat = lj_ir_tostr(J, J->base[1]);
+  TRef trrepl = J->base[2], trmax, hdr, tr, trn;
+  GCstr *pat = argv2str(J, &rd->argv[1]);
+  if (tref_istab(trrepl)) {
+    GCtab *t = tabV(&rd->argv[2]);
+    if (gcref(t->metatable)) {  /* NYI: __index on the replacement table. */
+      recff_nyiu(J, rd);
+      return;
+    }
+    emitir(IRTG(IR_EQ, IRT_TAB),
+	   emitir(IRT(IR_FLOAD, IRT_TAB), trrepl, IRFL_TAB_META),
+	   lj_ir_knull(J, IRT_TAB));
+  } else if (tref_isstr(trrepl) || tref_isnumber(trrepl)) {
+    trrepl = lj_ir_tostr(J, trrepl);
+  } else {  /* NYI: function replacements. */
+    recff_nyiu(J, rd);
+    return;
+  }
+  if (tref_isnil(J->base[3]))  /* No limit. Can't match more than len+1. */
+    trmax = lj_ir_kint(J, 0x7fffffff);
+  else
+    trmax = lj_opt_narrow_toint(J, J->base[3]);
+  J->needsnap = 1;
+  emitir(IRTG(IR_EQ, IRT_STR), trpat, lj_ir_kstr(J, pat));
+  hdr = recff_bufhdr(J);
+  tr = lj_ir_call(J, IRCALL_ljx_str_gsub, hdr, trstr, lj_ir_kstr(J, pat),
+		  trrepl, trmax);
+  /* The count is left in g->ms. It's addressed relative to the returned
+  ** g->tmpbuf, so every call gets its own load.
+  */
+  trn = emitir(IRTI(IR_XLOAD),
+	       emitir(IRT(IR_ADD, IRT_PGC), tr,
+		      recff_kpgcofs(J, (int32_t)(offsetof(global_State, ms) +
+				offsetof(MatchState, findret1) -
+				offsetof(global_State, tmpbuf)))), 0);
+  emitir(IRTGI(IR_GE), trn, lj_ir_kint(J, 0));  /* Deferred error? */
+  J->base[0] = emitir(IRT(IR_BUFSTR, IRT_STR), tr, hdr);
+  J->base[1] = trn;
+  rd->nres = 2;
+}
+
+/* Record lj_obj_ptr() for a GC object. */
+static TRef recff_objptr(jit_State *J, TRef tr)
+{
+  if (tref_isudata(tr))
+    return emitir(IRT(IR_ADD, IRT_PTR), tr, lj_ir_kintp(J, sizeof(GCudata)));
+#if LJ_HASFFI
+  if (tref_iscdata(tr))
+    return emitir(IRT(IR_ADD, IRT_PTR), tr, lj_ir_kintp(J, sizeof(GCcdata)));
+#endif
+  return tr;
+}
+
 static void LJ_FASTCALL recff_string_format(jit_State *J, RecordFFData *rd)
 {
   TRef trfmt = lj_ir_tostr(J, J->base[0]);
@@ -1099,9 +1218,34 @@ static void LJ_FASTCALL recff_string_format(jit_State *J, RecordFFData *rd)
       if (LJ_SOFTFP) lj_needsplit(J);
       break;
     case STRFMT_STR:
-      if (!tref_isstr(tra)) {
-	recff_nyiu(J, rd);  /* NYI: __tostring and non-string types for %s. */
-	return;
+      if (!tref_isstr(tra)) {  /* Inline tostring() semantics. */
+	RecordIndex ix;
+	ix.tab = tra;
+	copyTV(J->L, &ix.tabv, &rd->argv[arg-1]);
+	if (tref_islightud(tra) || lj_record_mm_lookup(J, &ix, MM_tostring)) {
+	  recff_nyiu(J, rd);  /* NYI: __tostring calls. */
+	  return;
+	}
+	if (tref_isnumber(tra)) {
+	  tra = emitir(IRT(IR_TOSTR, IRT_STR), tra,
+		       tref_isnum(tra) ? IRTOSTR_NUM : IRTOSTR_INT);
+	} else if (tref_ispri(tra)) {
+	  tra = lj_ir_kstr(J, lj_strfmt_obj(J->L, &rd->argv[arg-1]));
+	} else if (sf == STRFMT_STR && !tref_isfunc(tra)) {
+	  /* Shortcut for "type: 0x..." without a temporary string. */
+	  const char *tn = lj_typename(&rd->argv[arg-1]);
+	  char buf[16];
+	  MSize n = (MSize)strlen(tn);
+	  memcpy(buf, tn, n);
+	  buf[n] = ':'; buf[n+1] = ' ';
+	  tr = emitir(IRT(IR_BUFPUT, IRT_PGC), tr,
+		      lj_ir_kstr(J, lj_str_new(J->L, buf, n+2)));
+	  tr = lj_ir_call(J, IRCALL_lj_strfmt_putptr, tr, recff_objptr(J, tra));
+	  break;
+	} else {  /* Functions may be builtins. */
+	  tr = lj_ir_call(J, IRCALL_lj_strfmt_putfobj, tr, trsf, tra);
+	  break;
+	}
       }
       if (sf == STRFMT_STR)  /* Shortcut for plain %s. */
 	tr = emitir(IRT(IR_BUFPUT, IRT_PGC), tr, tra);
@@ -1118,7 +1262,17 @@ static void LJ_FASTCALL recff_string_format(jit_State *J, RecordFFData *rd)
       else
 	tr = lj_ir_call(J, IRCALL_lj_strfmt_putfchar, tr, trsf, tra);
       break;
-    case STRFMT_PTR:  /* NYI */
+    case STRFMT_PTR:  /* No formatting. */
+      if (tref_islightud(tra)) {
+	recff_nyiu(J, rd);
+	return;
+      }
+      if (tref_isgcv(tra))
+	tr = lj_ir_call(J, IRCALL_lj_strfmt_putptr, tr, recff_objptr(J, tra));
+      else  /* No pointer. */
+	tr = emitir(IRT(IR_BUFPUT, IRT_PGC), tr, lj_ir_kstr(J,
+		    lj_str_newlit(J->L, "NULL")));
+      break;
     case STRFMT_ERR:
     default:
       recff_nyiu(J, rd);
@@ -119,73 +119,86 @@ GCfunc *lj_func_newC(lua_State *L, MSize nelems, GCtab *env)
   return fn;
 }
 
-static GCfunc *func_newL(lua_State *L, GCproto *pt, GCtab *env)
+static GCfunc *func_newL(lua_State *L, GCproto *pt, GCupval *uvenv)
 {
   uint32_t count;
   GCfunc *fn = (GCfunc *)lj_mem_newgco(L, sizeLfunc((MSize)pt->sizeuv));
-  /* Initially points to itself */
-  setgcref(fn->l.prev_ENV, obj2gco(fn));
-  setgcref(fn->l.next_ENV, obj2gco(fn));
   fn->l.gct = ~LJ_TFUNC;
   fn->l.ffid = FF_LUA;
   fn->l.nupvalues = 0;  /* Set to zero until upvalues are initialized. */
   /* NOBARRIER: Really a setgcref. But the GCfunc is new (marked white). */
   setmref(fn->l.pc, proto_bc(pt));
-  setgcref(fn->l.env, obj2gco(env));
+  setgcref(fn->l.env, obj2gco(uvenv));
   /* Saturating 3 bit counter (0..7) for created closures. */
   count = (uint32_t)pt->flags + PROTO_CLCOUNT;
   pt->flags = (uint8_t)(count - ((count >> PROTO_CLC_BITS) & PROTO_CLCOUNT));
   return fn;
 }
 
-static GCfunc *lj_func_newL(lua_State *L, GCproto *pt, GCfuncL *parent);
+/* Create a new env cell, i.e. a closed _ENV upvalue holding env. */
+static GCupval *func_envuv(lua_State *L, GCproto *pt, GCtab *env)
+{
+  GCupval *uv = func_emptyuv(L);
+  uv->flags = UV_ENV;
+  uv->dhash = (uint32_t)(uintptr_t)pt;
+  settabV(L, &uv->tv, env);
+  return uv;
+}
+
+static GCfunc *lj_func_newL(lua_State *L, GCproto *pt, GCfuncL *parent,
+			    TValue *base);
 /* Recursively instantiate closures */
 static inline
-void lj_func_init_closure(lua_State *L, uintptr_t i, GCproto *pttab, GCfuncL *parent, GCupval *uv)
+void lj_func_init_closure(lua_State *L, uintptr_t i, GCproto *pttab, GCfuncL *parent, GCupval *uv, TValue *base)
 {
-  setfuncV(L, &uv->tv, lj_func_newL(L, &proto_kgc(pttab, (~i))->pt, parent));
+  setfuncV(L, &uv->tv, lj_func_newL(L, &proto_kgc(pttab, (~i))->pt, parent, base));
 }
 
 /* Create a new Lua function with empty upvalues. */
 GCfunc *lj_func_newL_empty(lua_State *L, GCproto *pt, GCtab *env)
 {
-  GCfunc *fn = func_newL(L, pt, env);
+  GCupval *uvenv = func_envuv(L, pt, env);
+  GCfunc *fn = func_newL(L, pt, uvenv);
   MSize i, nuv = pt->sizeuv;
   for (i = 0; i < nuv; i++) {
-    GCupval *uv = func_emptyuv(L);
+    GCupval *uv;
     uint32_t v = proto_uv(pt)[i];
     uint8_t flags = (v >> PROTO_UV_SHIFT);
     if (flags == UV_HOLE) {
       setgcrefnull(fn->l.uvptr[i]);
       continue;
     }
+    /* NOBARRIER: The GCfunc is new (marked white). */
+    if (flags == UV_ENV) {  /* The _ENV upvalue is the env cell itself. */
+      setgcref(fn->l.uvptr[i], obj2gco(uvenv));
+      continue;
+    }
+    uv = func_emptyuv(L);
     uv->flags = flags;
     uv->dhash = (uint32_t)(uintptr_t)pt ^ ((uint32_t)proto_uv(pt)[i] << 24);
-    /* NOBARRIER: The GCfunc is new (marked white). */
     setgcref(fn->l.uvptr[i], obj2gco(uv));
     /* TBD: sub-closures and env barriers? */
-    if (flags == UV_ENV) {
-      settabV(L, &uv->tv, env);
-    } else if (flags == UV_CLOSURE)
-      lj_func_init_closure(L, v & PROTO_UV_MASK, pt, &fn->l, uv);
+    if (flags == UV_CLOSURE)
+      lj_func_init_closure(L, v & PROTO_UV_MASK, pt, &fn->l, uv, L->base);
   }
   fn->l.nupvalues = (uint8_t)nuv;
   return fn;
 }
 
-/* Do a GC check and create a new Lua function with inherited upvalues. */
-static GCfunc *lj_func_newL(lua_State *L, GCproto *pt, GCfuncL *parent)
+/* Create a new Lua function with inherited upvalues.
+** Local upvalues are opened on the stack frame starting at base.
+*/
+static GCfunc *lj_func_newL(lua_State *L, GCproto *pt, GCfuncL *parent,
+			    TValue *base)
 {
   GCfunc *fn;
   GCRef *puv;
   MSize i, nuv;
-  TValue *base;
 
-  fn = func_newL(L, pt, tabref(parent->env));
+  fn = func_newL(L, pt, &gcref(parent->env)->uv);
   /* NOBARRIER: The GCfunc is new (marked white). */
   puv = parent->uvptr;
   nuv = pt->sizeuv;
-  base = L->base;
 
   fn->l.nupvalues = 0;
   /* TBD: sub-closures and env barriers? */
@@ -197,19 +210,13 @@ static GCfunc *lj_func_newL(lua_State *L, GCproto *pt, GCfuncL *parent)
         uv = func_emptyuv(L);
         uv->flags = v >> PROTO_UV_SHIFT;
         setgcref(fn->l.uvptr[i], obj2gco(uv));
-        lj_func_init_closure(L, v & PROTO_UV_MASK, pt, &fn->l, uv);
+        lj_func_init_closure(L, v & PROTO_UV_MASK, pt, &fn->l, uv, base);
         break;
       case UV_ENV:
         //lua_assert(0);
       case UV_CHAINED:
         uv = &gcref(puv[v & PROTO_UV_MASK])->uv;
         lua_assert(uv);
-        if (uv->flags & UV_ENV) {
-          setgcref(fn->l.next_ENV, obj2gco(parent));
-          fn->l.prev_ENV = parent->prev_ENV;
-          setgcref(gcref(fn->l.prev_ENV)->fn.l.next_ENV, obj2gco(fn));
-          setgcref(parent->prev_ENV, obj2gco(fn));
-        }
         setgcref(fn->l.uvptr[i], obj2gco(uv));
         break;
       case UV_IMMUTABLE:
@@ -230,21 +237,44 @@ static GCfunc *lj_func_newL(lua_State *L, GCproto *pt, GCfuncL *parent)
   return fn;
 }
   
+/* Do a GC check and create a new Lua function with inherited upvalues. */
 GCfunc *lj_func_newL_gc(lua_State *L, GCproto *pt, GCfuncL *parent)
 {
   lj_gc_check_fixtop(L);
-  return lj_func_newL(L, pt, parent);
+  return lj_func_newL(L, pt, parent, L->base);
+}
+
+#if LJ_HASJIT
+/* Create a new Lua function from a trace (FNEW). No GC check.
+** L->base is stale inside a trace, so the frame base is passed explicitly.
+*/
+GCfunc *lj_func_newL_jit(lua_State *L, GCproto *pt, GCfuncL *parent,
+			 TValue *base)
+{
+  return lj_func_newL(L, pt, parent, base);
+}
+#endif
+
+/* Give a Lua function a private env cell (setfenv). Closures created
+** afterwards inherit it, but the ones already sharing the old cell don't.
+*/
+void lj_func_setenv(lua_State *L, GCfunc *fn, GCtab *env)
+{
+  GCupval *uvold = funcenvuv(fn);
+  GCupval *uv = func_envuv(L, funcproto(fn), env);
+  MSize i;
+  uv->dhash = uvold->dhash;
+  for (i = 0; i < fn->l.nupvalues; i++)
+    if (gcref(fn->l.uvptr[i]) == obj2gco(uvold))
+      setgcref(fn->l.uvptr[i], obj2gco(uv));
+  setgcref(fn->l.env, obj2gco(uv));
+  lj_gc_objbarrier(L, fn, uv);
 }
 
 void LJ_FASTCALL lj_func_free(global_State *g, GCfunc *fn)
 {
   MSize size = isluafunc(fn) ? sizeLfunc((MSize)fn->l.nupvalues) :
 			       sizeCfunc((MSize)fn->c.nupvalues);
-  /* NOBARRIER: Should be handled in ESETV/lua_setupvalue. */
-  if (isluafunc(fn)) {
-    setgcrefr(gcref(fn->l.next_ENV)->fn.l.prev_ENV, fn->l.prev_ENV);
-    setgcrefr(gcref(fn->l.prev_ENV)->fn.l.next_ENV, fn->l.next_ENV);
-  }
   lj_mem_free(g, fn, size);
 }
 
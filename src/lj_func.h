@@ -18,7 +18,12 @@ LJ_FUNC void LJ_FASTCALL lj_func_freeuv(global_State *g, GCupval *uv);
 /* Functions (closures). */
 LJ_FUNC GCfunc *lj_func_newC(lua_State *L, MSize nelems, GCtab *env);
 LJ_FUNC GCfunc *lj_func_newL_empty(lua_State *L, GCproto *pt, GCtab *env);
+LJ_FUNC void lj_func_setenv(lua_State *L, GCfunc *fn, GCtab *env);
 LJ_FUNCA GCfunc *lj_func_newL_gc(lua_State *L, GCproto *pt, GCfuncL *parent);
+#if LJ_HASJIT
+LJ_FUNC GCfunc *lj_func_newL_jit(lua_State *L, GCproto *pt, GCfuncL *parent,
+				 TValue *base);
+#endif
 LJ_FUNC void LJ_FASTCALL lj_func_free(global_State *g, GCfunc *c);
 
 #endif
@@ -27,16 +27,46 @@
 #include "lj_trace.h"
 #include "lj_vm.h"
 
+#if LJ_TARGET_WINDOWS
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
 #define GCSTEPSIZE	1024u
 #define GCSWEEPMAX	40
 #define GCSWEEPCOST	10
 #define GCFINALIZECOST	100
+#define GCREGRAYMAX	2
+#define GCTRAVCHUNK	4096
+#define GCREMARKMAX	8
+
+/* Sub-phases of the atomic phase. Order matters. */
+enum {
+  GCAmark,	/* Traverse tables from the 2nd chance list. */
+  GCAremark,	/* Mark the roots and the 2nd chance list again. */
+  GCAfix,	/* Propagate to a fixpoint, without running the mutator. */
+  GCAsep,	/* Separate objects which were unreachable at the fixpoint. */
+  GCAmarkfin,	/* Mark them. */
+  GCAclear,	/* Clear weak tables traversed up to the fixpoint. */
+  GCAmark2, GCAremark2,
+  GCAfix2	/* Again, then finish with the newer objects. */
+};
 
 /* Macros to set GCobj colors and flags. */
 #define white2gray(x)		((x)->gch.marked &= (uint8_t)~LJ_GC_WHITES)
 #define gray2black(x)		((x)->gch.marked |= LJ_GC_BLACK)
 #define isfinalized(u)		((u)->marked & LJ_GC_FINALIZED)
 
+/* Any userdata or tables waiting for their finalizer? */
+#define gc_needfin(g)	(gcref((g)->gc.mmudata) != NULL || (g)->gc.ntofin)
+
+/* Must the invariant (no black object points to a white one) hold? */
+#define gc_keepinvariant(g) \
+  (isgenerational(g) || (g)->gc.state == GCSpropagate || \
+   (g)->gc.state == GCSatomic)
+
 /* -- Mark phase ---------------------------------------------------------- */
 
 /* Mark a TValue (if needed). */
@@ -51,8 +81,6 @@
 /* Mark a string object. */
 #define gc_mark_str(s)		((s)->marked &= (uint8_t)~LJ_GC_WHITES)
 
-static int gc_traverse_tab(global_State *g, GCtab *t);
-
 /* Mark a white GCobj. */
 static void gc_mark(global_State *g, GCobj *o)
 {
@@ -72,14 +100,8 @@ static void gc_mark(global_State *g, GCobj *o)
   } else if (gct != ~LJ_TSTR && gct != ~LJ_TCDATA) {
     lua_assert(gct == ~LJ_TFUNC || gct == ~LJ_TTAB ||
 	       gct == ~LJ_TTHREAD || gct == ~LJ_TPROTO || gct == ~LJ_TTRACE);
-    if (gct == ~LJ_TTAB && isfinalized(gco2tab(o))) {
-      /* UNSURE: Always stays gray if __gc. */
-//      gray2black(o);
-      gc_traverse_tab(g, gco2tab(o));
-    } else {
-      setgcrefr(o->gch.gclist, g->gc.gray);
-      setgcref(g->gc.gray, o);
-    }
+    setgcrefr(o->gch.gclist, g->gc.gray);
+    setgcref(g->gc.gray, o);
   }
 }
 
@@ -95,9 +117,24 @@ static void gc_mark_gcroot(global_State *g)
 /* Start a GC cycle and mark the root set. */
 static void gc_mark_start(global_State *g)
 {
-  setgcrefnull(g->gc.gray);
-  setgcrefnull(g->gc.grayagain);
-  setgcrefnull(g->gc.weak);
+  if (isgenerational(g)) {
+    /* Minor cycle: the old generation is only reached via the gray lists. */
+    GCobj *o = gcref(g->gc.weak);
+    setgcrefnull(g->gc.weak);
+    while (o) {  /* Traverse all weak tables again, so they get cleared. */
+      GCobj *next = gcref(gco2tab(o)->gclist);
+      setgcrefr(gco2tab(o)->gclist, g->gc.gray);
+      setgcref(g->gc.gray, o);
+      o = next;
+    }
+  } else {
+    setgcrefnull(g->gc.gray);
+    setgcrefnull(g->gc.grayagain);
+    setgcrefnull(g->gc.weak);
+  }
+  g->gc.regray = 0;
+  g->gc.passcost = 0;
+  setgcrefnull(g->gc.travtab);
   gc_markobj(g, mainthread(g));
   gc_markobj(g, tabref(mainthread(g)->env));
   gc_marktv(g, &g->registrytv);
@@ -116,63 +153,117 @@ static void gc_mark_uv(global_State *g)
   }
 }
 
-/* Mark userdata and tables in mmudata list. */
-static void gc_mark_mmudata(global_State *g)
+/* Link userdata to the end of a circular list, e.g. the mmudata list. */
+static void gc_linkfin(GCRef *list, GCobj *o)
 {
-  GCobj *root = gcref(g->gc.mmudata);
-  GCobj *u = root;
-  if (u) {
-    do {
-      u = gcnext(u);
-      makewhite(g, u);  /* Could be from previous GC. */
-      gc_mark(g, u);
-    } while (u != root);
+  if (gcref(*list)) {  /* Link to end of list. */
+    GCobj *root = gcref(*list);
+    setgcrefr(o->gch.nextgc, root->gch.nextgc);
+    setgcref(root->gch.nextgc, o);
+  } else {  /* Create circular list. */
+    setgcref(o->gch.nextgc, o);
   }
+  setgcref(*list, o);
 }
 
-/* Separate userdata objects to be finalized to mmudata list. */
-size_t lj_gc_separateudata(global_State *g, int all)
+/* Mark a chunk of separated userdata and tables to be finalized. */
+static size_t gc_mark_mmudata(global_State *g)
+{
+  int lim = GCSWEEPMAX;
+  for (; lim > 0 && gcref(g->gc.sepmark) != NULL; lim--) {
+    GCobj *root = gcref(g->gc.sepmark);
+    GCobj *u = gcnext(root);
+    if (u == root)  /* Move it to the mmudata list. */
+      setgcrefnull(g->gc.sepmark);
+    else
+      setgcrefr(root->gch.nextgc, u->gch.nextgc);
+    gc_linkfin(&g->gc.mmudata, u);
+    makewhite(g, u);  /* Could be from previous GC. */
+    gc_mark(g, u);
+  }
+  for (; lim > 0 && g->gc.markfin < g->gc.ntofin; lim--) {
+    GCobj *o = gcref(g->gc.fin[g->gc.markfin++]);
+    gc_markobj(g, o);
+  }
+  return (size_t)(GCSWEEPMAX - lim) * GCSWEEPCOST;
+}
+
+/* Separate tables to be finalized to the front of the fin vector. */
+static MSize gc_separatetab(global_State *g, MSize i, MSize n, int all)
+{
+  GCRef *fin = g->gc.fin;
+  lua_assert(i >= g->gc.ntofin);
+  for (; i < n; i++) {
+    GCobj *o = gcref(fin[i]);
+    lua_assert(isfinalized(gco2tab(o)));
+    if (iswhite(o) || all) {  /* Swap it into the to-be-finalized part. */
+      fin[i] = fin[g->gc.ntofin];
+      setgcref(fin[g->gc.ntofin++], o);
+    }
+  }
+  return i;
+}
+
+/* Separate userdata objects to be finalized from a userdata list. */
+static GCRef *gc_separate(global_State *g, GCRef *p, GCRef *list,
+			  uint32_t lim, int all)
 {
-  size_t m = 0;
-  GCRef *p = &mainthread(g)->nextgc;
   GCobj *o;
-  while ((o = gcref(*p)) != NULL) {
-    int isud = o->gch.gct == ~LJ_TUDATA;
-    lua_assert(isud || o->gch.gct == ~LJ_TTAB);
-    if (!(iswhite(o) || all) || (isud && isfinalized(&(o->gch)))) {
+  while ((o = gcref(*p)) != NULL && lim-- > 0) {
+    if (!(iswhite(o) || all) || isfinalized(gco2ud(o))) {
       p = &o->gch.nextgc;  /* Nothing to do. */
-    } else if (isud && !lj_meta_fastg(g, tabref(o->ud.metatable), MM_gc)) {
+    } else if (!lj_meta_fastg(g, tabref(gco2ud(o)->metatable), MM_gc)) {
       markfinalized(o);  /* Done, as there's no __gc metamethod. */
       p = &o->gch.nextgc;
-    } else {  /* Otherwise move it to mmudata list. */
-      if (isud)
-        m += sizeudata(gco2ud(o));
+    } else {  /* Otherwise move it to the list. */
+      g->gc.udsize += sizeudata(gco2ud(o));
       *p = o->gch.nextgc; /* Advance */
-      if (gcref(g->gc.mmudata)) {  /* Link to end of mmudata list. */
-	GCobj *root = gcref(g->gc.mmudata);
-	setgcrefr(o->gch.nextgc, root->gch.nextgc);
-	setgcref(root->gch.nextgc, o);
-	setgcref(g->gc.mmudata, o);
-      } else {  /* Create circular list. */
-	setgcref(o->gch.nextgc, o);
-	setgcref(g->gc.mmudata, o);
-      }
+      gc_linkfin(list, o);
     }
   }
-  return m;
+  return p;
+}
+
+/* Separate the next chunk of objects to be finalized. Returns 0 when done.
+** Userdata are taken from the list at sepcur, tables from fin[sepfin, n).
+*/
+static size_t gc_separate_step(global_State *g, MSize n)
+{
+  GCRef *p = mref(g->gc.sepcur, GCRef);
+  if (gcref(*p) != NULL) {
+    setmref(g->gc.sepcur, gc_separate(g, p, &g->gc.sepmark, GCSWEEPMAX, 0));
+    return GCSWEEPMAX*GCSWEEPCOST;
+  }
+  if (g->gc.sepfin < n) {
+    MSize i = g->gc.sepfin;
+    g->gc.sepfin = gc_separatetab(g, i, n - i > GCSWEEPMAX ? i+GCSWEEPMAX : n,
+				  0);
+    return GCSWEEPMAX*GCSWEEPCOST;
+  }
+  return 0;
 }
 
 /* -- Propagation phase --------------------------------------------------- */
 
+#if LJ_NUMARRAY
+/* Size of the array part, unless it's numeric and needs no traversal. */
+#define gc_tabasize(t)	((t)->numarr == 1 ? 0 : (t)->asize)
+#else
+#define gc_tabasize(t)	((t)->asize)
+#endif
+
 /* Traverse a table. */
 static int gc_traverse_tab(global_State *g, GCtab *t)
 {
   int weak = 0;
   cTValue *mode;
   GCtab *mt = tabref(t->metatable);
-  int tofin = isfinalized(t);
   if (mt)
     gc_markobj(g, mt);
+#if LJ_TABSHAPE
+  if (gcref(t->shape))  /* Keep template alive, its address is the shape. */
+    gc_markobj(g, gcref(t->shape));
+#endif
   mode = lj_meta_fastg(g, mt, MM_mode);
   if (mode && tvisstr(mode)) {  /* Valid __mode field? */
     const char *modestr = strVdata(mode);
@@ -184,22 +275,58 @@ static int gc_traverse_tab(global_State *g, GCtab *t)
     }
     if (weak > 0) {  /* Weak tables are cleared in the atomic phase. */
       t->marked = (uint8_t)((t->marked & ~LJ_GC_WEAK) | weak);
-      if (!tofin) { /* UNSURE: Wait until it is finalized. */
-        setgcrefr(t->gclist, g->gc.weak);
-        setgcref(g->gc.weak, obj2gco(t));
+      if (g->gc.state == GCSatomic) {  /* Keep it black, but remember it. */
+	lua_assert(g->gc.nwtab < g->gc.sizewtab);
+	setgcref(g->gc.wtab[g->gc.nwtab++], obj2gco(t));
+      } else {
+	setgcrefr(t->gclist, g->gc.weak);
+	setgcref(g->gc.weak, obj2gco(t));
       }
     }
   }
   if (weak == LJ_GC_WEAK)  /* Nothing to mark if both keys/values are weak. */
     return 1;
+  if (gc_tabasize(t) + t->hmask > GCTRAVCHUNK) {
+    setgcref(g->gc.travtab, obj2gco(t));  /* Traverse big tables in chunks. */
+    g->gc.travpos = 0;
+    g->gc.travweak = (uint8_t)weak;
+    return weak;
+  }
+#if LJ_NUMARRAY
+  if (!(weak & LJ_GC_WEAKVAL) && t->numarr != 1) {  /* Mark array part. */
+    MSize i, asize = t->asize;
+    uint8_t num = 1;
+    for (i = 0; i < asize; i++) {
+      cTValue *o = arrayslot(t, i);
+      if (!tvisnumber(o) && !tvisnil(o)) {
+	gc_marktv(g, o);
+	num = 0;
+      }
+    }
+    t->numarr = num;  /* Skip it next time, if it's numeric. */
+  }
+#else
   if (!(weak & LJ_GC_WEAKVAL)) {  /* Mark array part. */
     MSize i, asize = t->asize;
     for (i = 0; i < asize; i++)
       gc_marktv(g, arrayslot(t, i));
   }
+#endif
   if (t->hmask > 0) {  /* Mark hash part. */
     Node *node = noderef(t->node);
     MSize i, hmask = t->hmask;
+#if LJ_SWISSTAB
+    for (i = 0; i <= hmask; i += HCTRL_GROUP) {  /* Skip empty nodes. */
+      uint32_t m;
+      for (m = hctrl_used(node, hmask, i); m; m &= m-1) {
+	Node *n = &node[i + lj_ffs(m)];
+	if (!tvisnil(&n->val)) {  /* Mark non-empty slot. */
+	  if (!(weak & LJ_GC_WEAKKEY)) gc_marktv(g, &n->key);
+	  if (!(weak & LJ_GC_WEAKVAL)) gc_marktv(g, &n->val);
+	}
+      }
+    }
+#else
     for (i = 0; i <= hmask; i++) {
       Node *n = &node[i];
       if (!tvisnil(&n->val)) {  /* Mark non-empty slot. */
@@ -208,14 +335,15 @@ static int gc_traverse_tab(global_State *g, GCtab *t)
 	if (!(weak & LJ_GC_WEAKVAL)) gc_marktv(g, &n->val);
       }
     }
+#endif
   }
-  return weak || tofin; /* UNSURE: Keep gray if __gc */
+  return weak;
 }
 
 /* Traverse a function. */
 static void gc_traverse_func(global_State *g, GCfunc *fn)
 {
-  gc_markobj(g, tabref(fn->c.env));
+  gc_markobj(g, gcref(fn->c.env));  /* Env table or env cell (Lua). */
   if (isluafunc(fn)) {
     uint32_t i;
     lua_assert(fn->l.nupvalues <= funcproto(fn)->sizeuv);
@@ -320,10 +448,12 @@ static size_t propagatemark(global_State *g)
   setgcrefr(g->gc.gray, o->gch.gclist);  /* Remove from gray list. */
   if (LJ_LIKELY(gct == ~LJ_TTAB)) {
     GCtab *t = gco2tab(o);
-    if (gc_traverse_tab(g, t) > 0)
-      black2gray(o);  /* Keep weak tables gray. */
-    return sizeof(GCtab) + sizeof(TValue) * t->asize +
-			   sizeof(Node) * (t->hmask + 1);
+    if (gc_traverse_tab(g, t) > 0 && g->gc.state != GCSatomic)
+      black2gray(o);  /* Keep weak tables gray, until the atomic phase. */
+    if (gcref(g->gc.travtab) == o)
+      return sizeof(GCtab);
+    return sizeof(GCtab) + sizeof(TValue) * gc_tabasize(t) +
+			   sizehpart(t->hmask);
   } else if (LJ_LIKELY(gct == ~LJ_TFUNC)) {
     GCfunc *fn = gco2func(o);
     gc_traverse_func(g, fn);
@@ -353,12 +483,93 @@ static size_t propagatemark(global_State *g)
   }
 }
 
-/* Propagate all gray objects. */
-static size_t gc_propagate_gray(global_State *g)
+/* Traverse the next chunk of a big table.
+** The table is black in between, so any store or slot move makes it gray
+** and puts it on the 2nd chance list, where it's traversed again anyway.
+** Continue marking it, so the atomic phase finds most slots marked.
+** Weak tables stay gray, the atomic phase traverses them again, too.
+*/
+static size_t gc_traverse_chunk(global_State *g)
+{
+  GCtab *t = gco2tab(gcref(g->gc.travtab));
+  MSize start = g->gc.travpos, i = start, asize = t->asize, n;
+  int weak = g->gc.travweak;
+  if (i == 0 && (weak & LJ_GC_WEAKVAL))
+    start = i = asize;  /* Skip weak array part. */
+#if LJ_NUMARRAY
+  if (i == 0) {
+    if (t->numarr == 1)
+      start = i = asize;  /* Skip numeric array part. */
+    else
+      t->numarr = 2;  /* Check in progress, any store clears it. */
+  }
+  n = start + GCTRAVCHUNK;
+  for (; i < asize && i < n; i++) {  /* Mark array part. */
+    cTValue *o = arrayslot(t, i);
+    if (!tvisnumber(o) && !tvisnil(o)) {
+      gc_marktv(g, o);
+      t->numarr = 0;
+    }
+  }
+  if (i == asize && t->numarr == 2)
+    t->numarr = 1;
+#else
+  n = start + GCTRAVCHUNK;
+  for (; i < asize && i < n; i++)  /* Mark array part. */
+    gc_marktv(g, arrayslot(t, i));
+#endif
+  for (; i < n && i - asize <= t->hmask; i++) {  /* Mark hash part. */
+    Node *node = &noderef(t->node)[i - asize];
+    if (!tvisnil(&node->val)) {
+      if (!(weak & LJ_GC_WEAKKEY)) gc_marktv(g, &node->key);
+      if (!(weak & LJ_GC_WEAKVAL)) gc_marktv(g, &node->val);
+    }
+  }
+  if (i >= asize && i - asize > t->hmask)
+    setgcrefnull(g->gc.travtab);  /* Done. */
+  g->gc.travpos = i;
+  return sizeof(TValue) * (i - start);
+}
+
+/* Move tables from the 2nd chance list back to the gray list.
+** This traverses them incrementally and keeps the atomic phase short.
+** Threads stay, their stacks can only be traversed atomically.
+*/
+static int gc_regray(global_State *g)
+{
+  GCRef *p = &g->gc.grayagain;
+  GCobj *o;
+  int n = 0;
+  while ((o = gcref(*p)) != NULL) {
+    if (o->gch.gct == ~LJ_TTAB) {
+      setgcrefr(*p, gco2tab(o)->gclist);
+      setgcrefr(gco2tab(o)->gclist, g->gc.gray);
+      setgcref(g->gc.gray, o);
+      n++;
+    } else {
+      p = &gco2th(o)->gclist;
+    }
+  }
+  return n;
+}
+
+/* Estimate the cost of traversing the 2nd chance list. */
+static GCSize gc_graycost(global_State *g)
 {
-  size_t m = 0;
-  while (gcref(g->gc.gray) != NULL)
-    m += propagatemark(g);
+  GCobj *o;
+  GCSize m = 0;
+  for (o = gcref(g->gc.grayagain); o != NULL; o = gcref(o->gch.gclist)) {
+    if (o->gch.gct == ~LJ_TTAB) {
+      GCtab *t = gco2tab(o);
+      MSize asize = gc_tabasize(t);
+      if (asize + t->hmask > GCTRAVCHUNK)  /* Same as the chunked traversal. */
+	m += sizeof(GCtab) + sizeof(TValue) * (asize + t->hmask + 1);
+      else
+	m += sizeof(GCtab) + sizeof(TValue) * asize + sizehpart(t->hmask);
+    } else {
+      m += sizeof(lua_State) + sizeof(TValue) * gco2th(o)->stacksize;
+    }
+  }
   return m;
 }
 
@@ -402,7 +613,8 @@ static GCRef *gc_sweep(global_State *g, GCRef *p, uint32_t lim)
       gc_fullsweep(g, &gco2th(o)->openupval);
     if (((o->gch.marked ^ LJ_GC_WHITES) & ow)) {  /* Black or current white? */
       lua_assert(!isdead(g, o) || (o->gch.marked & LJ_GC_FIXED));
-      makewhite(g, o);  /* Value is alive, change to the current white. */
+      if (!isgenerational(g))  /* Otherwise it keeps its mark, i.e. is old. */
+	makewhite(g, o);  /* Value is alive, change to the current white. */
       p = &o->gch.nextgc;
     } else {  /* Otherwise value is dead, free it. */
       lua_assert(isdead(g, o) || ow == LJ_GC_SFIXED);
@@ -415,6 +627,28 @@ static GCRef *gc_sweep(global_State *g, GCRef *p, uint32_t lim)
   return p;
 }
 
+/* Generational sweep of the root list. Stops at the old generation. */
+static GCRef *gc_sweepyoung(global_State *g, GCRef *p, uint32_t lim)
+{
+  GCobj *o;
+  if (gcref(g->gc.genhead) == NULL)  /* Young objects done, sweep userdata. */
+    return gc_sweep(g, p, lim);
+  while (lim-- > 0) {
+    GCRef *q;
+    if ((o = gcref(*p)) == gcref(g->gc.oldroot)) {
+      /* Whatever survived from the head at the atomic phase on is old now. */
+      setgcrefr(g->gc.oldroot, g->gc.genhead);
+      setgcrefnull(g->gc.genhead);
+      return o ? &mainthread(g)->nextgc : p;
+    }
+    q = gc_sweep(g, p, 1);
+    if (q == p && o == gcref(g->gc.genhead))  /* Dead, move the boundary. */
+      setgcrefr(g->gc.genhead, *p);
+    p = q;
+  }
+  return p;
+}
+
 /* Check whether we can clear a key or a value slot from a table. */
 static int gc_mayclear(cTValue *o, int val)
 {
@@ -431,34 +665,75 @@ static int gc_mayclear(cTValue *o, int val)
   return 0;  /* Cannot clear. */
 }
 
-/* Clear collected entries from weak tables. */
-static void gc_clearweak(GCobj *o)
+/* Clear collected entries from the slots [i, n) of a weak table.
+** Returns the next slot to clear.
+*/
+static MSize gc_cleartab(GCtab *t, MSize i, MSize n)
 {
-  while (o) {
-    GCtab *t = gco2tab(o);
-    lua_assert((t->marked & LJ_GC_WEAK));
-    if ((t->marked & LJ_GC_WEAKVAL)) {
-      MSize i, asize = t->asize;
-      for (i = 0; i < asize; i++) {
-	/* Clear array slot when value is about to be collected. */
-	TValue *tv = arrayslot(t, i);
-	if (gc_mayclear(tv, 1))
-	  setnilV(tv);
+  MSize asize = t->asize;
+  if (i < asize && !(t->marked & LJ_GC_WEAKVAL))
+    i = asize;  /* Skip strong array part. */
+  for (; i < asize && i < n; i++) {
+    /* Clear array slot when value is about to be collected. */
+    TValue *tv = arrayslot(t, i);
+    if (gc_mayclear(tv, 1))
+      setnilV(tv);
+  }
+  for (; i < n && i - asize <= t->hmask; i++) {
+    Node *node = &noderef(t->node)[i - asize];
+    /* Clear hash slot when key or value is about to be collected. */
+    if (!tvisnil(&node->val) && (gc_mayclear(&node->key, 0) ||
+				 gc_mayclear(&node->val, 1)))
+      setnilV(&node->val);
+  }
+  return i;
+}
+
+/* Clear a chunk of the weak tables traversed up to the first fixpoint.
+** Anything white in a black table was unreachable at the fixpoint. A
+** white store makes the table gray and it's traversed again, so it's
+** left for gc_clearweak. Black tables aren't linked, so a table links
+** to itself once it's cleared.
+*/
+static size_t gc_clearweak_step(global_State *g)
+{
+  while (g->gc.wclear < g->gc.nwfix) {
+    GCtab *t = gco2tab(gcref(g->gc.wtab[g->gc.wclear]));
+    if (isblack(obj2gco(t)) && gcref(t->gclist) != obj2gco(t)) {
+      MSize i = g->gc.wclearpos, n = gc_cleartab(t, i, i + GCTRAVCHUNK);
+      if (n <= t->asize + t->hmask) {
+	g->gc.wclearpos = n;  /* Continue with this table. */
+      } else {
+	setgcref(t->gclist, obj2gco(t));  /* Mark it as cleared. */
+	g->gc.wclear++;
+	g->gc.wclearpos = 0;
       }
+      return sizeof(TValue) * (n - i);
     }
-    if (t->hmask > 0) {
-      Node *node = noderef(t->node);
-      MSize i, hmask = t->hmask;
-      for (i = 0; i <= hmask; i++) {
-	Node *n = &node[i];
-	/* Clear hash slot when key or value is about to be collected. */
-	if (!tvisnil(&n->val) && (gc_mayclear(&n->key, 0) ||
-				  gc_mayclear(&n->val, 1)))
-	  setnilV(&n->val);
-      }
+    g->gc.wclear++;  /* Gray or cleared already. */
+    g->gc.wclearpos = 0;
+  }
+  return 0;
+}
+
+/* Clear collected entries from all weak tables traversed by the atomic
+** phase, unless they were cleared in chunks already. Duplicates are gray
+** by the time they're seen again.
+*/
+static void gc_clearweak(global_State *g)
+{
+  MSize i, n = g->gc.nwtab;
+  for (i = 0; i < n; i++) {
+    GCtab *t = gco2tab(gcref(g->gc.wtab[i]));
+    if (isblack(obj2gco(t))) {  /* Keep weak tables gray and listed. */
+      if (gcref(t->gclist) != obj2gco(t))
+	gc_cleartab(t, 0, ~(MSize)0);
+      black2gray(obj2gco(t));
+      setgcrefr(t->gclist, g->gc.weak);
+      setgcref(g->gc.weak, obj2gco(t));
     }
-    o = gcref(t->gclist);
   }
+  g->gc.nwtab = 0;
 }
 
 /* Call a userdata or cdata finalizer. */
@@ -485,21 +760,32 @@ static void gc_call_finalizer(global_State *g, lua_State *L,
     lj_err_throw(L, errcode);  /* Propagate errors. */
 }
 
-/* Finalize one userdata or cdata object from the mmudata list. */
+/* Finalize one userdata or cdata object from the mmudata list or a table. */
 static void gc_finalize(lua_State *L)
 {
   global_State *g = G(L);
-  GCobj *o = gcnext(gcref(g->gc.mmudata));
+  GCobj *o;
   cTValue *mo;
-  int gct = o->gch.gct;
   lua_assert(tvref(g->jit_base) == NULL);  /* Must not be called on trace. */
+  if (gcref(g->gc.mmudata) == NULL) {
+    MSize n = --g->gc.ntofin;
+    /* Take the table off the fin vector. It has never left the root list. */
+    o = gcref(g->gc.fin[n]);
+    g->gc.fin[n] = g->gc.fin[--g->gc.nfin];
+    clearfinalized(o);  /* Setting the metatable again re-registers it. */
+    mo = lj_meta_fastg(g, tabref(gco2tab(o)->metatable), MM_gc);
+    if (mo)
+      gc_call_finalizer(g, L, mo, o);
+    return;
+  }
+  o = gcnext(gcref(g->gc.mmudata));
   /* Unchain from list of userdata to be finalized. */
   if (o == gcref(g->gc.mmudata))
     setgcrefnull(g->gc.mmudata);
   else
     setgcrefr(gcref(g->gc.mmudata)->gch.nextgc, o->gch.nextgc);
 #if LJ_HASFFI
-  if (gct == ~LJ_TCDATA) {
+  if (o->gch.gct == ~LJ_TCDATA) {
     TValue tmp, *tv;
     /* Add cdata back to the GC list and make it white. */
     setgcrefr(o->gch.nextgc, g->gc.root);
@@ -518,69 +804,46 @@ static void gc_finalize(lua_State *L)
     return;
   }
 #endif
-  if (gct == ~LJ_TTAB) {
-    /* Add table back to the main userdata list and make it white. */
-    setgcrefr(o->gch.nextgc, g->gc.root);
-    setgcref(g->gc.root, o);
-    clearfinalized(o); /* This stops it from being finalized again.  */
-  } else {
-    /* Add userdata back to the main userdata list and make it white. */
-    setgcrefr(o->gch.nextgc, mainthread(g)->nextgc);
-    setgcref(mainthread(g)->nextgc, o);
-    markfinalized(o); /* This stops it from being finalized again.  */
-  }
+  /* Add userdata back to the main userdata list and make it white. */
+  setgcrefr(o->gch.nextgc, mainthread(g)->nextgc);
+  setgcref(mainthread(g)->nextgc, o);
   makewhite(g, o);
+  markfinalized(o);  /* This stops it from being finalized again. */
   /* Resolve the __gc metamethod. */
-  mo = lj_meta_fastg(g, tabref(o->ud.metatable), MM_gc);
+  mo = lj_meta_fastg(g, tabref(gco2ud(o)->metatable), MM_gc);
   if (mo)
     gc_call_finalizer(g, L, mo, o);
 }
 
-/* Finalize all userdata objects from mmudata list. */
+/* Finalize all userdata objects from mmudata list and pending tables. */
 void lj_gc_finalize_udata(lua_State *L)
 {
-  while (gcref(G(L)->gc.mmudata) != NULL)
+  while (gc_needfin(G(L)))
     gc_finalize(L);
 }
 
-void lj_gc_checkfinalizer(lua_State *L, GCobj *o)
-{
-  /* TBD */
-}
-
+/* Register a table with a __gc metamethod for finalization. O(1). */
 void lj_gc_tab_finalized(lua_State *L, GCobj *o)
 {
   global_State *g = G(L);
-  GCobj *p, *t = obj2gco(mainthread(g));
-  GCRef *ref = &g->gc.root;
-
-  /* Already marked for finalization. */
-  if (isfinalized(gco2tab(o)))
+  if (isfinalized(gco2tab(o)))  /* Already registered. */
     return;
+  if (g->gc.nfin >= g->gc.sizefin)
+    lj_mem_growvec(L, g->gc.fin, g->gc.sizefin, LJ_MAX_ASIZE, GCRef);
+  setgcref(g->gc.fin[g->gc.nfin++], o);
+  markfinalized(o);  /* Cleared just before __gc is called. */
+}
 
-  /* UNSURE: Sweep points to current object, skip it.
-   * TBD: gclist?
-   * We could advance GC to some safe state, but wouldn't that be slow? */
-  if (mref(g->gc.sweep, GCRef) == &o->gch.nextgc)
-    setmref(g->gc.sweep, gc_sweep(g, mref(g->gc.sweep, GCRef), 1));
-
-  /* Find object in gc root list. */
-  for (p = gcref(g->gc.root); p != o; p = gcnext(p))
-    ref = &p->gch.nextgc;
-
-  /* Unlink. */
-  setgcref(*ref, gcnext(o));
-
-  /* And put it into userdata list. */
-  setgcrefr(o->gch.nextgc, t->gch.nextgc);
-  setgcref(t->gch.nextgc, o);
-
-  /* Mark as such. This is cleared just before __gc is called. */
-  markfinalized(o);
-
-  /* UNSURE: GC invariant. */
-  if (g->gc.state == GCSpropagate || g->gc.state == GCSatomic)
-    makewhite(g, o);
+/* Register a table for finalization if its metatable has a __gc field. */
+void lj_gc_checkfinalizer(lua_State *L, GCtab *t)
+{
+#if !LJ_51
+  GCtab *mt = tabref(t->metatable);
+  if (mt && lj_meta_fast(L, mt, MM_gc))
+    lj_gc_tab_finalized(L, obj2gco(t));
+#else
+  UNUSED(L); UNUSED(t);
+#endif
 }
 
 #if LJ_HASFFI
@@ -617,45 +880,190 @@ void lj_gc_freeall(global_State *g)
   gc_fullsweep(g, &g->gc.root);
   strmask = g->strmask;
   for (i = 0; i <= strmask; i++)  /* Free all string hash chains. */
-    gc_fullsweep(g, &g->strhash[i]);
+    if (lj_str_chainok(g, i))
+      gc_fullsweep(g, &g->strhash[i]);
+  if (g->stroldhash) {  /* And the ones not yet migrated by a resize. */
+    strmask = g->stroldmask;
+    for (i = 0; i <= strmask; i++)
+      gc_fullsweep(g, &g->stroldhash[i]);
+  }
 }
 
 /* -- Collector ----------------------------------------------------------- */
 
-/* Atomic part of the GC cycle, transitioning from mark to sweep phase. */
-static void atomic(global_State *g, lua_State *L)
+/* Start the atomic phase, transitioning from mark to sweep phase.
+** It's split into steps, too. Only the remark of the roots and the 2nd
+** chance list and the propagation of it must not be interrupted by the
+** mutator. Anything that's white at such a fixpoint is unreachable.
+*/
+static void gc_atomic_start(global_State *g)
 {
-  size_t udsize;
-
-  gc_mark_uv(g);  /* Need to remark open upvalues (the thread may be dead). */
-  gc_propagate_gray(g);  /* Propagate any left-overs. */
-
   setgcrefr(g->gc.gray, g->gc.weak);  /* Empty the list of weak tables. */
   setgcrefnull(g->gc.weak);
+  setgcrefr(g->gc.sepmark, g->gc.mmudata);  /* Could be from previous GC. */
+  setgcrefnull(g->gc.mmudata);
+  g->gc.markfin = 0;
+  g->gc.udsize = 0;
+  g->gc.remarks = 0;
+  g->gc.regray = 0;
+  g->gc.atomic = GCAmark;
+  g->gc.state = GCSatomic;
+}
+
+/* Undo the list changes of an unfinished atomic phase. */
+static void gc_atomic_reset(global_State *g)
+{
+  if (gcref(g->gc.sepud)) {  /* Reattach the detached userdata. */
+    GCRef *p = &mainthread(g)->nextgc;
+    while (gcref(*p))
+      p = &gcref(*p)->gch.nextgc;
+    setgcrefr(*p, g->gc.sepud);
+    setgcrefnull(g->gc.sepud);
+  }
+  if (gcref(g->gc.sepmark)) {  /* Separated userdata are still finalized. */
+    GCobj *root = gcref(g->gc.mmudata), *sep = gcref(g->gc.sepmark);
+    if (root) {  /* Join both circular lists. */
+      GCobj *u = gcnext(root);
+      setgcrefr(root->gch.nextgc, sep->gch.nextgc);
+      setgcref(sep->gch.nextgc, u);
+    }
+    setgcref(g->gc.mmudata, sep);
+    setgcrefnull(g->gc.sepmark);
+  }
+  g->gc.nwtab = 0;
+}
+
+/* Mark the roots and the 2nd chance list again.
+** Gray objects left over from an interrupted fixpoint are kept.
+*/
+static void gc_remark(global_State *g, lua_State *L)
+{
+  GCobj *o = gcref(g->gc.grayagain);
+  if (o) {  /* Prepend the 2nd chance list to the gray list. */
+    while (gcref(o->gch.gclist))
+      o = gcref(o->gch.gclist);
+    setgcrefr(o->gch.gclist, g->gc.gray);
+    setgcrefr(g->gc.gray, g->gc.grayagain);
+    setgcrefnull(g->gc.grayagain);
+  }
+  gc_mark_uv(g);  /* Need to remark open upvalues (the thread may be dead). */
   lua_assert(!iswhite(obj2gco(mainthread(g))));
   gc_markobj(g, L);  /* Mark running thread. */
   gc_traverse_curtrace(g);  /* Traverse current trace. */
   gc_mark_gcroot(g);  /* Mark GC roots (again). */
-  gc_propagate_gray(g);  /* Propagate all of the above. */
+}
 
-  setgcrefr(g->gc.gray, g->gc.grayagain);  /* Empty the 2nd chance list. */
-  setgcrefnull(g->gc.grayagain);
-  gc_propagate_gray(g);  /* Propagate it. */
+/* The mutator ran since the last step. The fixpoint needs a new remark. */
+static void gc_atomic_interrupt(global_State *g)
+{
+  if (g->gc.state == GCSatomic &&
+      (g->gc.atomic == GCAfix || g->gc.atomic == GCAfix2)) {
+    g->gc.atomic--;
+    g->gc.remarks++;
+  }
+}
 
-  udsize = lj_gc_separateudata(g, 0);  /* Separate userdata to be finalized. */
-  gc_mark_mmudata(g);  /* Mark them. */
-  udsize += gc_propagate_gray(g);  /* And propagate the marks. */
+/* Finish the atomic phase, start the sweep phase. */
+static void gc_atomic_finish(global_State *g, lua_State *L)
+{
+  /* Append the detached userdata to the newer ones. */
+  lua_assert(gcref(*mref(g->gc.sepcur, GCRef)) == NULL);
+  setgcrefr(*mref(g->gc.sepcur, GCRef), g->gc.sepud);
+  setgcrefnull(g->gc.sepud);
 
   /* All marking done, clear weak tables. */
-  gc_clearweak(gcref(g->gc.weak));
+  gc_clearweak(g);
 
   lj_buf_shrink(L, &g->tmpbuf);  /* Shrink temp buffer. */
 
+  if (g->gc.kind == GCKmajor) {  /* All survivors of a major cycle are old. */
+    g->gc.kind = GCKgen;
+    g->gc.majorbase = 0;  /* Signals the end of a major cycle. */
+    setgcrefnull(g->gc.oldroot);
+  }
+  setgcrefr(g->gc.genhead, g->gc.root);
+
   /* Prepare for sweep phase. */
   g->gc.currentwhite = (uint8_t)otherwhite(g);  /* Flip current white. */
   g->strempty.marked = g->gc.currentwhite;
   setmref(g->gc.sweep, &g->gc.root);
-  g->gc.estimate = g->gc.total - (GCSize)udsize;  /* Initial estimate. */
+  g->gc.estimate = g->gc.total - g->gc.udsize;  /* Initial estimate. */
+  g->gc.state = GCSsweepstring;  /* Start of sweep phase. */
+  g->gc.sweepstr = 0;
+}
+
+/* Perform one step of the atomic phase. Not called on trace. */
+static size_t gc_atomic_step(global_State *g, lua_State *L)
+{
+  size_t m;
+  if (g->gc.atomic == GCAremark || g->gc.atomic == GCAremark2) {
+    if (g->gc.atomic == GCAremark2) {
+      setmref(g->gc.sepcur, &mainthread(g)->nextgc);  /* Newer userdata. */
+      /* Newer tables with __gc. Some may be separated already. */
+      g->gc.sepfin = g->gc.ntofin > g->gc.nfinold ? g->gc.ntofin :
+						      g->gc.nfinold;
+    }
+    /* Does the mutator dirty more than a whole step traverses? */
+    if (g->gc.remarks > 1 && gc_graycost(g) > g->gc.passcost)
+      g->gc.remarks = GCREMARKMAX+1;  /* Then it won't converge. */
+    gc_remark(g, L);  /* Right at the start, so the fixpoint gets a full step. */
+    g->gc.passcost = 0;
+    g->gc.atomic++;
+    return 0;
+  }
+  if (gcref(g->gc.travtab) != NULL)
+    return gc_traverse_chunk(g);  /* Continue traversal of a big table. */
+  if (gcref(g->gc.gray) != NULL) {
+    if (g->gc.nwtab >= g->gc.sizewtab)  /* Room for a weak table. */
+      lj_mem_growvec(L, g->gc.wtab, g->gc.sizewtab, LJ_MAX_ASIZE, GCRef);
+    return propagatemark(g);  /* Propagate one gray object. */
+  }
+  switch (g->gc.atomic) {
+  case GCAmark: case GCAmark2:
+    /* Catch up with stores of the mutator first, while the passes shrink. */
+    if (gc_graycost(g) > g->gc.passcost) {
+      g->gc.remarks = GCREMARKMAX+1;  /* Otherwise reach the fixpoint now. */
+    } else if (g->gc.regray < GCREMARKMAX && gc_regray(g)) {
+      g->gc.regray++;
+      g->gc.passcost = 0;
+      return 0;
+    }
+    break;
+  case GCAfix:
+    /* Detach the userdata, the mutator may add newer ones in between. */
+    setgcrefr(g->gc.sepud, mainthread(g)->nextgc);
+    setgcrefnull(mainthread(g)->nextgc);
+    setmref(g->gc.sepcur, &g->gc.sepud);
+    g->gc.sepfin = g->gc.ntofin;
+    g->gc.nfinold = g->gc.nfin;
+    g->gc.nwfix = g->gc.nwtab;
+    g->gc.wclear = g->gc.wclearpos = 0;
+    g->gc.remarks = 0;
+    g->gc.regray = 0;
+    break;
+  case GCAsep:
+    if ((m = gc_separate_step(g, g->gc.nfinold)))
+      return m;
+    break;
+  case GCAmarkfin:
+    if ((m = gc_mark_mmudata(g)))
+      return m;
+    break;
+  case GCAclear:
+    if ((m = gc_clearweak_step(g)))
+      return m;
+    break;
+  case GCAfix2:
+    if ((m = gc_separate_step(g, g->gc.nfin)) || (m = gc_mark_mmudata(g)))
+      return m;
+    gc_atomic_finish(g, L);
+    return 0;
+  default:
+    lua_assert(0);
+    break;
+  }
+  g->gc.atomic++;
+  return 0;
 }
 
 /* GC state machine. Returns a cost estimate for each step performed. */
@@ -666,22 +1074,44 @@ static size_t gc_onestep(lua_State *L)
   case GCSpause:
     gc_mark_start(g);  /* Start a new GC cycle by marking all GC roots. */
     return 0;
-  case GCSpropagate:
-    if (gcref(g->gc.gray) != NULL)
-      return propagatemark(g);  /* Propagate one gray object. */
-    g->gc.state = GCSatomic;  /* End of mark phase. */
-    return 0;
-  case GCSatomic:
+  case GCSpropagate: {
+    size_t m;
+    if (gcref(g->gc.travtab) != NULL) {
+      m = gc_traverse_chunk(g);  /* Continue traversal of a big table. */
+    } else if (gcref(g->gc.gray) != NULL) {
+      m = propagatemark(g);  /* Propagate one gray object. */
+    } else {
+      if (g->gc.regray < GCREGRAYMAX && gc_regray(g)) {
+	g->gc.regray++;
+	g->gc.passcost = 0;
+      } else {
+	gc_atomic_start(g);  /* End of mark phase. */
+      }
+      return 0;
+    }
+    g->gc.passcost += (GCSize)m;
+    return m;
+    }
+  case GCSatomic: {
+    size_t m = 0;
     if (tvref(g->jit_base))  /* Don't run atomic phase on trace. */
       return LJ_MAX_MEM;
-    atomic(g, L);
-    g->gc.state = GCSsweepstring;  /* Start of sweep phase. */
-    g->gc.sweepstr = 0;
-    return 0;
+    do {  /* Reach the fixpoint in one go, if the mutator keeps interrupting. */
+      m += gc_atomic_step(g, L);
+    } while (g->gc.state == GCSatomic && g->gc.remarks > GCREMARKMAX);
+    g->gc.passcost += (GCSize)m;
+    return m;
+    }
   case GCSsweepstring: {
     GCSize old = g->gc.total;
-    gc_fullsweep(g, &g->strhash[g->gc.sweepstr++]);  /* Sweep one chain. */
-    if (g->gc.sweepstr > g->strmask)
+    MSize i = g->gc.sweepstr++;
+    if (i <= g->strmask) {
+      if (lj_str_chainok(g, i))
+	gc_fullsweep(g, &g->strhash[i]);  /* Sweep one chain. */
+    } else  /* Then the old chains of an unfinished resize. */
+      gc_fullsweep(g, &g->stroldhash[i - g->strmask - 1]);
+    if (g->gc.sweepstr > g->strmask +
+			 (g->stroldhash ? g->stroldmask+1 : 0))
       g->gc.state = GCSsweep;  /* All string hash chains sweeped. */
     lua_assert(old >= g->gc.total);
     g->gc.estimate -= old - g->gc.total;
@@ -689,13 +1119,18 @@ static size_t gc_onestep(lua_State *L)
     }
   case GCSsweep: {
     GCSize old = g->gc.total;
-    setmref(g->gc.sweep, gc_sweep(g, mref(g->gc.sweep, GCRef), GCSWEEPMAX));
+    GCRef *p = mref(g->gc.sweep, GCRef);
+    if (g->stroldhash)  /* Help an unfinished string table resize. */
+      lj_str_migrate(g, GCSWEEPMAX);
+    p = isgenerational(g) ? gc_sweepyoung(g, p, GCSWEEPMAX) :
+			    gc_sweep(g, p, GCSWEEPMAX);
+    setmref(g->gc.sweep, p);
     lua_assert(old >= g->gc.total);
     g->gc.estimate -= old - g->gc.total;
     if (gcref(*mref(g->gc.sweep, GCRef)) == NULL) {
       if (g->strnum <= (g->strmask >> 2) && g->strmask > LJ_MIN_STRTAB*2-1)
 	lj_str_resize(L, g->strmask >> 1);  /* Shrink string table. */
-      if (gcref(g->gc.mmudata)) {  /* Need any finalizations? */
+      if (gc_needfin(g)) {  /* Need any finalizations? */
 	g->gc.state = GCSfinalize;
 #if LJ_HASFFI
 	g->gc.nocdatafin = 1;
@@ -708,7 +1143,7 @@ static size_t gc_onestep(lua_State *L)
     return GCSWEEPMAX*GCSWEEPCOST;
     }
   case GCSfinalize:
-    if (gcref(g->gc.mmudata) != NULL) {
+    if (gc_needfin(g)) {
       if (tvref(g->jit_base))  /* Don't call finalizers on trace. */
 	return LJ_MAX_MEM;
       gc_finalize(L);  /* Finalize one userdata object. */
@@ -728,6 +1163,51 @@ static size_t gc_onestep(lua_State *L)
   }
 }
 
+/* Start a sweep which turns the old generation white again. */
+static void gc_whiten(global_State *g)
+{
+  if (g->gc.state == GCSatomic)
+    gc_atomic_reset(g);
+  setmref(g->gc.sweep, &g->gc.root);  /* Sweep everything (preserving it). */
+  setgcrefnull(g->gc.gray);  /* Reset lists from partial propagation. */
+  setgcrefnull(g->gc.grayagain);
+  setgcrefnull(g->gc.weak);
+  setgcrefnull(g->gc.travtab);
+  g->gc.state = GCSsweepstring;
+  g->gc.sweepstr = 0;
+}
+
+/* Separate userdata objects to be finalized to mmudata list. */
+void lj_gc_separateudata(global_State *g, int all)
+{
+  if (g->gc.state == GCSatomic)  /* Caught somewhere in the middle. */
+    gc_whiten(g);  /* Fast forward to the sweep phase. */
+  gc_separate(g, &mainthread(g)->nextgc, &g->gc.mmudata, ~(uint32_t)0, all);
+  gc_separatetab(g, g->gc.ntofin, g->gc.nfin, all);
+}
+
+/* Compute the GC threshold after a cycle. Maybe start a major cycle. */
+static GCSize gc_newthreshold(global_State *g)
+{
+  int64_t nt;
+  if (g->gc.kind == GCKmajor) {
+    return g->gc.total;  /* Continue with the major cycle right away. */
+  } else if (isgenerational(g)) {
+    if (g->gc.majorbase == 0) {  /* Major cycle just finished. */
+      g->gc.majorbase = g->gc.estimate;
+    } else if (g->gc.estimate >
+	       (int64_t)(g->gc.majorbase/100) * g->gc.majorinc) {
+      g->gc.kind = GCKmajor;  /* The old heap has grown too much. */
+      gc_whiten(g);
+      return g->gc.total;
+    }
+    nt = (int64_t)g->gc.total + (int64_t)(g->gc.estimate/100) * LUAI_GCMINOR;
+  } else {
+    nt = (int64_t)(g->gc.estimate/100) * g->gc.pause;
+  }
+  return nt > LJ_MAX_MEM ? LJ_MAX_MEM : (GCSize)nt;
+}
+
 /* Perform a limited amount of incremental GC steps. */
 int LJ_FASTCALL lj_gc_step(lua_State *L)
 {
@@ -735,6 +1215,7 @@ int LJ_FASTCALL lj_gc_step(lua_State *L)
   int64_t lim;
   int32_t ostate = g->vmstate;
   setvmstate(g, GC);
+  gc_atomic_interrupt(g);
   lim = (GCSTEPSIZE/100) * g->gc.stepmul;
   if (lim == 0)
     lim = LJ_MAX_MEM;
@@ -743,10 +1224,7 @@ int LJ_FASTCALL lj_gc_step(lua_State *L)
   do {
     lim -= (GCSize)gc_onestep(L);
     if (g->gc.state == GCSpause) {
-      int64_t nt = (g->gc.estimate/100) * g->gc.pause;
-      if (nt > LJ_MAX_MEM)
-        nt = LJ_MAX_MEM;
-      g->gc.threshold = nt;
+      g->gc.threshold = gc_newthreshold(g);
       g->vmstate = ostate;
       return 1;  /* Finished a GC cycle. */
     }
@@ -790,34 +1268,101 @@ void lj_gc_fullgc(lua_State *L)
   global_State *g = G(L);
   int32_t ostate = g->vmstate;
   setvmstate(g, GC);
-  if (g->gc.state <= GCSatomic) {  /* Caught somewhere in the middle. */
-    setmref(g->gc.sweep, &g->gc.root);  /* Sweep everything (preserving it). */
-    setgcrefnull(g->gc.gray);  /* Reset lists from partial propagation. */
-    setgcrefnull(g->gc.grayagain);
-    setgcrefnull(g->gc.weak);
-    g->gc.state = GCSsweepstring;  /* Fast forward to the sweep phase. */
-    g->gc.sweepstr = 0;
+  gc_atomic_interrupt(g);
+  if (isgenerational(g)) {  /* Finish the minor cycle, then do a major one. */
+    while (g->gc.state != GCSpause)
+      gc_onestep(L);
+    g->gc.kind = GCKmajor;
   }
+  if (g->gc.state <= GCSatomic)  /* Caught somewhere in the middle. */
+    gc_whiten(g);  /* Fast forward to the sweep phase. */
   while (g->gc.state == GCSsweepstring || g->gc.state == GCSsweep)
     gc_onestep(L);  /* Finish sweep. */
   lua_assert(g->gc.state == GCSfinalize || g->gc.state == GCSpause);
   /* Now perform a full GC. */
   g->gc.state = GCSpause;
   do { gc_onestep(L); } while (g->gc.state != GCSpause);
-  g->gc.threshold = (g->gc.estimate/100) * g->gc.pause;
+  g->gc.threshold = gc_newthreshold(g);
   g->vmstate = ostate;
 }
 
+/* Monotonic clock in microseconds. */
+static uint64_t gc_clock(void)
+{
+#if LJ_TARGET_WINDOWS
+  LARGE_INTEGER c, f;
+  QueryPerformanceCounter(&c);
+  QueryPerformanceFrequency(&f);
+  return (uint64_t)(c.QuadPart / f.QuadPart) * 1000000u +
+	 (uint64_t)(c.QuadPart % f.QuadPart) * 1000000u / f.QuadPart;
+#elif defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+#else
+  return (uint64_t)clock() * 1000000u / CLOCKS_PER_SEC;
+#endif
+}
+
+/* Perform GC steps until a time budget is used up. Not called on trace. */
+int lj_gc_steptime(lua_State *L, uint32_t usec)
+{
+  global_State *g = G(L);
+  int32_t ostate = g->vmstate;
+  uint64_t start = gc_clock(), t;
+  int res = 0;
+  setvmstate(g, GC);
+  gc_atomic_interrupt(g);
+  do {
+    gc_onestep(L);
+    if (g->gc.state == GCSpause) {
+      if (g->gc.threshold != LJ_MAX_MEM)  /* Unless the GC is stopped. */
+	g->gc.threshold = gc_newthreshold(g);
+      res = 1;  /* Finished a GC cycle. */
+      t = gc_clock() - start;
+      break;
+    }
+  } while ((t = gc_clock() - start) < usec);
+  if (t > g->gc.maxpause)
+    g->gc.maxpause = (MSize)t;
+  g->vmstate = ostate;
+  return res;
+}
+
+/* Switch between incremental and generational mode. */
+void lj_gc_changemode(lua_State *L, int kind)
+{
+  global_State *g = G(L);
+  if (kind == GCKgen) {
+    if (g->gc.kind == GCKinc) {
+      g->gc.kind = GCKmajor;  /* The survivors of a full cycle become old. */
+      lj_gc_fullgc(L);
+    }
+  } else if (g->gc.kind == GCKmajor) {
+    g->gc.kind = GCKinc;  /* Already marking incrementally. */
+  } else if (isgenerational(g)) {
+    int32_t ostate = g->vmstate;
+    setvmstate(g, GC);
+    gc_atomic_interrupt(g);
+    while (g->gc.state != GCSpause)
+      gc_onestep(L);
+    g->gc.kind = GCKinc;
+    gc_whiten(g);  /* The old generation needs to be marked again. */
+    g->vmstate = ostate;
+  }
+}
+
 /* -- Write barriers ------------------------------------------------------ */
 
 /* Move the GC propagation frontier forward. */
 void lj_gc_barrierf(global_State *g, GCobj *o, GCobj *v)
 {
   lua_assert(isblack(o) && iswhite(v) && !isdead(g, v) && !isdead(g, o));
-  lua_assert(g->gc.state != GCSfinalize && g->gc.state != GCSpause);
+  lua_assert(isgenerational(g) ||
+	     (g->gc.state != GCSfinalize && g->gc.state != GCSpause));
   lua_assert(o->gch.gct != ~LJ_TTAB);
-  /* Preserve invariant during propagation. Otherwise it doesn't matter. */
-  if (g->gc.state == GCSpropagate || g->gc.state == GCSatomic)
+  /* Preserve invariant during propagation or for old objects. */
+  if (gc_keepinvariant(g))
     gc_mark(g, v);  /* Move frontier forward. */
   else
     makewhite(g, o);  /* Make it white to avoid the following barrier. */
@@ -828,7 +1373,7 @@ void LJ_FASTCALL lj_gc_barrieruv(global_State *g, TValue *tv)
 {
 #define TV2MARKED(x) \
   (*((uint8_t *)(x) - offsetof(GCupval, tv) + offsetof(GCupval, marked)))
-  if (g->gc.state == GCSpropagate || g->gc.state == GCSatomic)
+  if (gc_keepinvariant(g))
     gc_mark(g, gcV(tv));
   else
     TV2MARKED(tv) = (TV2MARKED(tv) & (uint8_t)~LJ_GC_COLORS) | curwhite(g);
@@ -846,7 +1391,7 @@ void lj_gc_closeuv(global_State *g, GCupval *uv)
   setgcrefr(o->gch.nextgc, g->gc.root);
   setgcref(g->gc.root, o);
   if (isgray(o)) {  /* A closed upvalue is never gray, so fix this. */
-    if (g->gc.state == GCSpropagate || g->gc.state == GCSatomic) {
+    if (gc_keepinvariant(g)) {
       gray2black(o);  /* Make it black and preserve invariant. */
       if (tviswhite(&uv->tv))
 	lj_gc_barrierf(g, o, gcV(&uv->tv));
@@ -861,7 +1406,7 @@ void lj_gc_closeuv(global_State *g, GCupval *uv)
 /* Mark a trace if it's saved during the propagation phase. */
 void lj_gc_barriertrace(global_State *g, uint32_t traceno)
 {
-  if (g->gc.state == GCSpropagate || g->gc.state == GCSatomic)
+  if (gc_keepinvariant(g))
     gc_marktrace(g, traceno);
 }
 #endif
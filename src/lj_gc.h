@@ -13,6 +13,13 @@ enum {
   GCSpause, GCSpropagate, GCSatomic, GCSsweepstring, GCSsweep, GCSfinalize
 };
 
+/* Garbage collector kinds. */
+enum {
+  GCKinc,	/* Incremental. */
+  GCKgen,	/* Generational. Marks of survivors are kept, i.e. they are old. */
+  GCKmajor	/* Generational, but running an incremental full cycle. */
+};
+
 /* Bitmasks for marked field of GCobj. */
 #define LJ_GC_WHITE0	0x01
 #define LJ_GC_WHITE1	0x02
@@ -36,6 +43,7 @@ enum {
 #define isgray(x)	(!((x)->gch.marked & (LJ_GC_BLACK|LJ_GC_WHITES)))
 #define tviswhite(x)	(tvisgcv(x) && iswhite(gcV(x)))
 #define otherwhite(g)	(g->gc.currentwhite ^ LJ_GC_WHITES)
+#define isgenerational(g)	((g)->gc.kind == GCKgen)
 #define isdead(g, v)	((v)->gch.marked & otherwhite(g) & LJ_GC_WHITES)
 
 #define curwhite(g)	((g)->gc.currentwhite & LJ_GC_WHITES)
@@ -49,9 +57,10 @@ enum {
 #define clearfinalized(x)	((x)->gch.marked &= ~LJ_GC_FINALIZED)
 
 /* Collector. */
-LJ_FUNC size_t lj_gc_separateudata(global_State *g, int all);
+LJ_FUNC void lj_gc_separateudata(global_State *g, int all);
 LJ_FUNC void lj_gc_finalize_udata(lua_State *L);
 LJ_FUNC void lj_gc_tab_finalized(lua_State *L, GCobj *o);
+LJ_FUNC void lj_gc_checkfinalizer(lua_State *L, GCtab *t);
 #if LJ_HASFFI
 LJ_FUNC void lj_gc_finalize_cdata(lua_State *L);
 #else
@@ -64,6 +73,8 @@ LJ_FUNCA void LJ_FASTCALL lj_gc_step_fixtop(lua_State *L);
 LJ_FUNC int LJ_FASTCALL lj_gc_step_jit(global_State *g, MSize steps);
 #endif
 LJ_FUNC void lj_gc_fullgc(lua_State *L);
+LJ_FUNC void lj_gc_changemode(lua_State *L, int kind);
+LJ_FUNC int lj_gc_steptime(lua_State *L, uint32_t usec);
 
 /* GC check: drive collector forward if the GC threshold has been reached. */
 #define lj_gc_check(L) \
@@ -86,7 +97,8 @@ static LJ_AINLINE void lj_gc_barrierback(global_State *g, GCtab *t)
 {
   GCobj *o = obj2gco(t);
   lua_assert(isblack(o) && !isdead(g, o));
-  lua_assert(g->gc.state != GCSfinalize && g->gc.state != GCSpause);
+  lua_assert(isgenerational(g) ||
+	     (g->gc.state != GCSfinalize && g->gc.state != GCSpause));
   black2gray(o);
   setgcrefr(t->gclist, g->gc.grayagain);
   setgcref(g->gc.grayagain, o);
@@ -101,6 +113,13 @@ static LJ_AINLINE void lj_gc_barrierback(global_State *g, GCtab *t)
 #define lj_gc_objbarriert(L, t, o)  \
   { if (iswhite(obj2gco(o)) && isblack(obj2gco(t))) \
       lj_gc_barrierback(G(L), (t)); }
+/* Barrier for moving slots of a table which may be traversed in chunks.
+** The atomic phase also clears black weak tables in chunks.
+*/
+#define lj_gc_barriermove(L, t) \
+  { if (LJ_UNLIKELY(obj2gco(t) == gcref(G(L)->gc.travtab) || \
+		    G(L)->gc.state == GCSatomic) && isblack(obj2gco(t))) \
+      lj_gc_barrierback(G(L), (t)); }
 
 /* Barrier for stores to any other object. TValue and GCobj variant. */
 #define lj_gc_barrier(L, p, tv) \
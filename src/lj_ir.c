@@ -18,6 +18,7 @@
 #include "lj_buf.h"
 #include "lj_str.h"
 #include "lj_tab.h"
+#include "lj_func.h"
 #include "lj_ir.h"
 #include "lj_jit.h"
 #include "lj_ircall.h"
@@ -105,7 +105,7 @@
   _(FLOAD,	L , ref, lit) \
   _(XLOAD,	L , ref, lit) \
   _(SLOAD,	L , lit, lit) \
-  _(VLOAD,	L , ref, ___) \
+  _(VLOAD,	L , ref, lit) \
   \
   _(ASTORE,	S , ref, ref) \
   _(HSTORE,	S , ref, ref) \
@@ -120,6 +120,7 @@
   _(TDUP,	AW, ref, ___) \
   _(CNEW,	AW, ref, ref) \
   _(CNEWI,	NW, ref, ref)  /* CSE is ok, not marked as A. */ \
+  _(FNEW,	AW, ref, ref) \
   \
   /* Buffer operations. */ \
   _(BUFHDR,	L , ref, lit) \
@@ -189,6 +190,17 @@ IRFPMDEF(FPMENUM)
 } IRFPMathOp;
 
 /* FLOAD fields. */
+#if LJ_TABSHAPE
+#define IRFLDEF_TABSHAPE(_)	_(TAB_SHAPE,	offsetof(GCtab, shape))
+#else
+#define IRFLDEF_TABSHAPE(_)
+#endif
+#if LJ_NUMARRAY
+#define IRFLDEF_NUMARRAY(_)	_(TAB_NUMARR,	offsetof(GCtab, numarr))
+#else
+#define IRFLDEF_NUMARRAY(_)
+#endif
+
 #define IRFLDEF(_) \
   _(STR_LEN,	offsetof(GCstr, len)) \
   _(FUNC_ENV,	offsetof(GCfunc, l.env)) \
@@ -200,6 +212,8 @@ IRFPMDEF(FPMENUM)
   _(TAB_NODE,	offsetof(GCtab, node)) \
   _(TAB_ASIZE,	offsetof(GCtab, asize)) \
   _(TAB_HMASK,	offsetof(GCtab, hmask)) \
+  IRFLDEF_TABSHAPE(_) \
+  IRFLDEF_NUMARRAY(_) \
   _(TAB_NOMM,	offsetof(GCtab, nomm)) \
   _(MS_LEVEL,   offsetof(MatchState, level)) \
   _(MS_FINDRET1,offsetof(MatchState, findret1)) \
@@ -227,6 +241,7 @@ IRFLDEF(FLENUM)
 #define IRSLOAD_CONVERT		0x08	/* Number to integer conversion. */
 #define IRSLOAD_READONLY	0x10	/* Read-only, omit slot store. */
 #define IRSLOAD_INHERIT		0x20	/* Inherited by exits/side traces. */
+#define IRSLOAD_KEYINDEX	0x40	/* Table traversal index in key slot. */
 
 /* XLOAD mode, stored in op2. */
 #define IRXLOAD_READONLY	1	/* Load from read-only data. */
@@ -481,6 +496,7 @@ typedef uint32_t TRef;
 #define TREF_REFMASK		0x0000ffff
 #define TREF_FRAME		0x00010000
 #define TREF_CONT		0x00020000
+#define TREF_KEYINDEX		0x00100000
 
 #define TREF(ref, t)		((TRef)((ref) + ((t)<<24)))
 
@@ -104,6 +104,12 @@ typedef struct CCallInfo {
 #define IRCALLCOND_FFI32(x)		NULL
 #endif
 
+#if LJ_HASFFI && LJ_53
+#define IRCALLCOND_FFI53(x)		x
+#else
+#define IRCALLCOND_FFI53(x)		NULL
+#endif
+
 #if LJ_SOFTFP
 #define XA_FP		CCI_XA
 #define XA2_FP		(CCI_XA+CCI_XA)
@@ -123,9 +129,12 @@ typedef struct CCallInfo {
 /* Function definitions for CALL* instructions. */
 #define IRCALLDEF(_) \
   _(ANY,	lj_gc_tab_finalized,	2,   S, NIL, CCI_L) \
-  _(ANY,	ljx_str_match,		6,   N, P32, CCI_L) \
+  _(ANY,	ljx_str_match,		6,   N, PGC, CCI_L) \
+  _(ANY,	ljx_str_gmatch_new,	3,   S, FUNC, CCI_L) \
+  _(ANY,	ljx_str_gmatch,		4,   S, PGC, CCI_L) \
+  _(ANY,	ljx_str_gsub,		5,   L, PGC, 0) \
   _(ANY,	lj_str_cmp,		2,  FN, INT, CCI_NOFPRCLOBBER) \
-  _(ANY,	lj_str_find,		5,   N, P32, 0) \
+  _(ANY,	lj_str_find,		5,   N, INT, 0) \
   _(ANY,	lj_str_new,		3,   S, STR, CCI_L) \
   _(ANY,	lj_strscan_num,		2,  FN, INT, 0) \
   _(ANY,	lj_strfmt_int,		2,  FN, STR, CCI_L) \
@@ -140,6 +149,8 @@ typedef struct CCallInfo {
   _(ANY,	lj_strfmt_putfnum,	3,   L, PGC, XA_FP) \
   _(ANY,	lj_strfmt_putfstr,	3,   L, PGC, 0) \
   _(ANY,	lj_strfmt_putfchar,	3,   L, PGC, 0) \
+  _(ANY,	lj_strfmt_putfobj,	3,   L, PGC, 0) \
+  _(ANY,	lj_strfmt_putptr,	2,  FL, PGC, 0) \
   _(ANY,	lj_buf_putmem,		3,   S, PGC, 0) \
   _(ANY,	lj_buf_putstr,		2,  FL, PGC, 0) \
   _(ANY,	lj_buf_putchar,		2,  FL, PGC, 0) \
@@ -155,6 +166,9 @@ typedef struct CCallInfo {
   _(ANY,	lj_tab_clear,		1,  FS, NIL, 0) \
   _(ANY,	lj_tab_newkey,		3,   S, PGC, CCI_L) \
   _(ANY,	lj_tab_len,		1,  FL, INT, 0) \
+  _(ANY,	lj_tab_nexti,		2,  FL, INT, 0) \
+  _(ANY,	lj_func_newL_jit,	4,   S, FUNC, CCI_L) \
+  _(ANY,	lj_func_closeuv,	2,  FS, NIL, CCI_L) \
   _(ANY,	lj_gc_step_jit,		2,  FS, NIL, CCI_L) \
   _(ANY,	lj_gc_barrieruv,	2,  FS, NIL, 0) \
   _(ANY,	lj_mem_newgco,		2,  FS, PGC, CCI_L) \
@@ -211,7 +225,9 @@ typedef struct CCallInfo {
   _(FP64_FFI,	fp64_f2ul,		1,   N, U64, 0) \
   _(FFI,	lj_carith_divi64,	2,   N, I64, XA2_64|CCI_NOFPRCLOBBER) \
   _(FFI,	lj_carith_divu64,	2,   N, U64, XA2_64|CCI_NOFPRCLOBBER) \
+  _(FFI53,	lj_carith_idivi64,	2,   N, I64, XA2_64|CCI_NOFPRCLOBBER) \
   _(FFI,	lj_carith_modi64,	2,   N, I64, XA2_64|CCI_NOFPRCLOBBER) \
+  _(FFI53,	lj_carith_imodi64,	2,   N, I64, XA2_64|CCI_NOFPRCLOBBER) \
   _(FFI,	lj_carith_modu64,	2,   N, U64, XA2_64|CCI_NOFPRCLOBBER) \
   _(FFI,	lj_carith_powi64,	2,   N, I64, XA2_64|CCI_NOFPRCLOBBER) \
   _(FFI,	lj_carith_powu64,	2,   N, U64, XA2_64|CCI_NOFPRCLOBBER) \
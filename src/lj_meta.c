@@ -173,12 +173,15 @@ TValue *lj_meta_tset(lua_State *L, cTValue *o, cTValue *k)
       if (LJ_LIKELY(!tvisnil(tv))) {
 	t->nomm = 0;  /* Invalidate negative metamethod cache. */
 	lj_gc_anybarriert(L, t);
+	clearnumarr(t);  /* The slot may be in the array part. */
 	return (TValue *)tv;
       } else if (!(mo = lj_meta_fast(L, tabref(t->metatable), MM_newindex))) {
 	t->nomm = 0;  /* Invalidate negative metamethod cache. */
 	lj_gc_anybarriert(L, t);
-	if (tv != niltv(L))
+	if (tv != niltv(L)) {
+	  clearnumarr(t);
 	  return (TValue *)tv;
+	}
 	if (tvisnil(k)) lj_err_msg(L, LJ_ERR_NILIDX);
 	else if (tvisint(k)) { setnumV(&tmp, (lua_Number)intV(k)); k = &tmp; }
 	else if (tvisnum(k) && tvisnan(k)) lj_err_msg(L, LJ_ERR_NANIDX);
@@ -220,7 +223,8 @@ TValue *lj_meta_arith(lua_State *L, TValue *ra, cTValue *rb, cTValue *rc,
   TValue tempb, tempc;
   cTValue *b, *c;
 #if LJ_53
-  if (mm >= MM_bnot) {
+  /* Integer division of plain numbers is a regular arithmetic op. */
+  if (mm >= MM_bnot && (mm != MM_idiv || tviscdata(rb) || tviscdata(rc))) {
     if (ljx_vm_foldbit(L, ra, rb, rc, mm) < 0)
       goto metacall;
     return NULL;
@@ -233,12 +237,23 @@ TValue *lj_meta_arith(lua_State *L, TValue *ra, cTValue *rb, cTValue *rc,
   }
 #if LJ_53
 metacall:
+  if (mm >= MM_bnot) {  /* A float without integer value and an integer? */
+    int64_t i;
+    int ib = ljx_toint64(L, rb, &i), ic = ljx_toint64(L, rc, &i);
+    if ((ib && !ic && str2num(rc, &tempc)) ||
+	(ic && !ib && str2num(rb, &tempb)))
+      lj_err_msg(L, LJ_ERR_NOINTREP);  /* Not even for cdata metamethods. */
+  }
 #endif
   {
     cTValue *mo = lj_meta_lookup(L, rb, mm);
     if (tvisnil(mo)) {
       mo = lj_meta_lookup(L, rc, mm);
       if (tvisnil(mo)) {
+#if LJ_53
+	if (mm >= MM_bnot && str2num(rb, &tempb) && str2num(rc, &tempc))
+	  lj_err_msg(L, LJ_ERR_NOINTREP);
+#endif
         if (str2num(rb, &tempb) == NULL) rc = rb;
         lj_err_optype(L, rc, LJ_ERR_OPARITH);
         return NULL;  /* unreachable */
@@ -163,6 +163,22 @@ typedef struct SBuf {
   MRef L;		/* lua_State, used for buffer resizing. */
 } SBuf;
 
+/* Compiled Lua pattern. Cached by the string library. */
+#define PAT_MAXLEN	64	/* Max. length of a compiled pattern. */
+#define PAT_MAXCLS	8	/* Max. number of character class bitmaps. */
+#define PAT_CACHE	32	/* Number of cached patterns (pow2). */
+
+typedef struct PatCache {
+  MSize len;		/* Length of pattern or 0 for an unused slot. */
+  int32_t firstc;	/* Only possible first char or -1. */
+  uint8_t anchor;	/* Pattern starts with '^'. */
+  uint8_t first;	/* Set of possible first chars is valid. */
+  uint8_t idx[PAT_MAXLEN];  /* Class bitmap number+1 for pattern offsets. */
+  char pat[PAT_MAXLEN];	/* Pattern string. */
+  uint32_t firstset[8];	/* Set of possible first chars (after '^'). */
+  uint32_t cls[PAT_MAXCLS][8];  /* Character class bitmaps. */
+} PatCache;
+
 /* Match state for pattern captures. Directly accesed by emitted JIT code. */
 typedef struct MatchState {
   uint32_t findret1, findret2;
@@ -177,6 +193,9 @@ typedef struct MatchState {
   lua_State *L;
   int depth;
   int backtracks;
+  const PatCache *pc;  /* Compiled pattern or NULL. */
+  const char *p_init;  /* Start of pattern, including '^'. */
+  int errdefer;  /* 0: throw errors, 1: defer them (trace call), 2: failed. */
 } MatchState;
 #define CAP_UNFINISHED	((MSize)(-1))
 #define CAP_POSITION	((MSize)(-2))
@@ -303,6 +322,9 @@ typedef const TValue cTValue;
 #define LJ_TISGCV		(LJ_TSTR+1)
 #define LJ_TISTABUD		LJ_TTAB
 
+/* Tag of the ITERN control variable. Holds the next array/hash slot index. */
+#define LJ_KEYINDEX		0xfffe7fffu
+
 #if LJ_GC64
 #define LJ_GCVMASK		(((uint64_t)1 << 47) - 1)
 #endif
@@ -484,9 +506,11 @@ typedef struct GCfuncC {
   TValue upvalue[1];	/* Array of upvalues (TValue). */
 } GCfuncC;
 
+/* For Lua functions env points to the _ENV upvalue (the env cell), which is
+** shared by all closures instantiated under the same _ENV.
+*/
 typedef struct GCfuncL {
   GCfuncHeader;
-  GCRef next_ENV, prev_ENV; /* Chain of closures we share _ENV with */
   GCRef uvptr[1];	/* Array of _pointers_ to upvalue objects (GCupval). */
 } GCfuncL;
 
@@ -502,6 +526,9 @@ typedef union GCfunc {
 #define isffunc(fn)	((fn)->c.ffid > FF_C)
 #define funcproto(fn) \
   check_exp(isluafunc(fn), (GCproto *)(mref((fn)->l.pc, char)-sizeof(GCproto)))
+#define funcenvuv(fn) \
+  check_exp(isluafunc(fn), &gcref((fn)->l.env)->uv)
+#define funcenv(fn)	(uvval(funcenvuv(fn)))
 #define sizeCfunc(n)	(sizeof(GCfuncC)-sizeof(TValue)+sizeof(TValue)*(n))
 #define sizeLfunc(n)	(sizeof(GCfuncL)-sizeof(GCRef)+sizeof(GCRef)*(n))
 
@@ -511,32 +538,47 @@ typedef union GCfunc {
 typedef struct Node {
   TValue val;		/* Value object. Must be first field. */
   TValue key;		/* Key object. */
+#if !LJ_SWISSTAB
   MRef next;		/* Hash chain. */
 #if !LJ_GC64
   MRef freetop;		/* Top of free elements (stored in t->node[0]). */
 #endif
+#endif
 } Node;
 
 LJ_STATIC_ASSERT(offsetof(Node, val) == 0);
+#if LJ_SWISSTAB
+LJ_STATIC_ASSERT(sizeof(Node) == 16);
+#endif
 
 typedef struct GCtab {
   GCHeader;
   uint8_t nomm;		/* Negative cache for fast metamethods. */
   int8_t colo;		/* Array colocation. */
+#if LJ_NUMARRAY
+  uint8_t numarr;	/* 1 if the array part holds only numbers and nil. */
+#endif
   MRef array;		/* Array part. Aliases env. */
   GCRef gclist;
   GCRef metatable;	/* Must be at same offset in GCudata. */
   MRef node;		/* Hash part. */
   uint32_t asize;	/* Size of array part (keys [0, asize-1]). */
   uint32_t hmask;	/* Hash part mask (size of hash part - 1). */
-#if LJ_GC64
+#if LJ_GC64 && !LJ_SWISSTAB
   MRef freetop;		/* Top of free elements. */
 #endif
+#if LJ_TABSHAPE
+  GCRef shape;		/* Template with the same hash part layout or NULL. */
+#if !LJ_GC64
+  uint32_t unused1;
+#endif
+#endif
 } GCtab;
 
 #define sizetabcolo(n)	((n)*sizeof(TValue) + sizeof(GCtab))
 #define tabref(r)	(&gcref((r))->tab)
 #define noderef(r)	(mref((r), Node))
+#if !LJ_SWISSTAB
 #define nextnode(n)	(mref((n)->next, Node))
 #if LJ_GC64
 #define getfreetop(t, n)	(noderef((t)->freetop))
@@ -545,6 +587,7 @@ typedef struct GCtab {
 #define getfreetop(t, n)	(noderef((n)->freetop))
 #define setfreetop(t, n, v)	(setmref((n)->freetop, (v)))
 #endif
+#endif
 
 /* -- State objects ------------------------------------------------------- */
 
@@ -631,18 +674,47 @@ typedef struct GCState {
   uint8_t currentwhite;	/* Current white color. */
   uint8_t state;	/* GC state. */
   uint8_t nocdatafin;	/* No cdata finalizer called. */
-  uint8_t unused2;
+  uint8_t kind;		/* GC kind: incremental or generational. */
   MSize sweepstr;	/* Sweep position in string table. */
+  MSize regray;		/* Early passes over the 2nd chance list. */
   GCRef root;		/* List of all collectable objects. */
   MRef sweep;		/* Sweep position in root list. */
   GCRef gray;		/* List of gray objects. */
   GCRef grayagain;	/* List of objects for atomic traversal. */
   GCRef weak;		/* List of weak tables (to be cleared). */
+  GCRef travtab;	/* Black table whose traversal is not finished. */
   GCRef mmudata;	/* List of userdata (to be finalized). */
+  GCRef *fin;		/* Tables with __gc: [0,ntofin) to be finalized. */
+  MSize sizefin;	/* Size of fin vector. */
+  MSize nfin;		/* Number of tables in fin vector. */
+  MSize ntofin;		/* Number of tables to be finalized. */
   GCSize debt;		/* Debt (how much GC is behind schedule). */
   GCSize estimate;	/* Estimate of memory actually in use. */
   MSize stepmul;	/* Incremental GC step granularity. */
   MSize pause;		/* Pause between successive GC cycles. */
+  MSize majorinc;	/* Old heap growth which triggers a major cycle. */
+  GCSize majorbase;	/* Estimate after the last major cycle. */
+  GCRef oldroot;	/* First object of the old generation in root list. */
+  GCRef genhead;	/* First object of the generation being swept. */
+  MSize travpos;	/* Next slot to traverse in travtab. */
+  MSize maxpause;	/* Longest time-budgeted GC step (in usec). */
+  uint8_t atomic;	/* Sub-phase of the atomic phase. */
+  uint8_t travweak;	/* Weak mode of travtab or 0. */
+  MSize remarks;	/* Remarks interrupted by the mutator this cycle. */
+  GCSize passcost;	/* Cost of the steps since the last pass over grayagain. */
+  GCRef sepud;		/* Userdata detached for separation. */
+  MRef sepcur;		/* Separation position in a userdata list. */
+  GCRef sepmark;	/* List of separated userdata not yet marked. */
+  MSize sepfin;		/* Separation position in fin vector. */
+  MSize nfinold;	/* Size of fin vector at the first fixpoint. */
+  MSize markfin;	/* Marking position in fin vector. */
+  GCSize udsize;	/* Size of separated userdata. */
+  GCRef *wtab;		/* Weak tables traversed by the atomic phase. */
+  MSize sizewtab;	/* Size of wtab vector. */
+  MSize nwtab;		/* Number of tables in wtab vector. */
+  MSize nwfix;		/* Number of tables at the first fixpoint. */
+  MSize wclear;		/* Clearing position in wtab vector. */
+  MSize wclearpos;	/* Next slot to clear in the table at wclear. */
 } GCState;
 
 /* Global state, shared by all threads of a Lua universe. */
@@ -650,6 +722,12 @@ typedef struct global_State {
   GCRef *strhash;	/* String hash table (hash chain anchors). */
   MSize strmask;	/* String hash mask (size of hash table - 1). */
   MSize strnum;		/* Number of strings in hash table. */
+  GCRef *stroldhash;	/* Old string hash table during a resize or NULL. */
+  MSize stroldmask;	/* Old string hash mask. */
+  MSize strmigrate;	/* Next old hash chain to migrate. */
+#if LJ_STRHASH_SEEDED
+  uint64_t strseed[2];	/* Secret for the string hash. */
+#endif
   lua_Alloc allocf;	/* Memory allocator. */
   void *allocd;		/* Memory allocator data. */
   GCState gc;		/* Garbage collector. */
@@ -664,6 +742,9 @@ typedef struct global_State {
   TValue registrytv;	/* Anchor for registry. */
   TValue tmptv, tmptv2;	/* Temporary TValues. */
   Node nilnode;		/* Fallback 1-element hash part (nil key and value). */
+#if LJ_SWISSTAB
+  uint8_t nilctrl[16];	/* Empty control bytes of nilnode. Must follow it. */
+#endif
   GCupval uvhead;	/* Head of double-linked list of all open upvalues. */
   int32_t hookcount;	/* Instruction hook countdown. */
   int32_t hookcstart;	/* Start count for instruction hook counter. */
@@ -677,6 +758,7 @@ typedef struct global_State {
   MRef ctype_state;	/* Pointer to C type state. */
   GCRef gcroot[GCROOT_MAX];  /* GC roots. */
   MatchState ms;        /* Capture buffer for JIT mcode. */
+  MRef patcache;	/* Compiled pattern cache. */
   const void *cframe_limit; /* CPU stack overflows below this. */
   const lua_Number *version;
 } global_State;
@@ -164,7 +164,7 @@ typedef IRRef (LJ_FASTCALL *FoldFunc)(jit_State *J);
   ((ref) < J->chain[IR_LOOP] && \
    (J->chain[IR_SNEW] || J->chain[IR_XSNEW] || \
     J->chain[IR_TNEW] || J->chain[IR_TDUP] || \
-    J->chain[IR_CNEW] || J->chain[IR_CNEWI] || \
+    J->chain[IR_CNEW] || J->chain[IR_CNEWI] || J->chain[IR_FNEW] || \
     J->chain[IR_BUFSTR] || J->chain[IR_TOSTR] || J->chain[IR_CALLA]))
 
 /* -- Constant folding for FP numbers ------------------------------------- */
@@ -605,7 +605,8 @@ LJFOLDF(bufstr_kfold_cse)
 		   ira->o == IR_CALLL || ira->o == IR_CARG);
 	if (ira->o == IR_BUFHDR && !(ira->op2 & IRBUFHDR_APPEND))
 	  return ref;  /* CSE succeeded. */
-	if (ira->o == IR_CALLL && ira->op2 == IRCALL_lj_buf_puttab)
+	if (ira->o == IR_CALLL && (ira->op2 == IRCALL_lj_buf_puttab ||
+				   ira->op2 == IRCALL_ljx_str_gsub))
 	  break;
 	ira = IR(ira->op1);
 	irb = IR(irb->op1);
@@ -1129,6 +1130,11 @@ LJFOLDF(simplify_conv_i64_num)
     fins->op2 = (IRT_I64<<5)|IRT_U32;
     return RETRYFOLD;
 #endif
+  } else if ((fleft->op2 & IRCONV_SRCMASK) == IRT_I64 &&
+	     (fleft->op2 & IRCONV_CONVMASK) == IRCONV_CHECK &&
+	     (fins->op2 & IRCONV_DSTMASK) == (IRT_I64<<IRCONV_DSH)) {
+    /* The int64 was range-checked to be exactly representable. */
+    return fleft->op1;
   }
   return NEXTFOLD;
 }
@@ -1651,6 +1657,17 @@ LJFOLDF(simplify_shiftk_andk)
     fins->op2 = (IRRef1)lj_ir_kint(J, k);
     fins->ot = IRTI(IR_BAND);
     return RETRYFOLD;
+#if LJ_HASFFI
+  } else if (irk->o == IR_KINT64) {  /* Same for 64 bit integers. */
+    uint64_t k = lj_carith_shift64(ir_k64(irk)->u64, fright->i & 63,
+				   fins->o - IR_BSHL);
+    IRType t = irt_type(fins->t);
+    fins->op1 = fleft->op1;
+    fins->op1 = (IRRef1)lj_opt_fold(J);
+    fins->op2 = (IRRef1)lj_ir_kint64(J, k);
+    fins->ot = IRT(IR_BAND, t);
+    return RETRYFOLD;
+#endif
   }
   return NEXTFOLD;
 }
@@ -1666,6 +1683,38 @@ LJFOLDF(simplify_andk_shiftk)
   return NEXTFOLD;
 }
 
+LJFOLD(BAND BSHL KINT64)
+LJFOLD(BAND BSHR KINT64)
+LJFOLDF(simplify_andk_shiftk64)
+{
+#if LJ_HASFFI
+  IRIns *irk = IR(fleft->op2);
+  if (irk->o == IR_KINT && lj_carith_shift64(~(uint64_t)0, irk->i & 63,
+			     fleft->o - IR_BSHL) == ir_k64(fright)->u64)
+    return LEFTFOLD;  /* (i o k1) & k2 ==> i, if (-1 o k1) == k2 */
+  return NEXTFOLD;
+#else
+  UNUSED(J); lua_assert(0); return FAILFOLD;
+#endif
+}
+
+LJFOLD(BAND BOR KINT)
+LJFOLD(BAND BXOR KINT)
+LJFOLD(BAND BOR KINT64)
+LJFOLD(BAND BXOR KINT64)
+LJFOLDF(simplify_andk_ork)
+{
+  IRIns *irk = IR(fleft->op2);
+  PHIBARRIER(fleft);
+  if (irk->o == fright->o &&
+      (irk->o == IR_KINT ? (irk->i & fright->i) == 0 :
+       (ir_k64(irk)->u64 & ir_k64(fright)->u64) == 0)) {
+    fins->op1 = fleft->op1;  /* (i o k1) & k2 ==> i & k2, if (k1 & k2) == 0 */
+    return RETRYFOLD;
+  }
+  return NEXTFOLD;
+}
+
 /* -- Reassociation ------------------------------------------------------- */
 
 LJFOLD(ADD ADD KINT)
@@ -1760,6 +1809,30 @@ LJFOLDF(reassoc_shift)
   return NEXTFOLD;
 }
 
+LJFOLD(BSHR BSHL KINT)
+LJFOLD(BSHL BSHR KINT)
+LJFOLDF(reassoc_shiftpair)
+{
+  PHIBARRIER(fleft);
+  if (fleft->op2 == fins->op2) {  /* (i o1 k) o2 k ==> i & (-1 o1 k o2 k) */
+    int32_t k = fright->i & (irt_is64(fins->t) ? 63 : 31);
+    fins->op1 = fleft->op1;
+    if (irt_is64(fins->t)) {
+#if LJ_HASFFI
+      uint64_t m = fins->o == IR_BSHR ? ~(uint64_t)0 >> k : ~(uint64_t)0 << k;
+      fins->op2 = (IRRef1)lj_ir_kint64(J, m);
+#else
+      lua_assert(0);
+#endif
+    } else {
+      fins->op2 = (IRRef1)lj_ir_kint(J, kfold_intop(-1, k, (IROp)fins->o));
+    }
+    fins->o = IR_BAND;
+    return RETRYFOLD;
+  }
+  return NEXTFOLD;
+}
+
 LJFOLD(MIN MIN KNUM)
 LJFOLD(MAX MAX KNUM)
 LJFOLD(MIN MIN KINT)
@@ -1897,16 +1970,53 @@ LJFOLDF(comm_swap)
   return NEXTFOLD;
 }
 
+/* Is the number result of an instruction never NaN? */
+static int fold_notnan(IRIns *ir)
+{
+  IRType st = (IRType)(ir->op2 & IRCONV_SRCMASK);
+  return ir->o == IR_CONV && st >= IRT_I8 && st <= IRT_U64;
+}
+
 LJFOLD(EQ any any)
 LJFOLD(NE any any)
 LJFOLDF(comm_equal)
 {
   /* For non-numbers only: x == x ==> drop; x ~= x ==> fail */
-  if (fins->op1 == fins->op2 && !irt_isnum(fins->t))
+  if (fins->op1 == fins->op2 &&
+      (!irt_isnum(fins->t) || fold_notnan(fleft)))
     return CONDFOLD(fins->o == IR_EQ);
   return fold_comm_swap(J);
 }
 
+LJFOLD(EQ CONV KNUM)
+LJFOLD(NE CONV KNUM)
+LJFOLD(LT CONV KNUM)
+LJFOLD(GE CONV KNUM)
+LJFOLD(LE CONV KNUM)
+LJFOLD(GT CONV KNUM)
+LJFOLD(ULT CONV KNUM)
+LJFOLD(UGE CONV KNUM)
+LJFOLD(ULE CONV KNUM)
+LJFOLD(UGT CONV KNUM)
+LJFOLDF(narrow_comp_i64)
+{
+  lua_Number n = knumright;
+  PHIBARRIER(fleft);
+  /* Compare an exact int64 to number conversion as an int64. */
+  if (fleft->op2 == ((IRT_NUM<<IRCONV_DSH)|IRT_I64|IRCONV_CHECK) &&
+      n >= -9007199254740992.0 && n <= 9007199254740992.0 &&
+      n == (lua_Number)(int64_t)n) {
+    IROp op = (IROp)fins->o;
+    if (op >= IR_ULT && op <= IR_UGT)  /* No NaNs here. */
+      op = (IROp)(op - IR_ULT + IR_LT);
+    fins->ot = IRTG(op, IRT_I64);
+    fins->op1 = fleft->op1;
+    fins->op2 = (IRRef1)lj_ir_kint64(J, (uint64_t)(int64_t)n);
+    return RETRYFOLD;
+  }
+  return NEXTFOLD;
+}
+
 LJFOLD(LT any any)
 LJFOLD(GE any any)
 LJFOLD(LE any any)
@@ -2230,6 +2340,24 @@ LJFOLDF(fload_cdata_ptr_int64_cnew)
   return NEXTFOLD;
 }
 
+/* Closures created on-trace inherit the environment of their parent. */
+LJFOLD(FLOAD FNEW IRFL_FUNC_ENV)
+LJFOLDF(fload_func_env_fnew)
+{
+  if (LJ_LIKELY(J->flags & JIT_F_OPT_FOLD)) {
+    PHIBARRIER(fleft);
+    fins->op1 = IR(fleft->op1)->op1;  /* Parent closure from CARG. */
+    return RETRYFOLD;
+  }
+  return NEXTFOLD;
+}
+
+LJFOLD(FLOAD FNEW IRFL_FUNC_FFID)
+LJFOLDF(fload_func_ffid_fnew)
+{
+  return INTFOLD(FF_LUA);
+}
+
 LJFOLD(FLOAD any IRFL_STR_LEN)
 LJFOLD(FLOAD any IRFL_FUNC_ENV)
 LJFOLD(FLOAD any IRFL_THREAD_ENV)
@@ -2237,7 +2365,7 @@ LJFOLD(FLOAD any IRFL_CDATA_CTYPEID)
 LJFOLD(FLOAD any IRFL_CDATA_PTR)
 LJFOLD(FLOAD any IRFL_CDATA_INT)
 LJFOLD(FLOAD any IRFL_CDATA_INT64)
-LJFOLD(VLOAD any any)  /* Vararg loads have no corresponding stores. */
+LJFOLD(VLOAD any any)  /* Vararg/traversal loads: no forwarding needed. */
 LJFOLDX(lj_opt_cse)
 
 /* All other field loads need alias analysis. */
@@ -2340,6 +2468,7 @@ LJFOLD(RETF any any)  /* Modifies BASE. */
 LJFOLD(TNEW any any)
 LJFOLD(TDUP any)
 LJFOLD(CNEW any any)
+LJFOLD(FNEW any any)
 LJFOLD(XSNEW any any)
 LJFOLD(BUFHDR any any)
 LJFOLDX(lj_ir_emit)
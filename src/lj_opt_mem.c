@@ -257,6 +257,20 @@ TRef LJ_FASTCALL lj_opt_fwd_hload(jit_State *J)
   return EMITFOLD;
 }
 
+/* Check whether there's no aliasing table.clear. */
+static int fwd_aa_tab_clear(jit_State *J, IRRef lim, IRRef ta)
+{
+  IRRef ref = J->chain[IR_CALLS];
+  while (ref > lim) {
+    IRIns *calls = IR(ref);
+    if (calls->op2 == IRCALL_lj_tab_clear &&
+	(ta == calls->op1 || aa_table(J, ta, calls->op1) != ALIAS_NO))
+      return 0;  /* Conflict. */
+    ref = calls->prev;
+  }
+  return 1;  /* No conflict. Can safely FOLD/CSE. */
+}
+
 /* HREFK forwarding. */
 TRef LJ_FASTCALL lj_opt_fwd_hrefk(jit_State *J)
 {
@@ -275,7 +289,7 @@ TRef LJ_FASTCALL lj_opt_fwd_hrefk(jit_State *J)
     ref = newref->prev;
   }
   /* No conflicting NEWREF: key location unchanged for HREFK of TDUP. */
-  if (IR(tab)->o == IR_TDUP)
+  if (IR(tab)->o == IR_TDUP && fwd_aa_tab_clear(J, tab, tab))
     fins->t.irt &= ~IRT_GUARD;  /* Drop HREFK guard. */
 docse:
   return CSEFOLD;
@@ -309,20 +323,6 @@ int LJ_FASTCALL lj_opt_fwd_href_nokey(jit_State *J)
   return 1;  /* No conflict. Can fold to niltv. */
 }
 
-/* Check whether there's no aliasing table.clear. */
-static int fwd_aa_tab_clear(jit_State *J, IRRef lim, IRRef ta)
-{
-  IRRef ref = J->chain[IR_CALLS];
-  while (ref > lim) {
-    IRIns *calls = IR(ref);
-    if (calls->op2 == IRCALL_lj_tab_clear &&
-	(ta == calls->op1 || aa_table(J, ta, calls->op1) != ALIAS_NO))
-      return 0;  /* Conflict. */
-    ref = calls->prev;
-  }
-  return 1;  /* No conflict. Can safely FOLD/CSE. */
-}
-
 /* Check whether there's no aliasing NEWREF/table.clear for the left operand. */
 int LJ_FASTCALL lj_opt_fwd_tptr(jit_State *J, IRRef lim)
 {
@@ -541,6 +541,16 @@ TRef LJ_FASTCALL lj_opt_fwd_fload(jit_State *J)
     if (ir->o == IR_TNEW || ir->o == IR_TDUP)
       return lj_ir_knull(J, IRT_TAB);
   }
+#if LJ_TABSHAPE
+  if (fid == IRFL_TAB_SHAPE) {  /* Changed by NEWREF and table.clear. */
+    IRIns *ir = IR(oref);
+    TRef tr;
+    if (ir->o == IR_TDUP && lj_opt_fwd_tptr(J, oref))
+      return lj_ir_ktab(J, ir_ktab(IR(ir->op1)));
+    tr = lj_opt_cselim(J, lim);
+    return lj_opt_fwd_tptr(J, tref_ref(tr)) ? tr : EMITFOLD;
+  }
+#endif
 
 cselim:
   /* Try to find a matching load. Below the conflicting store, if any. */
@@ -558,12 +558,47 @@ TRef lj_opt_narrow_unm(jit_State *J, TRef rc, TValue *vc)
   return emitir(IRTN(IR_NEG), rc, lj_ir_ksimd(J, LJ_KSIMD_NEG));
 }
 
+/* Narrow a constant number operand to an integer constant, if possible. */
+static TRef narrow_kint(jit_State *J, TRef tr, cTValue *o)
+{
+  if (tref_isk(tr) && tref_isnum(tr)) {
+    lua_Number n = numV(o);
+    int32_t k = lj_num2int(n);
+    if (n == (lua_Number)k)
+      return lj_ir_kint(J, k);
+  }
+  return tr;
+}
+
+#if LJ_53
+/* Narrowing of floor division. */
+TRef lj_opt_narrow_idiv(jit_State *J, TRef rb, TRef rc, TValue *vb, TValue *vc)
+{
+  rb = conv_str_tonum(J, rb, vb);
+  rc = conv_str_tonum(J, rc, vc);
+  if ((LJ_DUALNUM || (J->flags & JIT_F_OPT_NARROW)) && tref_isinteger(rb)) {
+    TRef tmp = narrow_kint(J, rc, vc);
+    if (tref_isk(tmp) && tref_isinteger(tmp)) {
+      int32_t k = IR(tref_ref(tmp))->i;
+      if (k > 0 && (k & (k-1)) == 0)  /* i // 2^k ==> i >> k */
+	return emitir(IRTI(IR_BSAR), rb, lj_ir_kint(J, (int32_t)lj_fls(k)));
+    }
+  }
+  /* b // c ==> floor(b/c) */
+  rb = lj_ir_tonum(J, rb);
+  rc = lj_ir_tonum(J, rc);
+  return emitir(IRTN(IR_FPMATH), emitir(IRTN(IR_DIV), rb, rc), IRFPM_FLOOR);
+}
+#endif
+
 /* Narrowing of modulo operator. */
 TRef lj_opt_narrow_mod(jit_State *J, TRef rb, TRef rc, TValue *vb, TValue *vc)
 {
   TRef tmp;
   rb = conv_str_tonum(J, rb, vb);
   rc = conv_str_tonum(J, rc, vc);
+  if (tref_isinteger(rb))
+    rc = narrow_kint(J, rc, vc);
   if ((LJ_DUALNUM || (J->flags & JIT_F_OPT_NARROW)) &&
       tref_isinteger(rb) && tref_isinteger(rc) &&
       (tvisint(vc) ? intV(vc) != 0 : !tviszero(vc))) {
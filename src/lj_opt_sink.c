@@ -13,6 +13,7 @@
 #include "lj_ir.h"
 #include "lj_jit.h"
 #include "lj_iropt.h"
+#include "lj_ircall.h"
 #include "lj_target.h"
 
 /* Some local macros to save typing. Undef'd at the end. */
@@ -61,6 +62,26 @@ static int sink_checkphi(jit_State *J, IRIns *ira, IRRef ref)
   return 1;  /* Constant (non-PHI). */
 }
 
+/* Check whether a closure (or one of its lifted closures) opens upvalues. */
+static int sink_fnew_openuv(GCproto *pt)
+{
+  MSize i;
+  for (i = 0; i < pt->sizeuv; i++) {
+    uint32_t v = proto_uv(pt)[i];
+    switch (v >> PROTO_UV_SHIFT) {
+    case UV_LOCAL: case UV_IMMUTABLE:
+      return 1;
+    case UV_CLOSURE:
+      if (sink_fnew_openuv(gco2pt(proto_kgc(pt, ~(ptrdiff_t)(v & PROTO_UV_MASK)))))
+	return 1;
+      break;
+    default:
+      break;
+    }
+  }
+  return 0;
+}
+
 /* Mark non-sinkable allocations using single-pass backward propagation.
 **
 ** Roots for the marking process are:
@@ -70,11 +91,17 @@ static int sink_checkphi(jit_State *J, IRIns *ira, IRRef ref)
 ** - Any remaining loads not eliminated by store-to-load forwarding.
 ** - Stores with non-constant keys.
 ** - All stored values.
+** - All strings used by other instructions. Only snapshot refs sink.
 */
 static void sink_mark_ins(jit_State *J)
 {
   IRIns *ir, *irlast = IR(J->cur.nins-1);
+  int closeuv = 0;
   for (ir = irlast ; ; ir--) {
+    if (ir->op1 >= REF_FIRST && IR(ir->op1)->o == IR_SNEW)
+      irt_setmark(IR(ir->op1)->t);
+    if (ir->op2 >= REF_FIRST && IR(ir->op2)->o == IR_SNEW)
+      irt_setmark(IR(ir->op2)->t);
     switch (ir->o) {
     case IR_BASE:
       return;  /* Finished. */
@@ -105,10 +132,20 @@ static void sink_mark_ins(jit_State *J)
     case IR_USTORE:
       irt_setmark(IR(ir->op2)->t);  /* Mark stored value. */
       break;
+    case IR_FNEW:
+      irt_setmark(IR(IR(ir->op1)->op1)->t);  /* Parent closure never sinks. */
+      /* Restoring it after its upvalues have been closed would reopen them. */
+      if (closeuv && sink_fnew_openuv(gco2pt(ir_kgc(IR(ir->op2)))))
+	irt_setmark(ir->t);
+      if (irt_ismarked(ir->t))
+	irt_setmark(IR(ir->op1)->t);
+      break;
 #if LJ_HASFFI
     case IR_CALLXS:
 #endif
     case IR_CALLS:
+      if (ir->op2 == IRCALL_lj_func_closeuv)
+	closeuv = 1;
       irt_setmark(IR(ir->op1)->t);  /* Mark (potentially) stored values. */
       break;
     case IR_PHI: {
@@ -189,7 +226,7 @@ static void sink_sweep_ins(jit_State *J)
 #if LJ_HASFFI
     case IR_CNEW: case IR_CNEWI:
 #endif
-    case IR_TNEW: case IR_TDUP:
+    case IR_TNEW: case IR_TDUP: case IR_FNEW: case IR_SNEW:
       if (!irt_ismarked(ir->t)) {
 	ir->t.irt &= ~IRT_GUARD;
 	ir->prev = REGSP(RID_SINK, 0);
@@ -234,7 +271,8 @@ void lj_opt_sink(jit_State *J)
   const uint32_t need = (JIT_F_OPT_SINK|JIT_F_OPT_FWD|
 			 JIT_F_OPT_DCE|JIT_F_OPT_CSE|JIT_F_OPT_FOLD);
   if ((J->flags & need) == need &&
-      (J->chain[IR_TNEW] || J->chain[IR_TDUP] ||
+      (J->chain[IR_TNEW] || J->chain[IR_TDUP] || J->chain[IR_FNEW] ||
+       J->chain[IR_SNEW] ||
        (LJ_HASFFI && (J->chain[IR_CNEW] || J->chain[IR_CNEWI])))) {
     if (!J->loopref)
       sink_mark_snap(J, &J->cur.snap[J->cur.nsnap-1]);
@@ -11,6 +11,7 @@
 #if LJ_HASJIT
 
 #include "lj_err.h"
+#include "lj_gc.h"
 #include "lj_str.h"
 #include "lj_tab.h"
 #include "lj_meta.h"
@@ -122,6 +123,10 @@ static void rec_check_slots(jit_State *J)
 	lua_assert(s > delta + LJ_FR2 ? (J->slot[s-delta] & TREF_FRAME)
 				      : (s == delta + LJ_FR2));
 	depth++;
+      } else if ((tr & TREF_KEYINDEX)) {
+	lua_assert(tref_isinteger(tr) && tv->u32.hi == LJ_KEYINDEX);
+	if (tref_isk(tr))
+	  lua_assert((int32_t)tv->u32.lo == ir->i);
       } else if ((tr & TREF_CONT)) {
 #if LJ_FR2
 	if (ref)
@@ -187,6 +192,10 @@ static TRef getcurrf(jit_State *J)
   return sloadt(J, -1-LJ_FR2, IRT_FUNC, IRSLOAD_READONLY);
 }
 
+/* Check whether a function ref is a closure created on-trace. */
+#define rec_isfnew(J, tr) \
+  (!tref_isk((tr)) && IR(tref_ref((tr)))->o == IR_FNEW)
+
 /* Compare for raw object equality.
 ** Returns 0 if the objects are the same.
 ** Returns 1 if they are different, but the same type.
@@ -246,7 +255,7 @@ static void canonicalize_slots(jit_State *J)
   if (LJ_DUALNUM) return;
   for (s = J->baseslot+J->maxslot-1; s >= 1; s--) {
     TRef tr = J->slot[s];
-    if (tref_isinteger(tr)) {
+    if (tref_isinteger(tr) && !(tr & TREF_KEYINDEX)) {
       IRIns *ir = IR(tref_ref(tr));
       if (!(ir->o == IR_SLOAD && (ir->op2 & IRSLOAD_READONLY)))
 	J->slot[s] = emitir(IRTN(IR_CONV), tr, IRCONV_NUM_INT);
@@ -663,6 +672,9 @@ static TRef rec_call_specialize(jit_State *J, GCfunc *fn, TRef tr)
   if (isluafunc(fn)) {
     GCproto *pt = funcproto(fn);
     /* Too many closures created? Probably not a monomorphic function. */
+    /* Closures created on-trace already have a known prototype. */
+    if (rec_isfnew(J, tr))
+      return tr;
     if (pt->flags >= PROTO_CLC_POLY) {  /* Specialize to prototype instead. */
       TRef trpt = emitir(IRT(IR_FLOAD, IRT_PGC), tr, IRFL_FUNC_PC);
       emitir(IRTG(IR_EQ, IRT_PGC), trpt, lj_ir_kptr(J, proto_bc(pt)));
@@ -1210,9 +1222,19 @@ static void rec_idx_bump(jit_State *J, RecordIndex *ix)
       /* Grow template table, but preserve keys with nil values. */
       if ((tb->asize > tpl->asize && (1u << nhbits)-1 == tpl->hmask) ||
 	  (tb->asize == tpl->asize && (1u << nhbits)-1 > tpl->hmask)) {
-	Node *node = noderef(tpl->node);
-	uint32_t i, hmask = tpl->hmask, asize;
+	Node *node;
+	uint32_t i, hmask, asize;
 	TValue *array;
+#if LJ_TABSHAPE
+	/* Tables duplicated so far keep the old template as their shape. */
+	GCproto *pt = &gcref(rbc->pt)->pt;
+	tpl = lj_tab_dup(J->L, tpl);
+	setgcrefnull(tpl->shape);
+	setgcref(mref(pt->k, GCRef)[~(ptrdiff_t)bc_d(*pc)], obj2gco(tpl));
+	lj_gc_objbarrier(J->L, pt, tpl);
+#endif
+	node = noderef(tpl->node);
+	hmask = tpl->hmask;
 	for (i = 0; i <= hmask; i++) {
 	  if (!tvisnil(&node[i].key) && tvisnil(&node[i].val))
 	    settabV(J->L, &node[i].val, tpl);
@@ -1342,6 +1364,16 @@ static TRef rec_idx_key(jit_State *J, RecordIndex *ix, IRRef *rbref,
       TRef node, kslot, hm;
       *rbref = J->cur.nins;  /* Mark possible rollback point. */
       *rbguard = J->guardemit;
+#if LJ_TABSHAPE
+      if (gcref(t->shape)) {
+	/* A shape fixes hmask and the slots of all keys. Guard it once. */
+	TRef shape = emitir(IRT(IR_FLOAD, IRT_TAB), ix->tab, IRFL_TAB_SHAPE);
+	emitir(IRTG(IR_EQ, IRT_TAB), shape, lj_ir_ktab(J, tabref(t->shape)));
+	node = emitir(IRT(IR_FLOAD, IRT_PGC), ix->tab, IRFL_TAB_NODE);
+	kslot = lj_ir_kslot(J, key, hslot / sizeof(Node));
+	return emitir(IRT(IR_HREFK, IRT_PGC), node, kslot);
+      }
+#endif
       hm = emitir(IRTI(IR_FLOAD), ix->tab, IRFL_TAB_HMASK);
       emitir(IRTGI(IR_EQ), hm, lj_ir_kint(J, (int32_t)t->hmask));
       node = emitir(IRT(IR_FLOAD, IRT_PGC), ix->tab, IRFL_TAB_NODE);
@@ -1514,6 +1546,13 @@ TRef lj_record_idx(jit_State *J, RecordIndex *ix)
       TRef fref = emitir(IRT(IR_FREF, IRT_PGC), ix->tab, IRFL_TAB_NOMM);
       emitir(IRT(IR_FSTORE, IRT_U8), fref, lj_ir_kint(J, 0));
     }
+#if LJ_NUMARRAY
+    /* Only numbers and nil keep the array part numeric. */
+    if (xrefop == IR_AREF && !tref_isnumber(ix->val) && !tref_isnil(ix->val)) {
+      TRef fref = emitir(IRT(IR_FREF, IRT_PGC), ix->tab, IRFL_TAB_NUMARR);
+      emitir(IRT(IR_FSTORE, IRT_U8), fref, lj_ir_kint(J, 0));
+    }
+#endif
     J->needsnap = 1;
     return 0;
   }
@@ -1544,6 +1583,106 @@ static void rec_tsetm(jit_State *J, BCReg ra, BCReg rn, int32_t i)
   }
 }
 
+/* -- Table traversal ----------------------------------------------------- */
+
+/* Record ISNEXT. */
+static void rec_isnext(jit_State *J, BCReg ra)
+{
+  cTValue *b = &J->L->base[ra-3];
+  if (tvisfunc(b) && funcV(b)->c.ffid == FF_next &&
+      tvistab(b+1) && tvisnil(b+2)) {
+    TRef trid = emitir(IRT(IR_FLOAD, IRT_U8), getslot(J, ra-3),
+		       IRFL_FUNC_FFID);
+    emitir(IRTGI(IR_EQ), trid, lj_ir_kint(J, FF_next));
+    (void)getslot(J, ra-2);  /* Type check for table. */
+    (void)getslot(J, ra-1);  /* Type check for nil key. */
+    J->base[ra-1] = lj_ir_kint(J, 0) | TREF_KEYINDEX;
+    J->maxslot = ra;
+  } else {  /* Abort trace. Interpreter will despecialize bytecode. */
+    lj_trace_err(J, LJ_TRERR_RECERR);
+  }
+}
+
+/* Record one step of a table traversal. Specialized to the part of the
+** table the next slot is in. The control var holds the slot index.
+*/
+static LoopEvent rec_iternext(jit_State *J, BCReg ra, BCReg rb)
+{
+  GCtab *t = tabV(&J->L->base[ra-2]);
+  uint32_t i = J->L->base[ra-1].u32.lo;
+  int32_t n = lj_tab_nexti(t, i);
+  TRef tab, idx, nidx, asize, key, val = 0;
+  J->maxslot = ra;
+  lj_snap_add(J);
+  tab = getslot(J, ra-2);
+  idx = J->base[ra-1] ? (J->base[ra-1] & ~TREF_KEYINDEX) :
+	sloadt(J, (int32_t)(ra-1), IRT_GUARD|IRT_INT,
+	       IRSLOAD_TYPECHECK|IRSLOAD_KEYINDEX);
+  asize = emitir(IRTI(IR_FLOAD), tab, IRFL_TAB_ASIZE);
+  if ((uint32_t)n == i && i < t->asize) {
+    nidx = idx;  /* Dense array part: the slot at the index is not nil. */
+    rec_idx_abc(J, asize, nidx, t->asize);
+  } else {
+    nidx = lj_ir_call(J, IRCALL_lj_tab_nexti, tab, idx);
+    if (n < 0) {  /* End of traversal. */
+      emitir(IRTGI(IR_EQ), nidx, lj_ir_kint(J, -1));
+      J->maxslot = ra-3;
+      J->pc += 2;
+      return LOOPEV_LEAVE;
+    } else if ((uint32_t)n < t->asize) {
+      rec_idx_abc(J, asize, nidx, t->asize);
+    } else {
+      emitir(IRTGI(IR_GE), nidx, asize);
+    }
+  }
+  if ((uint32_t)n < t->asize) {  /* Array slot. The key is the index. */
+    TRef aref = emitir(IRT(IR_FLOAD, IRT_PGC), tab, IRFL_TAB_ARRAY);
+    IRType tv = itype2irt(arrayslot(t, n));
+    aref = emitir(IRT(IR_AREF, IRT_PGC), aref, nidx);
+    val = emitir(IRTG(IR_ALOAD, tv), aref, 0);
+    if (irtype_ispri(tv)) val = TREF_PRI(tv);
+    key = nidx;
+  } else {  /* Hash slot. Load the key and the value from the node. */
+    Node *node = &noderef(t->node)[n - t->asize];
+    IRType tk = itype2irt(&node->key);
+    TRef nref = emitir(IRTI(IR_SUB), nidx, asize);
+    nref = emitir(IRTI(IR_MUL), nref, lj_ir_kint(J, (int32_t)sizeof(Node)));
+    nref = emitir(IRT(IR_ADD, IRT_PGC),
+		  emitir(IRT(IR_FLOAD, IRT_PGC), tab, IRFL_TAB_NODE), nref);
+    /* VLOAD op2 holds the offset in TValues. */
+    key = emitir(IRTG(IR_VLOAD, tk), nref, offsetof(Node, key)/sizeof(TValue));
+    if (irtype_ispri(tk)) key = TREF_PRI(tk);
+    if (rb >= 3) {  /* Omit the value load, if unused. */
+      IRType tv = itype2irt(&node->val);
+      val = emitir(IRTG(IR_VLOAD, tv), nref, 0);
+      if (irtype_ispri(tv)) val = TREF_PRI(tv);
+    }
+  }
+  J->base[ra-1] = emitir(IRTI(IR_ADD), nidx, lj_ir_kint(J, 1)) | TREF_KEYINDEX;
+  J->base[ra] = key;
+  if (rb >= 3) {
+    J->base[ra+1] = val;
+    J->maxslot = ra+2;
+  } else {
+    J->maxslot = ra+1;
+  }
+  J->pc += bc_j(J->pc[1])+2;  /* Continue at the target of ITERL. */
+  J->needsnap = 1;
+  return LOOPEV_ENTER;
+}
+
+/* Record ITERN. */
+static LoopEvent rec_itern(jit_State *J, BCReg ra, BCReg rb)
+{
+  /* The first step of a root trace is recorded by lj_record_setup(). */
+  if (J->pc == J->startpc && J->framedepth + J->retdepth == 0 &&
+      J->parent == 0 && J->exitno == 0) {
+    J->maxslot = ra;
+    return LOOPEV_ENTER;  /* Looping back. */
+  }
+  return rec_iternext(J, ra, rb);
+}
+
 /* -- Upvalue access ------------------------------------------------------ */
 
 /* Check whether upvalue is immutable and ok to constify. */
@@ -1571,14 +1710,33 @@ static int rec_upvalue_constify(jit_State *J, GCupval *uvp)
   return 0;
 }
 
+/* Forward chained upvalues of closures created on-trace to their parent.
+** The parent holds the very same GCupval, so this doesn't change the
+** semantics, but it avoids escaping the (potentially sunk) closure.
+*/
+static TRef rec_upvalue_fnew(jit_State *J, TRef fn, uint32_t *uv)
+{
+  while (rec_isfnew(J, fn)) {
+    IRIns *ir = IR(tref_ref(fn));
+    GCproto *pt = gco2pt(ir_kgc(IR(ir->op2)));
+    uint32_t v = proto_uv(pt)[*uv];
+    if ((v >> PROTO_UV_SHIFT) != UV_CHAINED)
+      break;
+    *uv = v & PROTO_UV_MASK;
+    fn = TREF(IR(ir->op1)->op1, IRT_FUNC);
+  }
+  return fn;
+}
+
 /* Record upvalue load/store. */
 static TRef rec_upvalue(jit_State *J, uint32_t uv, TRef val)
 {
   GCupval *uvp = &gcref(J->fn->l.uvptr[uv])->uv;
-  TRef fn = getcurrf(J);
+  TRef fn = rec_upvalue_fnew(J, getcurrf(J), &uv);
   IRRef uref;
   int needbarrier = 0;
-  if (rec_upvalue_constify(J, uvp)) {  /* Try to constify immutable upvalue. */
+  int fnew = rec_isfnew(J, fn);
+  if (!fnew && rec_upvalue_constify(J, uvp)) {  /* Try to constify immutable upvalue. */
     TRef tr, kfunc;
     lua_assert(val == 0);
     if (!tref_isk(fn)) {  /* Late specialization of current function. */
@@ -1601,16 +1759,19 @@ noconstify:
   /* Note: this effectively limits LJ_MAX_UPVAL to 127. */
   uv = (uv << 8) | (hashrot(uvp->dhash, uvp->dhash + HASH_BIAS) & 0xff);
   if (!uvp->closed) {
-    uref = tref_ref(emitir(IRTG(IR_UREFO, IRT_PGC), fn, uv));
     /* In current stack? */
     if (uvval(uvp) >= tvref(J->L->stack) &&
 	uvval(uvp) < tvref(J->L->maxstack)) {
       int32_t slot = (int32_t)(uvval(uvp) - (J->L->base - J->baseslot));
       if (slot >= 0) {  /* Aliases an SSA slot? */
-	emitir(IRTG(IR_EQ, IRT_PGC),
-	       REF_BASE,
-	       emitir(IRT(IR_ADD, IRT_PGC), uref,
-		      lj_ir_kint(J, (slot - 1 - LJ_FR2) * -8)));
+	/* An on-trace closure opened its upvalues on the trace's own slots. */
+	if (!fnew) {
+	  uref = tref_ref(emitir(IRTG(IR_UREFO, IRT_PGC), fn, uv));
+	  emitir(IRTG(IR_EQ, IRT_PGC),
+		 REF_BASE,
+		 emitir(IRT(IR_ADD, IRT_PGC), uref,
+			lj_ir_kint(J, (slot - 1 - LJ_FR2) * -8)));
+	}
 	slot -= (int32_t)J->baseslot;  /* Note: slot number may be negative! */
 	if (val == 0) {
 	  return getslot(J, slot);
@@ -1621,6 +1782,7 @@ noconstify:
 	}
       }
     }
+    uref = tref_ref(emitir(IRTG(IR_UREFO, IRT_PGC), fn, uv));
     emitir(IRTG(IR_UGT, IRT_PGC),
 	   emitir(IRT(IR_SUB, IRT_PGC), uref, REF_BASE),
 	   lj_ir_kint(J, (J->baseslot + J->maxslot) * 8));
@@ -1645,6 +1807,94 @@ noconstify:
   }
 }
 
+/* Find the _ENV upvalue of the current function, i.e. its env cell. */
+static uint32_t rec_envuv(jit_State *J)
+{
+  GCRef *uvp = J->fn->l.uvptr;
+  uint32_t uv;
+  for (uv = 0; uv < J->fn->l.nupvalues; uv++)
+    if (gcref(uvp[uv]) == gcref(J->fn->l.env))
+      return uv;
+  /* Env cell not reachable as an upvalue (e.g. hand-crafted bytecode). */
+  setintV(&J->errinfo, (int32_t)bc_op(*J->pc));
+  lj_trace_err_info(J, LJ_TRERR_NYIBC);
+  return 0;
+}
+
+/* Record closure creation. */
+static TRef rec_fnew(jit_State *J, BCReg rc)
+{
+  GCproto *pt = gco2pt(proto_kgc(J->pt, ~(ptrdiff_t)rc));
+  /* Local upvalues are opened relative to the base of the current frame. */
+  int32_t ofs = ((int32_t)J->baseslot - 1 - LJ_FR2) * 8;
+  TRef base = ofs ? emitir(IRT(IR_ADD, IRT_PGC), REF_BASE, lj_ir_kint(J, ofs)) :
+		    TREF(REF_BASE, IRT_PGC);
+  return emitir(IRT(IR_FNEW, IRT_FUNC),
+		emitir(IRT(IR_CARG, IRT_NIL), getcurrf(J), base),
+		lj_ir_kgc(J, obj2gco(pt), IRT_PROTO));
+}
+
+/* Flush the value of a slot captured by an open upvalue to the stack. */
+static void rec_uclo_flush(jit_State *J, BCReg s)
+{
+  TRef tr = J->base[s];
+  int32_t ofs = ((int32_t)(J->baseslot + s) - 1 - LJ_FR2) * 8;
+  TRef ref = emitir(IRT(IR_ADD, IRT_PGC), REF_BASE, lj_ir_kint(J, ofs));
+  if (tref_isnumber(tr)) {
+    if (!LJ_DUALNUM && tref_isinteger(tr))
+      tr = emitir(IRTN(IR_CONV), tr, IRCONV_NUM_INT);
+    emitir(IRT(IR_XSTORE, tref_type(tr)), ref, tr);
+    if (tref_isnum(tr))
+      return;  /* Numbers have no separate type tag. */
+  } else if (LJ_64 && tref_islightud(tr)) {
+    setintV(&J->errinfo, BC_UCLO);
+    lj_trace_err_info(J, LJ_TRERR_NYIBC);  /* NYI: 64 bit lightuserdata. */
+#if LJ_GC64
+  } else {  /* Store the tagged 64 bit value. */
+    uint64_t it = (uint64_t)irt_toitype_(tref_type(tr));
+    if (tref_ispri(tr))
+      tr = lj_ir_kint64(J, ~(~it << 47));
+    else
+      tr = emitir(IRT(IR_BOR, IRT_U64), tr, lj_ir_kint64(J, it << 47));
+    emitir(IRT(IR_XSTORE, IRT_U64), ref, tr);
+  }
+#else
+  } else if (!tref_ispri(tr)) {
+    emitir(IRT(IR_XSTORE, tref_type(tr)), ref, tr);
+  }
+  emitir(IRT(IR_XSTORE, IRT_U32),
+	 emitir(IRT(IR_ADD, IRT_PGC), REF_BASE, lj_ir_kint(J, ofs+4)),
+	 lj_ir_kint(J, (int32_t)irt_toitype_(tref_type(tr))));
+#endif
+}
+
+/* Record closing of upvalues. */
+static void rec_uclo(jit_State *J, BCReg ra)
+{
+  TValue *level = J->L->base + ra;
+  GCobj *o;
+  int32_t ofs;
+  if (!gcref(J->L->openupval) ||
+      uvval(gco2uv(gcref(J->L->openupval))) < level)
+    goto noclose;  /* No UVs to be closed or none concerning us -> NOP. */
+  /* Values of captured slots may only be held in SSA. Write them back. */
+  for (o = gcref(J->L->openupval);
+       o && uvval(gco2uv(o)) >= level; o = gcref(o->gch.nextgc)) {
+    BCReg s = (BCReg)(uvval(gco2uv(o)) - J->L->base);
+    if (s < J->maxslot && J->base[s] && !(J->base[s] & (TREF_FRAME|TREF_CONT)))
+      rec_uclo_flush(J, s);
+  }
+  ofs = ((int32_t)(J->baseslot + ra) - 1 - LJ_FR2) * 8;
+  lj_ir_call(J, IRCALL_lj_func_closeuv,
+	     emitir(IRT(IR_ADD, IRT_PGC), REF_BASE, lj_ir_kint(J, ofs)));
+  emitir(IRT(IR_XBAR, IRT_NIL), 0, 0);  /* Stack slots were read back. */
+  J->needsnap = 1;
+  return;  /* The next snapshot must keep the slots read by the next ins. */
+noclose:
+  if (ra < J->maxslot)
+    J->maxslot = ra;  /* Shrink used slots. */
+}
+
 /* -- Record calls to Lua functions --------------------------------------- */
 
 /* Check unroll limits for calls. */
@@ -2197,22 +2447,20 @@ void lj_record_ins(jit_State *J)
       rc = rec_mm_len(J, rc, rcv);
     break;
 #if LJ_53
-  /* -- Bitwise ops ---------------------------------------------------- */
+  /* -- Integer division and bitwise ops ---------------------------------- */
   case BC_BNOT:
-    ix.tab = rc;
+    ix.tab = rb = rc;
     copyTV(J->L, rbv, rcv);
+    /* fallthrough */
   case BC_IDIV:
   case BC_BAND:
   case BC_BOR:
   case BC_BXOR:
   case BC_SHL:
   case BC_SHR:
-  {
-    MMS opmm = bcmode_mm(op);
-    if (!(rc = ljx_rec_bitwise(J, rb, rc, rbv, rcv, opmm)))
+    if (!(rc = ljx_rec_bitwise(J, rb, rc, rbv, rcv, bcmode_mm(op))))
       rc = rec_mm_arith(J, &ix, bcmode_mm(op));
     break;
-  }
 #endif
 
   /* -- Arithmetic ops ---------------------------------------------------- */
@@ -2301,15 +2549,21 @@ void lj_record_ins(jit_State *J)
   case BC_UGET:
     rc = rec_upvalue(J, rc, 0);
     break;
-  case BC_USETV: case BC_USETS: case BC_USETN: case BC_USETP:
+  case BC_USETV: case BC_USETS: case BC_USETN: case BC_USETP: case BC_ESETV:
     rec_upvalue(J, ra, rc);
     break;
+  case BC_FNEW:
+    rc = rec_fnew(J, rc);
+    break;
+  case BC_UCLO:
+    rec_uclo(J, ra);
+    break;
 
   /* -- Table ops --------------------------------------------------------- */
 
   case BC_GGET: case BC_GSET:
-    settabV(J->L, &ix.tabv, tabref(J->fn->l.env));
-    ix.tab = emitir(IRT(IR_FLOAD, IRT_TAB), getcurrf(J), IRFL_FUNC_ENV);
+    copyTV(J->L, &ix.tabv, funcenv(J->fn));
+    ix.tab = rec_upvalue(J, rec_envuv(J), 0);
     ix.idxchain = LJ_MAX_IDXCHAIN;
     rc = lj_record_idx(J, &ix);
     break;
@@ -2413,6 +2667,12 @@ void lj_record_ins(jit_State *J)
   case BC_LOOP:
     rec_loop_interp(J, pc, rec_loop(J, ra));
     break;
+  case BC_ITERN:
+    rec_loop_interp(J, pc, rec_itern(J, ra, rb));
+    break;
+  case BC_ISNEXT:
+    rec_isnext(J, ra);
+    break;
 
   case BC_JFORL:
     rec_loop_jit(J, rc, rec_for(J, pc+bc_j(traceref(J, rc)->startins), 1));
@@ -2464,20 +2724,6 @@ void lj_record_ins(jit_State *J)
       lj_ffrecord_func(J);
       break;
     }
-  case BC_UCLO:
-    /* No UVs to be closed or none concerning us -> NOP */
-    if ((!gcref(J->L->openupval)) ||
-        (uvval((gco2uv(gcref(J->L->openupval)))) < (lbase + ra))) {
-      if (ra < J->maxslot)
-        J->maxslot = ra;  /* Shrink used slots. */
-      break;
-    }
-    /* TBD: Need to close UV -> call lj_func_closeuv */
-    /* fallthrough */
-  case BC_ITERN:
-  case BC_ISNEXT:
-  case BC_FNEW:
-  case BC_ESETV:
     setintV(&J->errinfo, (int32_t)op);
     lj_trace_err_info(J, LJ_TRERR_NYIBC);
     break;
@@ -2526,6 +2772,12 @@ static const BCIns *rec_setup_root(jit_State *J)
     lua_assert(bc_op(pc[-1]) == BC_JMP);
     J->bc_min = pc;
     break;
+  case BC_ITERN:
+    lua_assert(bc_op(pc[1]) == BC_ITERL);
+    J->maxslot = ra;
+    J->bc_extent = (MSize)(-bc_j(pc[1]))*sizeof(BCIns);
+    J->bc_min = pc+2 + bc_j(pc[1]);
+    break;
   case BC_LOOP:
     /* Only check BC range for real loops, but not for "repeat until true". */
     pcj = pc + bc_j(ins);
@@ -2625,6 +2877,15 @@ void lj_record_setup(jit_State *J)
     if (traceref(J, J->cur.root)->nchild >= J->param[JIT_P_maxside] ||
 	T->snap[J->exitno].count >= J->param[JIT_P_hotexit] +
 				    J->param[JIT_P_tryside]) {
+      if (bc_op(*J->pc) == BC_JLOOP &&
+	  bc_op(traceref(J, bc_d(*J->pc))->startins) == BC_ITERN) {
+	/* The interpreter would just re-enter the trace at the JLOOP.
+	** Leave this exit to lj_trace_exit(), which performs the ITERN.
+	*/
+	T->snap[J->exitno].count = SNAPCOUNT_DONE;
+	setintV(&J->errinfo, (int32_t)BC_ITERN);
+	lj_trace_err_info(J, LJ_TRERR_NYIBC);
+      }
       lj_record_stop(J, LJ_TRLINK_INTERP, 0);
     }
   } else {  /* Root trace. */
@@ -2633,12 +2894,20 @@ void lj_record_setup(jit_State *J)
     J->pc = rec_setup_root(J);
     /* Note: the loop instruction itself is recorded at the end and not
     ** at the start! So snapshot #0 needs to point to the *next* instruction.
+    ** Except for ITERN: its first step is recorded here and adds snapshot #0
+    ** for the ITERN itself. The loop is closed when it's reached again.
     */
-    lj_snap_add(J);
-    if (bc_op(J->cur.startins) == BC_FORL)
-      rec_for_loop(J, J->pc-1, &J->scev, 1);
-    else if (bc_op(J->cur.startins) == BC_ITERC)
-      J->startpc = NULL;
+    if (bc_op(J->cur.startins) == BC_ITERN) {
+      if (rec_iternext(J, bc_a(J->cur.startins),
+		       bc_b(J->cur.startins)) == LOOPEV_LEAVE)
+	lj_trace_err(J, LJ_TRERR_LLEAVE);
+    } else {
+      lj_snap_add(J);
+      if (bc_op(J->cur.startins) == BC_FORL)
+	rec_for_loop(J, J->pc-1, &J->scev, 1);
+      else if (bc_op(J->cur.startins) == BC_ITERC)
+	J->startpc = NULL;
+    }
     if (1 + J->pt->framesize >= LJ_MAX_JSLOTS)
       lj_trace_err(J, LJ_TRERR_STACKOV);
   }
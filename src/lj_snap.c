@@ -11,7 +11,9 @@
 #if LJ_HASJIT
 
 #include "lj_gc.h"
+#include "lj_str.h"
 #include "lj_tab.h"
+#include "lj_func.h"
 #include "lj_state.h"
 #include "lj_frame.h"
 #include "lj_bc.h"
@@ -399,6 +401,7 @@ static TRef snap_replay_const(jit_State *J, IRIns *ir)
   case IR_KNUM: case IR_KINT64:
     return lj_ir_k64(J, (IROp)ir->o, ir_k64(ir)->u64);
   case IR_KPTR: return lj_ir_kptr(J, ir_kptr(ir));  /* Continuation. */
+  case IR_KKPTR: return lj_ir_kkptr(J, ir_kptr(ir));  /* Sunk SNEW. */
   default: lua_assert(0); return TREF_NIL; break;
   }
 }
@@ -409,7 +412,8 @@ static TRef snap_dedup(jit_State *J, SnapEntry *map, MSize nmax, IRRef ref)
   MSize j;
   for (j = 0; j < nmax; j++)
     if (snap_ref(map[j]) == ref)
-      return J->slot[snap_slot(map[j])] & ~(SNAP_CONT|SNAP_FRAME);
+      return J->slot[snap_slot(map[j])] &
+	     ~(SNAP_CONT|SNAP_FRAME|SNAP_KEYINDEX);
   return 0;
 }
 
@@ -483,7 +487,8 @@ void lj_snap_replay(jit_State *J, GCtrace *T)
       tr = emitir_raw(IRT(IR_SLOAD, t), s, mode);
     }
   setslot:
-    J->slot[s] = tr | (sn&(SNAP_CONT|SNAP_FRAME));  /* Same as TREF_* flags. */
+    /* Same as TREF_* flags. */
+    J->slot[s] = tr | (sn&(SNAP_CONT|SNAP_FRAME|SNAP_KEYINDEX));
     J->framedepth += ((sn & (SNAP_CONT|SNAP_FRAME)) && s);
     if ((sn & SNAP_FRAME))
       J->baseslot = s+1;
@@ -500,13 +505,17 @@ void lj_snap_replay(jit_State *J, GCtrace *T)
 	if (J->slot[snap_slot(sn)] != snap_slot(sn)) continue;
 	pass23 = 1;
 	lua_assert(ir->o == IR_TNEW || ir->o == IR_TDUP ||
-		   ir->o == IR_CNEW || ir->o == IR_CNEWI);
-	if (ir->op1 >= T->nk) snap_pref(J, T, map, nent, seen, ir->op1);
+		   ir->o == IR_CNEW || ir->o == IR_CNEWI || ir->o == IR_FNEW ||
+		   ir->o == IR_SNEW);
+	if (ir->o == IR_FNEW)  /* Parent closure is in CARG. */
+	  snap_pref(J, T, map, nent, seen, T->ir[ir->op1].op1);
+	else if (ir->op1 >= T->nk)
+	  snap_pref(J, T, map, nent, seen, ir->op1);
 	if (ir->op2 >= T->nk) snap_pref(J, T, map, nent, seen, ir->op2);
 	if (LJ_HASFFI && ir->o == IR_CNEWI) {
 	  if (LJ_32 && refp+1 < T->nins && (ir+1)->o == IR_HIOP)
 	    snap_pref(J, T, map, nent, seen, (ir+1)->op2);
-	} else {
+	} else if (ir->o != IR_SNEW) {
 	  IRIns *irs;
 	  for (irs = ir+1; irs < irlast; irs++)
 	    if (irs->r == RID_SINK && snap_sunk_store(T, ir, irs)) {
@@ -534,10 +543,28 @@ void lj_snap_replay(jit_State *J, GCtrace *T)
 	  continue;
 	}
 	op1 = ir->op1;
-	if (op1 >= T->nk) op1 = snap_pref(J, T, map, nent, seen, op1);
+	if (ir->o == IR_FNEW) {
+	  IRIns *irc = &T->ir[op1];
+	  TRef base = TREF(REF_BASE, IRT_PGC);
+	  if (irc->op2 != REF_BASE) {
+	    IRIns *ira = &T->ir[irc->op2];
+	    lua_assert(ira->o == IR_ADD && T->ir[ira->op2].o == IR_KINT);
+	    base = emitir(IRT(IR_ADD, IRT_PGC), base,
+			  lj_ir_kint(J, T->ir[ira->op2].i));
+	  }
+	  op1 = emitir(IRT(IR_CARG, IRT_NIL),
+		       snap_pref(J, T, map, nent, seen, irc->op1), base);
+	} else if (op1 >= T->nk) {
+	  op1 = snap_pref(J, T, map, nent, seen, op1);
+	} else if (ir->o == IR_SNEW) {
+	  op1 = snap_replay_const(J, &T->ir[op1]);
+	}
 	op2 = ir->op2;
 	if (op2 >= T->nk) op2 = snap_pref(J, T, map, nent, seen, op2);
-	if (LJ_HASFFI && ir->o == IR_CNEWI) {
+	else if (ir->o == IR_SNEW) op2 = snap_replay_const(J, &T->ir[op2]);
+	if (ir->o == IR_SNEW) {
+	  J->slot[snap_slot(sn)] = emitir(ir->ot & ~IRT_MARK, op1, op2);
+	} else if (LJ_HASFFI && ir->o == IR_CNEWI) {
 	  if (LJ_32 && refp+1 < T->nins && (ir+1)->o == IR_HIOP) {
 	    lj_needsplit(J);  /* Emit joining HIOP. */
 	    op2 = emitir_raw(IRT(IR_HIOP, IRT_I64), op2,
@@ -607,7 +634,7 @@ void lj_snap_replay(jit_State *J, GCtrace *T)
 
 static void snap_unsink(jit_State *J, GCtrace *T, ExitState *ex,
 			SnapNo snapno, BloomFilter rfilt,
-			IRIns *ir, TValue *o);
+			IRIns *ir, TValue *frame, TValue *o);
 
 /* Restore a value from the trace exit state. */
 static void snap_restoreval(jit_State *J, GCtrace *T, ExitState *ex,
@@ -666,11 +693,10 @@ static void snap_restoreval(jit_State *J, GCtrace *T, ExitState *ex,
   }
 }
 
-#if LJ_HASFFI
 /* Restore raw data from the trace exit state. */
 static void snap_restoredata(GCtrace *T, ExitState *ex,
 			     SnapNo snapno, BloomFilter rfilt,
-			     IRRef ref, void *dst, CTSize sz)
+			     IRRef ref, void *dst, MSize sz)
 {
   IRIns *ir = &T->ir[ref];
   RegSP rs = ir->prev;
@@ -725,15 +751,38 @@ static void snap_restoredata(GCtrace *T, ExitState *ex,
   else if (sz == 1) *(int8_t *)dst = (int8_t)*src;
   else *(int16_t *)dst = (int16_t)*src;
 }
-#endif
 
 /* Unsink allocation from the trace exit state. Unsink sunk stores. */
 static void snap_unsink(jit_State *J, GCtrace *T, ExitState *ex,
 			SnapNo snapno, BloomFilter rfilt,
-			IRIns *ir, TValue *o)
+			IRIns *ir, TValue *frame, TValue *o)
 {
   lua_assert(ir->o == IR_TNEW || ir->o == IR_TDUP ||
-	     ir->o == IR_CNEW || ir->o == IR_CNEWI);
+	     ir->o == IR_CNEW || ir->o == IR_CNEWI || ir->o == IR_FNEW ||
+	     ir->o == IR_SNEW);
+  if (ir->o == IR_SNEW) {  /* Create the string from pointer and length. */
+    char *p;
+    int32_t len;
+    if (irref_isk(ir->op1))
+      p = (char *)ir_kptr(&T->ir[ir->op1]);
+    else
+      snap_restoredata(T, ex, snapno, rfilt, ir->op1, &p, sizeof(p));
+    snap_restoredata(T, ex, snapno, rfilt, ir->op2, &len, 4);
+    setstrV(J->L, o, lj_str_new(J->L, p, (size_t)len));
+    return;
+  }
+  if (ir->o == IR_FNEW) {
+    IRIns *irc = &T->ir[ir->op1];
+    TValue *base = frame + 1 + LJ_FR2;  /* Same as BASE on trace entry. */
+    TValue tmp;
+    lua_assert(irc->o == IR_CARG);
+    if (irc->op2 != REF_BASE)  /* Base of an inlined frame. */
+      base += T->ir[T->ir[irc->op2].op2].i / (int32_t)sizeof(TValue);
+    snap_restoreval(J, T, ex, snapno, rfilt, irc->op1, &tmp);
+    setfuncV(J->L, o, lj_func_newL_jit(J->L, gco2pt(ir_kgc(&T->ir[ir->op2])),
+				       &funcV(&tmp)->l, base));
+    return;
+  }
 #if LJ_HASFFI
   if (ir->o == IR_CNEW || ir->o == IR_CNEWI) {
     CTState *cts = ctype_cts(J->L);
@@ -793,6 +842,12 @@ static void snap_unsink(jit_State *J, GCtrace *T, ExitState *ex,
 	lua_assert(irs->o == IR_ASTORE || irs->o == IR_HSTORE ||
 		   irs->o == IR_FSTORE);
 	if (irk->o == IR_FREF) {
+#if LJ_NUMARRAY
+	  if (irk->op2 == IRFL_TAB_NUMARR) {
+	    t->numarr = 0;
+	    continue;
+	  }
+#endif
 	  lua_assert(irk->op2 == IRFL_TAB_META);
 	  snap_restoreval(J, T, ex, snapno, rfilt, irs->op2, &tmp);
 	  /* NOBARRIER: The table is new (marked white). */
@@ -860,7 +915,7 @@ const BCIns *lj_snap_restore(jit_State *J, void *exptr)
 	    copyTV(L, o, &frame[snap_slot(map[j])]);
 	    goto dupslot;
 	  }
-	snap_unsink(J, T, ex, snapno, rfilt, ir, o);
+	snap_unsink(J, T, ex, snapno, rfilt, ir, frame, o);
       dupslot:
 	continue;
       }
@@ -869,6 +924,10 @@ const BCIns *lj_snap_restore(jit_State *J, void *exptr)
 	TValue tmp;
 	snap_restoreval(J, T, ex, snapno, rfilt, ref+1, &tmp);
 	o->u32.hi = tmp.u32.lo;
+      } else if ((sn & SNAP_KEYINDEX)) {
+	/* Restore traversal index with the tag of the ITERN control var. */
+	o->u32.lo = (uint32_t)numberVint(o);
+	o->u32.hi = LJ_KEYINDEX;
 #if !LJ_FR2
       } else if ((sn & (SNAP_CONT|SNAP_FRAME))) {
 	/* Overwrite tag with frame link. */
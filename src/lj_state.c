@@ -194,8 +194,14 @@ static void close_state(lua_State *L)
 #if LJ_HASFFI
   lj_ctype_freestate(g);
 #endif
+  if (g->stroldhash)
+    lj_mem_freevec(g, g->stroldhash, g->stroldmask+1, GCRef);
   lj_mem_freevec(g, g->strhash, g->strmask+1, GCRef);
+  lj_mem_freevec(g, g->gc.fin, g->gc.sizefin, GCRef);
+  lj_mem_freevec(g, g->gc.wtab, g->gc.sizewtab, GCRef);
   lj_buf_free(g, &g->tmpbuf);
+  if (mref(g->patcache, PatCache))
+    lj_mem_freevec(g, mref(g->patcache, PatCache), PAT_CACHE, PatCache);
   lj_mem_freevec(g, tvref(L->stack), L->stacksize, TValue);
   lua_assert(g->gc.total == sizeof(GG_State));
 #ifndef LUAJIT_USE_SYSMALLOC
@@ -230,19 +236,26 @@ LUA_API lua_State *lua_newstate(lua_Alloc f, void *ud)
   setgcref(g->uvhead.prev, obj2gco(&g->uvhead));
   setgcref(g->uvhead.next, obj2gco(&g->uvhead));
   g->strmask = ~(MSize)0;
+#if LJ_STRHASH_SEEDED
+  lj_str_seed(g);
+#endif
   setnilV(registry(L));
   setnilV(&g->nilnode.val);
   setnilV(&g->nilnode.key);
-#if !LJ_GC64
+#if LJ_SWISSTAB
+  memset(g->nilctrl, HCTRL_EMPTY, sizeof(g->nilctrl));
+#elif !LJ_GC64
   setmref(g->nilnode.freetop, &g->nilnode);
 #endif
   lj_buf_init(NULL, &g->tmpbuf);
   g->gc.state = GCSpause;
+  g->gc.kind = GCKinc;
   setgcref(g->gc.root, obj2gco(L));
   setmref(g->gc.sweep, &g->gc.root);
   g->gc.total = sizeof(GG_State);
   g->gc.pause = LUAI_GCPAUSE;
   g->gc.stepmul = LUAI_GCMUL;
+  g->gc.majorinc = LUAI_GCMAJOR;
   lj_dispatch_init((GG_State *)L);
   L->status = LUA_ERRERR+1;  /* Avoid touching the stack upon memory error. */
   if (lj_vm_cpcall(L, NULL, NULL, cpluaopen) != 0) {
@@ -288,7 +301,8 @@ LUA_API void lua_close(lua_State *L)
     if (lj_vm_cpcall(L, NULL, NULL, cpfinalize) == 0) {
       if (++i >= 10) break;
       lj_gc_separateudata(g, 1);  /* Separate udata again. */
-      if (gcref(g->gc.mmudata) == NULL)  /* Until nothing is left to do. */
+      /* Until nothing is left to do. */
+      if (gcref(g->gc.mmudata) == NULL && g->gc.ntofin == 0)
 	break;
     }
   }
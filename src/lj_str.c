@@ -12,6 +12,18 @@
 #include "lj_str.h"
 #include "lj_char.h"
 
+#if LJ_STRHASH_SEEDED
+#include <stdio.h>
+#include <time.h>
+#endif
+
+#if LJ_TARGET_X86ORX64 && (defined(__SSE2__) || defined(_M_X64))
+#include <emmintrin.h>
+#define LJ_STR_SSE2	1
+#else
+#define LJ_STR_SSE2	0
+#endif
+
 /* -- String helpers ------------------------------------------------------ */
 
 /* Ordered compare of strings. Assumes string data is 4-byte aligned. */
@@ -58,6 +70,35 @@ static LJ_AINLINE int str_fastcmp(const char *a, const char *b, MSize len)
   return 0;
 }
 
+#if LJ_STR_SSE2
+/* Misses of the first char before switching to the SSE2 search. */
+#define STR_FIND_MISSMAX	8
+
+/* Find the rest of a pattern (after first char c) at n positions of s.
+** Checks the first and last char at 16 positions at once. Returns the
+** match or NULL and leaves the remaining positions in *ps and *pn.
+*/
+static const char *str_find_sse2(const char **ps, MSize *pn, int c,
+				 const char *p, MSize plen)
+{
+  const char *s = *ps;
+  MSize n = *pn;
+  __m128i vf = _mm_set1_epi8((char)c), vl = _mm_set1_epi8(p[plen-1]);
+  for (; n >= 16; s += 16, n -= 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)s);
+    __m128i b = _mm_loadu_si128((const __m128i *)(s+plen));
+    uint32_t m = (uint32_t)_mm_movemask_epi8(
+      _mm_and_si128(_mm_cmpeq_epi8(a, vf), _mm_cmpeq_epi8(b, vl)));
+    for (; m; m &= m-1) {
+      const char *q = s + lj_ffs(m);
+      if (memcmp(q+1, p, plen-1) == 0) return q;
+    }
+  }
+  *ps = s; *pn = n;
+  return NULL;
+}
+#endif
+
 /* Find fixed string p inside string s with offset start. Returns offset adjusted index. */
 uint32_t lj_str_find(const char *s, const char *p, MSize slen, MSize plen, int32_t start)
 {
@@ -75,12 +116,21 @@ uint32_t lj_str_find(const char *s, const char *p, MSize slen, MSize plen, int32
       return start+1;
     } else {
       int c = *(const uint8_t *)p++;
+      MSize miss = 0;
       plen--; slen -= plen;
       while (slen) {
-	const char *q = (const char *)memchr(s, c, slen);
+	const char *q;
+#if LJ_STR_SSE2
+	if (miss == STR_FIND_MISSMAX && plen) {  /* Frequent first char. */
+	  q = str_find_sse2(&s, &slen, c, p, plen);
+	  if (q) return (q-os+1);
+	  if (!slen) break;
+	}
+#endif
+	q = (const char *)memchr(s, c, slen);
 	if (!q) break;
 	if (memcmp(q+1, p, plen) == 0) return (q-os+1);
-	q++; slen -= (MSize)(q-s); s = q;
+	q++; slen -= (MSize)(q-s); s = q; miss++;
       }
     }
   }
@@ -99,69 +149,152 @@ int lj_str_haspattern(GCstr *s)
   return 0;  /* No pattern matching chars found. */
 }
 
+#if LJ_STRHASH_SEEDED
+/* -- Seeded string hash -------------------------------------------------- */
+
+/* The structure follows wyhash: each 16 bytes of input are mixed into the
+** hash with one 64x64->128 bit multiply, keyed with a per-state secret.
+** Colliding keys can't be precomputed without knowing the secret.
+*/
+
+static LJ_AINLINE uint64_t str_getu64(const char *p)
+{
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));  /* Compiles to an unaligned load. */
+  return v;
+}
+
+/* Multiply and fold the 128 bit product. */
+static LJ_AINLINE uint64_t str_mum(uint64_t a, uint64_t b)
+{
+#ifdef __SIZEOF_INT128__
+  __uint128_t r = (__uint128_t)a * b;
+  return (uint64_t)r ^ (uint64_t)(r >> 64);
+#else
+  uint64_t al = (uint32_t)a, ah = a >> 32, bl = (uint32_t)b, bh = b >> 32;
+  uint64_t ll = al*bl, lh = al*bh, hl = ah*bl, hh = ah*bh;
+  uint64_t mid = (ll >> 32) + (uint32_t)lh + (uint32_t)hl;
+  return ((mid << 32) | (uint32_t)ll) ^
+	 (hh + (lh >> 32) + (hl >> 32) + (mid >> 32));
+#endif
+}
+
+/* Hash the full contents of a non-empty string. */
+static MSize str_hash(const uint64_t *seed, const char *str, MSize len)
+{
+  uint64_t a, b, h = seed[0] ^ len;
+  MSize n = len;
+  if (n > 16) {
+    do {
+      h = str_mum(str_getu64(str) ^ seed[1], str_getu64(str+8) ^ h);
+      str += 16; n -= 16;
+    } while (n > 16);
+    a = str_getu64(str+n-16);  /* Overlap with the previous block. */
+    b = str_getu64(str+n-8);
+  } else if (n >= 8) {
+    a = str_getu64(str);
+    b = str_getu64(str+n-8);
+  } else if (n >= 4) {
+    a = lj_getu32(str);
+    b = lj_getu32(str+n-4);
+  } else {
+    a = ((uint64_t)(uint8_t)str[0] << 16) |
+	((uint64_t)(uint8_t)str[n>>1] << 8) | (uint8_t)str[n-1];
+    b = 0;
+  }
+  h = str_mum(a ^ seed[1], b ^ h);
+  h = str_mum(h ^ seed[1], (uint64_t)len ^ seed[0]);
+  return (MSize)(h ^ (h >> 32));
+}
+
+/* Initialize the secret of the string hash. */
+void lj_str_seed(global_State *g)
+{
+  uint64_t r[2] = { 0, 0 };
+  FILE *fp = fopen("/dev/urandom", "rb");
+  if (fp) {
+    if (fread(r, 1, sizeof(r), fp) != sizeof(r))
+      r[0] = r[1] = 0;
+    fclose(fp);
+  }
+  /* Mix in addresses and time, too. ASLR makes them differ between runs. */
+  r[0] ^= (uint64_t)(uintptr_t)g ^ ((uint64_t)time(NULL) << 32);
+  r[1] ^= (uint64_t)(uintptr_t)r ^ (uint64_t)clock();
+  g->strseed[0] = str_mum(r[0] ^ U64x(a0761d64,78bd642f),
+			  r[1] ^ U64x(e7037ed1,a0b428db));
+  g->strseed[1] = str_mum(r[1] ^ U64x(8ebc6af0,9c88c6e3),
+			  r[0] ^ U64x(589965cc,75374cc3));
+}
+#endif
+
 /* -- String interning ---------------------------------------------------- */
 
-/* Resize the string hash table (grow and shrink). */
+#define STRMIGRATE	8	/* Old hash chains to migrate per new string. */
+
+/* Move up to n hash chains from the old to the new string hash table. */
+void LJ_FASTCALL lj_str_migrate(global_State *g, MSize n)
+{
+  GCRef *oldhash = g->stroldhash;
+  MSize i = g->strmigrate, newmask = g->strmask;
+  lua_assert(g->gc.state != GCSsweepstring);
+  for (; n > 0 && i <= g->stroldmask; n--, i++) {
+    GCobj *p = gcref(oldhash[i]);
+    MSize j;
+    /* Clear the new chains, which can only receive strings from here on. */
+    for (j = i; j <= newmask; j += g->stroldmask+1)
+      setgcrefnull(g->strhash[j]);
+    setgcrefnull(oldhash[i]);
+    while (p) {  /* Follow the hash chain and reinsert all strings. */
+      MSize h = gco2str(p)->hash & newmask;
+      GCobj *next = gcnext(p);
+      /* NOBARRIER: The string table is a GC root. */
+      setgcrefr(p->gch.nextgc, g->strhash[h]);
+      setgcref(g->strhash[h], p);
+      p = next;
+    }
+  }
+  g->strmigrate = i;
+  if (i > g->stroldmask) {  /* Done. */
+    lj_mem_freevec(g, oldhash, g->stroldmask+1, GCRef);
+    g->stroldhash = NULL;
+  }
+}
+
+/* Resize the string hash table (grow and shrink).
+** The strings are migrated incrementally, on creation of new strings
+** and during the GC sweep phase. Until then, a string stays in the old
+** chain, unless its old chain index is below g->strmigrate. The new
+** chains are cleared lazily, too (see lj_str_chainok).
+*/
 void lj_str_resize(lua_State *L, MSize newmask)
 {
   global_State *g = G(L);
   GCRef *newhash;
-  MSize i;
   if (g->gc.state == GCSsweepstring || newmask >= LJ_MAX_STRTAB-1)
     return;  /* No resizing during GC traversal or if already too big. */
+  if (g->stroldhash)  /* Finish a pending resize first. */
+    lj_str_migrate(g, ~(MSize)0);
   newhash = lj_mem_newvec(L, newmask+1, GCRef);
-  memset(newhash, 0, (newmask+1)*sizeof(GCRef));
-  for (i = g->strmask; i != ~(MSize)0; i--) {  /* Rehash old table. */
-    GCobj *p = gcref(g->strhash[i]);
-    while (p) {  /* Follow each hash chain and reinsert all strings. */
-      MSize h = gco2str(p)->hash & newmask;
-      GCobj *next = gcnext(p);
-      /* NOBARRIER: The string table is a GC root. */
-      setgcrefr(p->gch.nextgc, newhash[h]);
-      setgcref(newhash[h], p);
-      p = next;
-    }
+  if (g->strhash) {
+    g->stroldhash = g->strhash;
+    g->stroldmask = g->strmask;
+    g->strmigrate = 0;
+  } else {
+    memset(newhash, 0, (newmask+1)*sizeof(GCRef));
   }
-  lj_mem_freevec(g, g->strhash, g->strmask+1, GCRef);
   g->strmask = newmask;
   g->strhash = newhash;
 }
 
-/* Intern a string and return string object. */
-GCstr *lj_str_new(lua_State *L, const char *str, size_t lenx)
+/* Find an interned string in a hash chain. */
+static LJ_AINLINE GCstr *str_lookup(global_State *g, GCobj *o,
+				    const char *str, MSize len, MSize h)
 {
-  global_State *g;
-  GCstr *s;
-  GCobj *o;
-  MSize len = (MSize)lenx;
-  MSize a, b, h = len;
-  if (lenx >= LJ_MAX_STR)
-    lj_err_msg(L, LJ_ERR_STROV);
-  g = G(L);
-  /* Compute string hash. Constants taken from lookup3 hash by Bob Jenkins. */
-  if (len >= 4) {  /* Caveat: unaligned access! */
-    a = lj_getu32(str);
-    h ^= lj_getu32(str+len-4);
-    b = lj_getu32(str+(len>>1)-2);
-    h ^= b; h -= lj_rol(b, 14);
-    b += lj_getu32(str+(len>>2)-1);
-  } else if (len > 0) {
-    a = *(const uint8_t *)str;
-    h ^= *(const uint8_t *)(str+len-1);
-    b = *(const uint8_t *)(str+(len>>1));
-    h ^= b; h -= lj_rol(b, 14);
-  } else {
-    return &g->strempty;
-  }
-  a ^= h; a -= lj_rol(h, 11);
-  b ^= a; b -= lj_rol(a, 25);
-  h ^= b; h -= lj_rol(b, 16);
-  /* Check if the string has already been interned. */
-  o = gcref(g->strhash[h & g->strmask]);
   if (LJ_LIKELY((((uintptr_t)str+len-1) & (LJ_PAGESIZE-1)) <= LJ_PAGESIZE-4)) {
     while (o != NULL) {
       GCstr *sx = gco2str(o);
-      if (sx->len == len && str_fastcmp(str, strdata(sx), len) == 0) {
+      if (sx->hash == h && sx->len == len &&
+	  str_fastcmp(str, strdata(sx), len) == 0) {
 	/* Resurrect if dead. Can only happen with fixstring() (keywords). */
 	if (isdead(g, o)) flipwhite(o);
 	return sx;  /* Return existing string. */
@@ -171,7 +304,8 @@ GCstr *lj_str_new(lua_State *L, const char *str, size_t lenx)
   } else {  /* Slow path: end of string is too close to a page boundary. */
     while (o != NULL) {
       GCstr *sx = gco2str(o);
-      if (sx->len == len && memcmp(str, strdata(sx), len) == 0) {
+      if (sx->hash == h && sx->len == len &&
+	  memcmp(str, strdata(sx), len) == 0) {
 	/* Resurrect if dead. Can only happen with fixstring() (keywords). */
 	if (isdead(g, o)) flipwhite(o);
 	return sx;  /* Return existing string. */
@@ -179,25 +313,116 @@ GCstr *lj_str_new(lua_State *L, const char *str, size_t lenx)
       o = gcnext(o);
     }
   }
-  /* Nope, create a new string. */
-  s = lj_mem_newt(L, sizeof(GCstr)+len+1, GCstr);
+  return NULL;
+}
+
+/* Compute the hash of a non-empty string. */
+static LJ_AINLINE MSize str_hashval(global_State *g, const char *str, MSize len)
+{
+#if LJ_STRHASH_SEEDED
+  return str_hash(g->strseed, str, len);
+#else
+  MSize a, b, h = len;
+  UNUSED(g);
+  /* Compute string hash. Constants taken from lookup3 hash by Bob Jenkins. */
+  if (len >= 4) {  /* Caveat: unaligned access! */
+    a = lj_getu32(str);
+    h ^= lj_getu32(str+len-4);
+    b = lj_getu32(str+(len>>1)-2);
+    h ^= b; h -= lj_rol(b, 14);
+    b += lj_getu32(str+(len>>2)-1);
+  } else {
+    a = *(const uint8_t *)str;
+    h ^= *(const uint8_t *)(str+len-1);
+    b = *(const uint8_t *)(str+(len>>1));
+    h ^= b; h -= lj_rol(b, 14);
+  }
+  a ^= h; a -= lj_rol(h, 11);
+  b ^= a; b -= lj_rol(a, 25);
+  h ^= b; h -= lj_rol(b, 16);
+  return h;
+#endif
+}
+
+/* Get the hash chain for a string hash. */
+static LJ_AINLINE GCRef *str_chain(global_State *g, MSize h)
+{
+  if (LJ_LIKELY(g->stroldhash == NULL) ||
+      (h & g->stroldmask) < g->strmigrate)
+    return &g->strhash[h & g->strmask];
+  else  /* Not yet migrated by a resize. */
+    return &g->stroldhash[h & g->stroldmask];
+}
+
+/* Add a new string object to the string hash table. */
+static GCstr *str_link(lua_State *L, GCstr *s, GCRef *chain, MSize h)
+{
+  global_State *g = G(L);
   newwhite(g, s);
   s->gct = ~LJ_TSTR;
-  s->len = len;
   s->hash = h;
   s->reserved = 0;
-  memcpy(strdatawr(s), str, len);
-  strdatawr(s)[len] = '\0';  /* Zero-terminate string. */
-  /* Add it to string hash table. */
-  h &= g->strmask;
-  s->nextgc = g->strhash[h];
+  strdatawr(s)[s->len] = '\0';  /* Zero-terminate string. */
+  s->nextgc = *chain;
   /* NOBARRIER: The string table is a GC root. */
-  setgcref(g->strhash[h], obj2gco(s));
+  setgcref(*chain, obj2gco(s));
+  if (LJ_UNLIKELY(g->stroldhash != NULL) && g->gc.state != GCSsweepstring)
+    lj_str_migrate(g, STRMIGRATE);
   if (g->strnum++ > g->strmask)  /* Allow a 100% load factor. */
     lj_str_resize(L, (g->strmask<<1)+1);  /* Grow string table. */
   return s;  /* Return newly interned string. */
 }
 
+/* Intern a string and return string object. */
+GCstr *lj_str_new(lua_State *L, const char *str, size_t lenx)
+{
+  global_State *g;
+  GCstr *s;
+  GCRef *chain;
+  MSize len = (MSize)lenx, h;
+  if (lenx >= LJ_MAX_STR)
+    lj_err_msg(L, LJ_ERR_STROV);
+  g = G(L);
+  if (len == 0)
+    return &g->strempty;
+  h = str_hashval(g, str, len);
+  /* Check if the string has already been interned. */
+  chain = str_chain(g, h);
+  s = str_lookup(g, gcref(*chain), str, len, h);
+  if (s)
+    return s;
+  /* Nope, create a new string. */
+  s = lj_mem_newt(L, sizeof(GCstr)+len+1, GCstr);
+  s->len = len;
+  memcpy(strdatawr(s), str, len);
+  return str_link(L, s, chain, h);
+}
+
+/* Intern a string object, which has been filled in by the caller.
+** The memory block holds sizeof(GCstr)+len+1 bytes. It's owned by the
+** string table afterwards and freed if an equal string already exists.
+*/
+GCstr *lj_str_intern(lua_State *L, GCstr *s, MSize len)
+{
+  global_State *g = G(L);
+  GCstr *sx;
+  GCRef *chain;
+  MSize h;
+  s->len = len;
+  if (len == 0) {
+    lj_mem_free(g, s, sizestring(s));
+    return &g->strempty;
+  }
+  h = str_hashval(g, strdata(s), len);
+  chain = str_chain(g, h);
+  sx = str_lookup(g, gcref(*chain), strdata(s), len, h);
+  if (sx) {
+    lj_mem_free(g, s, sizestring(s));
+    return sx;
+  }
+  return str_link(L, s, chain, h);
+}
+
 void LJ_FASTCALL lj_str_free(global_State *g, GCstr *s)
 {
   g->strnum--;
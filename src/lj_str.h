@@ -18,11 +18,23 @@ LJ_FUNC int lj_str_haspattern(GCstr *s);
 
 /* String interning. */
 LJ_FUNC void lj_str_resize(lua_State *L, MSize newmask);
+LJ_FUNC void LJ_FASTCALL lj_str_migrate(global_State *g, MSize n);
+#if LJ_STRHASH_SEEDED
+LJ_FUNC void lj_str_seed(global_State *g);
+#endif
 LJ_FUNCA GCstr *lj_str_new(lua_State *L, const char *str, size_t len);
+LJ_FUNC GCstr *lj_str_intern(lua_State *L, GCstr *s, MSize len);
 LJ_FUNC void LJ_FASTCALL lj_str_free(global_State *g, GCstr *s);
 
+/* Check whether a chain of the new string hash table is in use. */
+#define lj_str_chainok(g, i) \
+  ((g)->stroldhash == NULL || ((i) & (g)->stroldmask) < (g)->strmigrate)
+
 /* Actually lives in lib_string.c. */
-MatchState * ljx_str_match(lua_State *L, const char *s, const char *p, MSize slen, MSize plen, int32_t start);
+MatchState * ljx_str_match(lua_State *L, const char *s, GCstr *pat, MSize slen, int32_t start, MatchState *fail);
+GCfunc *ljx_str_gmatch_new(lua_State *L, GCstr *str, GCstr *pat);
+MatchState * ljx_str_gmatch(lua_State *L, GCfuncC *fn, GCstr *pat, MatchState *fail);
+SBuf *ljx_str_gsub(SBuf *sb, GCstr *str, GCstr *pat, GCobj *repl, int32_t max_s);
 
 #define lj_str_newz(L, s)	(lj_str_new(L, s, strlen(s)))
 #define lj_str_newlit(L, s)	(lj_str_new(L, "" s, sizeof(s)-1))
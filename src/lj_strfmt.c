@@ -22,7 +22,7 @@ static const uint8_t strfmt_map[('x'-'A')+1] = {
   0,0,0,0,0,0,0,STRFMT_UTF8,0,0,STRFMT_X,0,0,
   0,0,0,0,0,0,
   STRFMT_A,0,STRFMT_C,STRFMT_D,STRFMT_E,STRFMT_F,STRFMT_G,0,STRFMT_I,0,0,0,0,
-  0,STRFMT_O,STRFMT_P,STRFMT_Q,0,STRFMT_S,0,STRFMT_U,0,0,STRFMT_X
+  0,STRFMT_O,STRFMT_P,STRFMT_Q,STRFMT_R,STRFMT_S,0,STRFMT_U,0,0,STRFMT_X
 };
 
 SFormat LJ_FASTCALL lj_strfmt_parse(FormatState *fs)
@@ -210,6 +210,21 @@ SBuf * LJ_FASTCALL lj_strfmt_putnum(SBuf *sb, cTValue *o)
 }
 #endif
 
+#if LJ_HASJIT
+/* Add formatted tostring() of a GC object without __tostring to buffer. */
+SBuf *lj_strfmt_putfobj(SBuf *sb, SFormat sf, GCobj *o)
+{
+  lua_State *L = sbufL(sb);
+  TValue tv;
+  GCstr *str;
+  setgcV(L, &tv, o, ~o->gch.gct);
+  str = lj_strfmt_obj(L, &tv);
+  if ((sf & STRFMT_T_QUOTED))
+    return lj_strfmt_putquoted(sb, str);
+  return lj_strfmt_putfstr(sb, sf, str);
+}
+#endif
+
 SBuf * LJ_FASTCALL lj_strfmt_putptr(SBuf *sb, const void *v)
 {
   setsbufP(sb, lj_strfmt_wptr(lj_buf_more(sb, STRFMT_MAXBUF_PTR), v));
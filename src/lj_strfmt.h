@@ -36,6 +36,7 @@ typedef enum FormatType {
 #define STRFMT_T_FP_E	0x0010	/* STRFMT_NUM */
 #define STRFMT_T_FP_F	0x0020	/* STRFMT_NUM */
 #define STRFMT_T_FP_G	0x0030	/* STRFMT_NUM */
+#define STRFMT_T_FP_RT	0x0040	/* STRFMT_NUM, shortest round-trip %g */
 #define STRFMT_T_QUOTED	0x0010	/* STRFMT_STR */
 
 /* Format flags. */
@@ -66,6 +67,7 @@ typedef enum FormatType {
 #define STRFMT_O	(STRFMT_UINT|STRFMT_T_OCT)
 #define STRFMT_P	(STRFMT_PTR)
 #define STRFMT_Q	(STRFMT_STR|STRFMT_T_QUOTED)
+#define STRFMT_R	(STRFMT_G|STRFMT_T_FP_RT)
 #define STRFMT_S	(STRFMT_STR)
 #define STRFMT_U	(STRFMT_UINT)
 #define STRFMT_X	(STRFMT_UINT|STRFMT_T_HEX)
@@ -111,6 +113,9 @@ LJ_FUNC SBuf *lj_strfmt_putfnum_uint(SBuf *sb, SFormat sf, lua_Number n);
 LJ_FUNC SBuf *lj_strfmt_putfnum(SBuf *sb, SFormat, lua_Number n);
 LJ_FUNC SBuf *lj_strfmt_putfchar(SBuf *sb, SFormat, int32_t c);
 LJ_FUNC SBuf *lj_strfmt_putfstr(SBuf *sb, SFormat, GCstr *str);
+#if LJ_HASJIT
+LJ_FUNC SBuf *lj_strfmt_putfobj(SBuf *sb, SFormat sf, GCobj *o);
+#endif
 
 /* Conversions to strings. */
 LJ_FUNC GCstr * LJ_FASTCALL lj_strfmt_int(lua_State *L, int32_t k);
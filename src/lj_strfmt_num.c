@@ -13,6 +13,7 @@
 #include "lj_buf.h"
 #include "lj_str.h"
 #include "lj_strfmt.h"
+#include "lj_strscan.h"
 
 /* -- Precomputed tables -------------------------------------------------- */
 
@@ -263,13 +264,351 @@ static int nd_similar(uint32_t* nd, uint32_t ndhi, uint32_t* ref, MSize hilen,
   return !memcmp(nd9, ref9, prec) && (nd9[prec] < '5') == (ref9[prec] < '5');
 }
 
+/* -- Grisu3 digit generation --------------------------------------------- */
+
+/*
+** Grisu3 from F. Loitsch, "Printing Floating-Point Numbers Quickly and
+** Accurately with Integers", PLDI 2010. The number is scaled by a cached
+** power of ten into a 64 bit fixed-point value with a 32 bit integral part
+** and digits are generated from it with integer arithmetic only, tracking
+** the error bounds. It gives up in the rare cases where these don't allow
+** a definite answer, which then take the exact path.
+*/
+
+/* Cached powers 10^k ~ f*2^e for k = -348 through 340, in steps of 8. */
+static const struct { uint64_t f; int16_t e, k; } grisu_pow[] = {
+  {U64x(fa8fd5a0,081c0288),-1220,-348}, {U64x(baaee17f,a23ebf76),-1193,-340},
+  {U64x(8b16fb20,3055ac76),-1166,-332}, {U64x(cf42894a,5dce35ea),-1140,-324},
+  {U64x(9a6bb0aa,55653b2d),-1113,-316}, {U64x(e61acf03,3d1a45df),-1087,-308},
+  {U64x(ab70fe17,c79ac6ca),-1060,-300}, {U64x(ff77b1fc,bebcdc4f),-1034,-292},
+  {U64x(be5691ef,416bd60c),-1007,-284}, {U64x(8dd01fad,907ffc3c),-980,-276},
+  {U64x(d3515c28,31559a83),-954,-268}, {U64x(9d71ac8f,ada6c9b5),-927,-260},
+  {U64x(ea9c2277,23ee8bcb),-901,-252}, {U64x(aecc4991,4078536d),-874,-244},
+  {U64x(823c1279,5db6ce57),-847,-236}, {U64x(c2109436,4dfb5637),-821,-228},
+  {U64x(9096ea6f,3848984f),-794,-220}, {U64x(d77485cb,25823ac7),-768,-212},
+  {U64x(a086cfcd,97bf97f4),-741,-204}, {U64x(ef340a98,172aace5),-715,-196},
+  {U64x(b23867fb,2a35b28e),-688,-188}, {U64x(84c8d4df,d2c63f3b),-661,-180},
+  {U64x(c5dd4427,1ad3cdba),-635,-172}, {U64x(936b9fce,bb25c996),-608,-164},
+  {U64x(dbac6c24,7d62a584),-582,-156}, {U64x(a3ab6658,0d5fdaf6),-555,-148},
+  {U64x(f3e2f893,dec3f126),-529,-140}, {U64x(b5b5ada8,aaff80b8),-502,-132},
+  {U64x(87625f05,6c7c4a8b),-475,-124}, {U64x(c9bcff60,34c13053),-449,-116},
+  {U64x(964e858c,91ba2655),-422,-108}, {U64x(dff97724,70297ebd),-396,-100},
+  {U64x(a6dfbd9f,b8e5b88f),-369,-92}, {U64x(f8a95fcf,88747d94),-343,-84},
+  {U64x(b9447093,8fa89bcf),-316,-76}, {U64x(8a08f0f8,bf0f156b),-289,-68},
+  {U64x(cdb02555,653131b6),-263,-60}, {U64x(993fe2c6,d07b7fac),-236,-52},
+  {U64x(e45c10c4,2a2b3b06),-210,-44}, {U64x(aa242499,697392d3),-183,-36},
+  {U64x(fd87b5f2,8300ca0e),-157,-28}, {U64x(bce50864,92111aeb),-130,-20},
+  {U64x(8cbccc09,6f5088cc),-103,-12}, {U64x(d1b71758,e219652c),-77,-4},
+  {U64x(9c400000,00000000),-50,4}, {U64x(e8d4a510,00000000),-24,12},
+  {U64x(ad78ebc5,ac620000),3,20}, {U64x(813f3978,f8940984),30,28},
+  {U64x(c097ce7b,c90715b3),56,36}, {U64x(8f7e32ce,7bea5c70),83,44},
+  {U64x(d5d238a4,abe98068),109,52}, {U64x(9f4f2726,179a2245),136,60},
+  {U64x(ed63a231,d4c4fb27),162,68}, {U64x(b0de6538,8cc8ada8),189,76},
+  {U64x(83c7088e,1aab65db),216,84}, {U64x(c45d1df9,42711d9a),242,92},
+  {U64x(924d692c,a61be758),269,100}, {U64x(da01ee64,1a708dea),295,108},
+  {U64x(a26da399,9aef774a),322,116}, {U64x(f209787b,b47d6b85),348,124},
+  {U64x(b454e4a1,79dd1877),375,132}, {U64x(865b8692,5b9bc5c2),402,140},
+  {U64x(c83553c5,c8965d3d),428,148}, {U64x(952ab45c,fa97a0b3),455,156},
+  {U64x(de469fbd,99a05fe3),481,164}, {U64x(a59bc234,db398c25),508,172},
+  {U64x(f6c69a72,a3989f5c),534,180}, {U64x(b7dcbf53,54e9bece),561,188},
+  {U64x(88fcf317,f22241e2),588,196}, {U64x(cc20ce9b,d35c78a5),614,204},
+  {U64x(98165af3,7b2153df),641,212}, {U64x(e2a0b5dc,971f303a),667,220},
+  {U64x(a8d9d153,5ce3b396),694,228}, {U64x(fb9b7cd9,a4a7443c),720,236},
+  {U64x(bb764c4c,a7a44410),747,244}, {U64x(8bab8eef,b6409c1a),774,252},
+  {U64x(d01fef10,a657842c),800,260}, {U64x(9b10a4e5,e9913129),827,268},
+  {U64x(e7109bfb,a19c0c9d),853,276}, {U64x(ac2820d9,623bf429),880,284},
+  {U64x(80444b5e,7aa7cf85),907,292}, {U64x(bf21e440,03acdd2d),933,300},
+  {U64x(8e679c2f,5e44ff8f),960,308}, {U64x(d433179d,9c8cb841),986,316},
+  {U64x(9e19db92,b4e31ba9),1013,324}, {U64x(eb96bf6e,badf77d9),1039,332},
+  {U64x(af87023b,9bf0ee6b),1066,340}
+};
+
+/* Two-digit decimal strings for 0 through 99. */
+static const char grisu_dig2[] =
+  "0001020304050607080910111213141516171819"
+  "2021222324252627282930313233343536373839"
+  "4041424344454647484950515253545556575859"
+  "6061626364656667686970717273747576777879"
+  "8081828384858687888990919293949596979899";
+
+/* Write 4 digits of x < 10000 to p. */
+#define GRISU_WDIG4(p, x) \
+  { uint32_t hi_ = (x) / 100; \
+    memcpy((p), grisu_dig2 + 2*hi_, 2); \
+    memcpy((p)+2, grisu_dig2 + 2*((x) - hi_*100), 2); }
+
+/* Multiply two 64 bit fractions, returning the rounded upper half. */
+static uint64_t grisu_mul(uint64_t x, uint64_t y)
+{
+  uint64_t a = x >> 32, b = (uint32_t)x, c = y >> 32, d = (uint32_t)y;
+  uint64_t ad = a*d, bc = b*c;
+  uint64_t mid = ((b*d) >> 32) + (uint32_t)ad + (uint32_t)bc + 0x80000000u;
+  return a*c + (ad >> 32) + (bc >> 32) + (mid >> 32);
+}
+
+/* Normalize the significand of a finite n > 0. Returns the exponent. */
+static int32_t grisu_norm(lua_Number n, uint64_t *fp, int32_t *shp)
+{
+  TValue t;
+  uint64_t f;
+  int32_t e, sh;
+  t.n = n;
+  f = t.u64 & U64x(000fffff,ffffffff);
+  e = (t.u32.hi >> 20) & 0x7ff;
+  if (e) { f |= U64x(00100000,00000000); e -= 1075; } else { e = -1074; }
+  sh = 63 - (int32_t)((f >> 32) ? lj_fls((uint32_t)(f >> 32)) + 32 :
+				  lj_fls((uint32_t)f));
+  *fp = f << sh;
+  *shp = sh;
+  return e - sh;
+}
+
+/* Get the cached power which scales 2^(e+64) into [2^4, 2^32]. */
+static int32_t grisu_pow_idx(int32_t e)
+{
+  double dk = (-61 - e) * 0.30102999566398114;
+  int32_t k = (int32_t)dk;
+  if (dk > k) k++;
+  return (348 + k - 1) / 8 + 1;
+}
+
+/* Write the integral part of a scaled number as 10 digits. */
+static MSize grisu_wip(char *p, uint32_t ip)
+{
+  uint32_t hi = ip / 100000000, lo = ip - hi * 100000000, x = lo / 10000;
+  lua_assert(ip != 0);
+  memcpy(p, grisu_dig2 + 2*hi, 2);
+  lo -= x * 10000;
+  GRISU_WDIG4(p+2, x)
+  GRISU_WDIG4(p+6, lo)
+  return ndigits_dec(ip);
+}
+
+/* Move the last digit closer to the number. Returns 0 if unsure. */
+static int grisu_weed(char *p, uint64_t dist, uint64_t delta, uint64_t rest,
+		      uint64_t tenk, uint64_t unit)
+{
+  uint64_t lo = dist - unit, hi = dist + unit;
+  while (rest < lo && delta - rest >= tenk &&
+	 (rest + tenk < lo || lo - rest >= rest + tenk - lo)) {
+    p[-1]--;
+    rest += tenk;
+  }
+  if (rest < hi && delta - rest >= tenk &&
+      (rest + tenk < hi || hi - rest > rest + tenk - hi))
+    return 0;
+  return 2*unit <= rest && rest <= delta - 4*unit;
+}
+
+/*
+** Write the shortest digits which read back as a finite n > 0 to p. Returns
+** the end pointer and the decimal exponent of the first digit in *ndep, or
+** NULL if unsure.
+*/
+static char *grisu_shortest(char *p, lua_Number n, int32_t *ndep)
+{
+  uint64_t fw, fp, fm, one, delta, frac, unit = 1;
+  int32_t sh, e = grisu_norm(n, &fw, &sh), k;
+  uint32_t ip, div;
+  MSize nip;
+  char ipd[10], *s;
+  /* Boundaries m+ and m- halfway to the neighbours of n. */
+  fp = fw + ((uint64_t)1 << (sh-1));
+  if (fw == U64x(80000000,00000000) && sh == 11 && e > -1085)
+    fm = fw - ((uint64_t)1 << (sh-2));  /* Lower neighbour is closer. */
+  else
+    fm = fw - ((uint64_t)1 << (sh-1));
+  k = grisu_pow_idx(e);
+  sh = -(e + grisu_pow[k].e + 64);
+  fw = grisu_mul(fw, grisu_pow[k].f);
+  fp = grisu_mul(fp, grisu_pow[k].f) + unit;
+  fm = grisu_mul(fm, grisu_pow[k].f) - unit;
+  /* Generate digits of m+ until the rest is inside the unsafe interval. */
+  delta = fp - fm;
+  one = (uint64_t)1 << sh;
+  ip = (uint32_t)(fp >> sh);
+  frac = fp & (one - 1);
+  nip = grisu_wip(ipd, ip);
+  *ndep = (int32_t)nip - 1 - grisu_pow[k].k;
+  div = ndigits_dec_threshold[nip-1] + 1;
+  for (s = ipd + 10 - nip; ; div /= 10) {
+    uint64_t rest;
+    ip -= (uint32_t)(*s - '0') * div;
+    *p++ = *s++;
+    rest = ((uint64_t)ip << sh) + frac;
+    if (rest < delta)
+      return grisu_weed(p, fp - fw, delta, rest, (uint64_t)div << sh, unit) ?
+	     p : NULL;
+    if (s == ipd + 10) break;
+  }
+  for (;;) {
+    frac *= 10; unit *= 10; delta *= 10;
+    *p++ = (char)('0' + (frac >> sh));
+    frac &= one - 1;
+    if (frac < delta)
+      return grisu_weed(p, (fp - fw) * unit, delta, frac, one, unit) ? p : NULL;
+  }
+}
+
+/*
+** Write 14 correctly rounded digits of a finite n > 0 to p. Returns the end
+** pointer and the decimal exponent of the first digit in *ndep, or NULL if
+** n is too close to the middle between two roundings.
+*/
+static char *grisu_fixed14(char *p, lua_Number n, int32_t *ndep)
+{
+  uint64_t f, one, tenr, lo, x1, x2, d;
+  int32_t sh, e = grisu_norm(n, &f, &sh), k;
+  uint32_t ip, nip, a, b;
+  k = grisu_pow_idx(e);
+  sh = -(e + grisu_pow[k].e + 64);
+  f = grisu_mul(f, grisu_pow[k].f);
+  one = (uint64_t)1 << sh;
+  ip = (uint32_t)(f >> sh);
+  nip = ndigits_dec(ip);
+  /* Get the other digits from the 128 bit product fraction * 10^(14-nip). */
+  tenr = nip < 5 ? (uint64_t)(ndigits_dec_threshold[5-nip]+1) * 1000000000 :
+		   ndigits_dec_threshold[14-nip]+1;
+  f &= one - 1;
+  lo = (f & 0xffffffffu) * (tenr & 0xffffffffu);
+  x1 = (f >> 32) * (tenr & 0xffffffffu);
+  x2 = (f & 0xffffffffu) * (tenr >> 32);
+  d = (lo >> 32) + (uint32_t)x1 + (uint32_t)x2;
+  x1 = (f >> 32) * (tenr >> 32) + (x1 >> 32) + (x2 >> 32) + (d >> 32);
+  lo = (lo & 0xffffffffu) | (d << 32);
+  d = ip * tenr + ((x1 << (64 - sh)) | (lo >> sh));
+  lo &= one - 1;
+  /* The scaling error is below tenr units, so the rest decides unless close. */
+  if (2*(lo + tenr) > one) {
+    if (lo <= tenr || 2*(lo - tenr) < one)
+      return NULL;
+    if (++d == U64x(00005af3,107a4000)) { d /= 10; nip++; }  /* 10^14 */
+  }
+  *ndep = (int32_t)nip - 1 - grisu_pow[k].k;
+  /* Write the 14 digits as independent groups of 2+4+4+4. */
+  a = (uint32_t)(d / 100000000);
+  b = (uint32_t)(d - (uint64_t)a * 100000000);
+  ip = a / 10000; a -= ip * 10000;
+  memcpy(p, grisu_dig2 + 2*ip, 2);
+  GRISU_WDIG4(p+2, a)
+  ip = b / 10000; b -= ip * 10000;
+  GRISU_WDIG4(p+6, ip)
+  GRISU_WDIG4(p+10, b)
+  return p + 14;
+}
+
 /* -- Formatted conversions to buffer ------------------------------------- */
 
+static char *lj_strfmt_wfnum(SBuf *sb, SFormat sf, lua_Number n, char *p);
+
+/* Write the digits of a finite n > 0 which round-trip to p. */
+static char *strfmt_wrtdigits(char *p, lua_Number n, int32_t *ndep)
+{
+  char buf[STRFMT_MAXBUF_NUM], *q;
+  MSize prec;
+  int32_t nde = 0;
+  if ((q = grisu_shortest(p, n, ndep)))
+    return q;
+  /* Otherwise find the smallest %e precision which reads back as n. */
+  for (prec = 15; ; prec++) {
+    TValue o;
+    q = lj_strfmt_wfnum(NULL, STRFMT_E | (prec << STRFMT_SH_PREC), n, buf);
+    *q = '\0';
+    if (prec == 17 || (lj_strscan_scan((const uint8_t *)buf, &o,
+			STRSCAN_OPT_TONUM) == STRSCAN_NUM && o.n == n))
+      break;
+  }
+  /* Convert d.ddde+xx back to digits and exponent. */
+  *p = buf[0];
+  memcpy(p+1, buf+2, prec-1);
+  for (q = buf+prec+3; *q; q++) nde = nde*10 + (*q - '0');
+  *ndep = buf[prec+2] == '-' ? -nde : nde;
+  return p + prec;
+}
+
+/*
+** Shortcut for plain %.14g (as used by tostring) and %r. Returns NULL if
+** Grisu3 can't decide the rounding of the 14th digit.
+*/
+static char *strfmt_wshort(SBuf *sb, SFormat sf, lua_Number n, char *p)
+{
+  MSize width = STRFMT_WIDTH(sf), len, i;
+  int32_t nde, prec = 14;
+  char dig[40], *q, prefix = 0;
+  TValue t;
+  t.n = n;
+  if ((t.u32.hi & 0x80000000)) prefix = '-';
+  else if ((sf & STRFMT_F_PLUS)) prefix = '+';
+  else if ((sf & STRFMT_F_SPACE)) prefix = ' ';
+  t.u32.hi &= 0x7fffffff;
+  if (t.n < 2147483648.0 && t.n == (lua_Number)lj_num2int(t.n)) {
+    q = lj_strfmt_wint(dig, lj_num2int(t.n));
+    nde = (int32_t)(q - dig) - 1;
+  } else if ((sf & STRFMT_T_FP_RT)) {
+    q = strfmt_wrtdigits(dig, t.n, &nde);
+    prec = 17;
+  } else if (!(q = grisu_fixed14(dig, t.n, &nde))) {
+    return NULL;
+  }
+  while (q > dig+1 && q[-1] == '0') q--;
+  len = (MSize)(q - dig);
+  /* Emit the digits like %g with trailing zeros removed. */
+  if (nde < -4 || nde >= prec) {
+    i = len + (len > 1) + 4 + (nde <= -100 || nde >= 100);
+  } else if (nde < 0) {
+    i = len + 1 - nde;
+  } else {
+    i = len > (MSize)nde+1 ? len+1 : (MSize)nde+1;
+  }
+  i += (prefix != 0);
+  if (!p) p = lj_buf_more(sb, (width > i ? width : i) + 17);
+  if (!(sf & (STRFMT_F_LEFT | STRFMT_F_ZERO))) {
+    while (width-- > i) *p++ = ' ';
+  }
+  if (prefix) *p++ = prefix;
+  if ((sf & (STRFMT_F_LEFT | STRFMT_F_ZERO)) == STRFMT_F_ZERO) {
+    while (width-- > i) *p++ = '0';
+  }
+  /* Digits are copied in blocks of 17, so the buffer needs some slack. */
+  q = dig;
+  if (nde < -4 || nde >= prec) {
+    *p++ = *q;
+    if (len > 1) {
+      *p = '.';
+      memcpy(p+1, q+1, 17);
+      p += len;
+    }
+    *p++ = (sf & STRFMT_F_UPPER) ? 'E' : 'e';
+    if (nde < 0) { *p++ = '-'; nde = -nde; } else { *p++ = '+'; }
+    if (nde < 10) *p++ = '0';
+    p = lj_strfmt_wint(p, nde);
+  } else if (nde < 0) {
+    *p++ = '0'; *p++ = '.';
+    while (++nde < 0) *p++ = '0';
+    memcpy(p, q, 17);
+    p += len;
+  } else {
+    memcpy(p, q, 17);
+    if (len > (MSize)nde+1) {
+      p += nde+1;
+      *p = '.';
+      memcpy(p+1, q+nde+1, 17);
+      p += len - (MSize)nde;
+    } else {
+      p += len;
+      while (len++ <= (MSize)nde) *p++ = '0';
+    }
+  }
+  if ((sf & STRFMT_F_LEFT)) while (width-- > i) *p++ = ' ';
+  return p;
+}
+
 /* Write formatted floating-point number to either sb or p. */
 static char *lj_strfmt_wfnum(SBuf *sb, SFormat sf, lua_Number n, char *p)
 {
   MSize width = STRFMT_WIDTH(sf), prec = STRFMT_PREC(sf), len;
   TValue t;
+  char *q;
   t.n = n;
   if (LJ_UNLIKELY((t.u32.hi << 1) >= 0xffe00000)) {
     /* Handle non-finite values uniformly for %a, %e, %f, %g. */
@@ -288,6 +627,9 @@ static char *lj_strfmt_wfnum(SBuf *sb, SFormat sf, lua_Number n, char *p)
     if (!(sf & STRFMT_F_LEFT)) while (width-- > len) *p++ = ' ';
     if (prefix) *p++ = prefix;
     *p++ = (char)(ch >> 16); *p++ = (char)(ch >> 8); *p++ = (char)ch;
+  } else if ((sf == STRFMT_G14 || (sf & STRFMT_T_FP_RT)) &&
+	     (q = strfmt_wshort(sb, sf, n, p)) != NULL) {
+    return q;
   } else if (STRFMT_FP(sf) == STRFMT_FP(STRFMT_T_FP_A)) {
     /* %a */
     const char *hexdig = (sf & STRFMT_F_UPPER) ? "0123456789ABCDEFPX"
@@ -350,7 +692,7 @@ static char *lj_strfmt_wfnum(SBuf *sb, SFormat sf, lua_Number n, char *p)
     uint32_t nd[64];
     uint32_t ndhi = 0, ndlo, i;
     int32_t e = (t.u32.hi >> 20) & 0x7ff, ndebias = 0;
-    char prefix = 0, *q;
+    char prefix = 0;
     if (t.u32.hi & 0x80000000) prefix = '-';
     else if ((sf & STRFMT_F_PLUS)) prefix = '+';
     else if ((sf & STRFMT_F_SPACE)) prefix = ' ';
@@ -50,8 +50,10 @@
 ** handles simple integers on-the-fly. Otherwise, it dispatches to the
 ** base-specific parser. Hex and octal is straightforward.
 **
-** Decimal to binary conversion uses a fixed-length circular buffer in
-** base 100. Some simple cases are handled directly. For other cases, the
+** Decimals with up to 19 significant digits are first tried with a fast
+** 128 bit scaling, which decides all but a tiny fraction of the inputs.
+** Otherwise, decimal to binary conversion uses a fixed-length circular
+** buffer in base 100. Some simple cases are handled directly. For other cases, the
 ** number in the buffer is up-scaled or down-scaled until the integer part
 ** is in the proper range. Then the integer part is rounded and converted
 ** to a double which is finally rescaled to the result. Denormals need
@@ -177,6 +179,138 @@ static StrScanFmt strscan_oct(const uint8_t *p, TValue *o,
   return fmt;
 }
 
+/* -- Fast path for short decimals --------------------------------------- */
+
+/*
+** Most decimals have at most 19 significant digits, so the digits fit
+** into a uint64_t. Scaling it by a 128 bit approximation of the power of
+** ten gives the correctly rounded double, unless the dropped bits are
+** within the error bound of the halfway point (Eisel-Lemire). This is
+** very rare and the exact conversion below handles it.
+**
+** The powers are composed from 10^(16*k) and 10^r to keep the table small.
+*/
+
+/* 128 bit significands of 10^q for q = -352, -336, ..., 304. */
+static const uint64_t strscan_pow10[42][2] = {
+  { U64x(cd42a113,46f34f7d), U64x(0092757b,f2623727) },
+  { U64x(e3e27a44,4d8d98b7), U64x(fd1b1b23,08169b25) },
+  { U64x(fd00b897,478238d0), U64x(8920b098,955522b5) },
+  { U64x(8c71dcd9,ba0b4925), U64x(9ff0c08b,7f1d0b15) },
+  { U64x(9becce62,836ac577), U64x(4ee367f9,430aec33) },
+  { U64x(ad1c8eab,5ee43b66), U64x(da324365,0005eecf) },
+  { U64x(c0314325,637a1939), U64x(fa911155,fefb5309) },
+  { U64x(d5605fcd,cf32e1d6), U64x(fb1e4a9a,90880a65) },
+  { U64x(ece53cec,4a314ebd), U64x(a4f8bf56,35246428) },
+  { U64x(8380dea9,3da4bc60), U64x(4247cb9e,59f71e6d) },
+  { U64x(91ff8377,5423cc06), U64x(7b6306a3,4627ddcf) },
+  { U64x(a21727db,38cb002f), U64x(b8ada00e,5a506a7d) },
+  { U64x(b3f4e093,db73a093), U64x(59ed2167,65690f57) },
+  { U64x(c7caba6e,7c5382c8), U64x(fe64a52e,e96b8fc1) },
+  { U64x(ddd0467c,64bce4a0), U64x(ac7cb3f6,d05ddbdf) },
+  { U64x(f64335bc,f065d37d), U64x(4d4617b5,ff4a16d6) },
+  { U64x(88b402f7,fd75539b), U64x(11dbcb02,18ebb414) },
+  { U64x(97c560ba,6b0919a5), U64x(dccd879f,c967d41a) },
+  { U64x(a87fea27,a539e9a5), U64x(3f2398d7,47b36224) },
+  { U64x(bb127c53,b17ec159), U64x(5560c018,580d5d52) },
+  { U64x(cfb11ead,453994ba), U64x(67de18ed,a5814af2) },
+  { U64x(e69594be,c44de15b), U64x(4c2ebe68,7989a9b4) },
+  { U64x(80000000,00000000), U64x(00000000,00000000) },
+  { U64x(8e1bc9bf,04000000), U64x(00000000,00000000) },
+  { U64x(9dc5ada8,2b70b59d), U64x(f0200000,00000000) },
+  { U64x(af298d05,0e4395d6), U64x(9670b12b,7f410000) },
+  { U64x(c2781f49,ffcfa6d5), U64x(3cbf6b71,c76b25fb) },
+  { U64x(d7e77a8f,87daf7fb), U64x(dc33745e,c97be906) },
+  { U64x(efb3ab16,c59b14a2), U64x(c5cfe94e,f3ea101e) },
+  { U64x(850fadc0,9923329e), U64x(03e2cf6b,c604ddb0) },
+  { U64x(93ba47c9,80e98cdf), U64x(c66f336c,36b10137) },
+  { U64x(a402b9c5,a8d3a6e7), U64x(5f16206c,9c6209a6) },
+  { U64x(b616a12b,7fe617aa), U64x(577b986b,314d6009) },
+  { U64x(ca28a291,859bbf93), U64x(7d7b8f75,03cfdcff) },
+  { U64x(e070f78d,3927556a), U64x(85bbe253,f47b1417) },
+  { U64x(f92e0c35,37826145), U64x(a7709a56,ccdf8a83) },
+  { U64x(8a5296ff,e33cc92f), U64x(82bd6b70,d99aaa70) },
+  { U64x(9991a6f3,d6bf1765), U64x(acca6da1,e0a8ef29) },
+  { U64x(aa7eebfb,9df9de8d), U64x(ddbb901b,98feeab8) },
+  { U64x(bd49d14a,a79dbc82), U64x(4b2d8644,d8a74e19) },
+  { U64x(d226fc19,5c6a2f8c), U64x(73832eec,6fff3112) },
+  { U64x(e950df20,247c83fd), U64x(47c6b82e,f32a2069) }
+};
+
+/* Normalized 10^r for r = 0..15. */
+static const uint64_t strscan_pow10r[16] = {
+  U64x(80000000,00000000), U64x(a0000000,00000000), U64x(c8000000,00000000),
+  U64x(fa000000,00000000), U64x(9c400000,00000000), U64x(c3500000,00000000),
+  U64x(f4240000,00000000), U64x(98968000,00000000), U64x(bebc2000,00000000),
+  U64x(ee6b2800,00000000), U64x(9502f900,00000000), U64x(ba43b740,00000000),
+  U64x(e8d4a510,00000000), U64x(9184e72a,00000000), U64x(b5e620f4,80000000),
+  U64x(e35fa931,a0000000)
+};
+
+/* Multiply two uint64_t. Returns the high part, stores the low part. */
+static LJ_AINLINE uint64_t strscan_mul(uint64_t a, uint64_t b, uint64_t *lo)
+{
+#ifdef __SIZEOF_INT128__
+  __uint128_t r = (__uint128_t)a * b;
+  *lo = (uint64_t)r;
+  return (uint64_t)(r >> 64);
+#else
+  uint64_t al = (uint32_t)a, ah = a >> 32, bl = (uint32_t)b, bh = b >> 32;
+  uint64_t ll = al*bl, lh = al*bh, hl = ah*bl, hh = ah*bh;
+  uint64_t mid = (ll >> 32) + (uint32_t)lh + (uint32_t)hl;
+  *lo = (mid << 32) | (uint32_t)ll;
+  return hh + (lh >> 32) + (hl >> 32) + (mid >> 32);
+#endif
+}
+
+/* Multiply normalized 128 and 64 bit numbers. Keeps the normalized top
+** 128 bits and returns 1 if the product needed no shift.
+*/
+static int strscan_mul128(uint64_t *hp, uint64_t *lp, uint64_t y)
+{
+  uint64_t h, m, l, t;
+  h = strscan_mul(*hp, y, &m);
+  t = strscan_mul(*lp, y, &l);
+  m += t; h += (m < t);
+  if ((int64_t)h < 0) { *hp = h; *lp = m; return 1; }
+  *hp = (h << 1) | (m >> 63); *lp = (m << 1) | (l >> 63);
+  return 0;
+}
+
+/* Convert up to 19 significant decimal digits. Returns 0 if undecided. */
+static int strscan_fastdec(const uint8_t *p, TValue *o,
+			   int32_t ex10, int32_t neg, uint32_t dig)
+{
+  uint64_t x = 0, h, l, r, half;
+  int32_t q, e, sh;
+  do {
+    x = x * 10 + ((*p != '.' ? *p : *++p) & 15); p++;
+  } while (--dig);
+  if (ex10 < -352 || ex10 > 308) return 0;  /* Leave 0 or inf to slow path. */
+  /* Normalize the digits and scale them by 10^ex10. */
+  sh = 63 - (int32_t)((x >> 32) ? lj_fls((uint32_t)(x >> 32)) + 32 :
+				  lj_fls((uint32_t)x));
+  q = ex10 + 352;
+  h = strscan_pow10[q >> 4][0]; l = strscan_pow10[q >> 4][1];
+  e = (((ex10 - (q & 15)) * 217706) >> 16) + 63 - sh;
+  if ((q & 15))
+    e += (((q & 15) * 217706) >> 16) +
+	 strscan_mul128(&h, &l, strscan_pow10r[q & 15]);
+  e += strscan_mul128(&h, &l, x << sh);
+  /* Now 2^e <= |n| < 2^(e+1), except for an error below 8 units of l. */
+  if (e > 1023) return 0;
+  sh = e >= -1022 ? 11 : -1011 - e;  /* Denormals have fewer bits. */
+  if (sh > 63) return 0;
+  half = (uint64_t)1 << (sh-1);
+  r = h & (half+half-1);
+  if ((r == half && l <= 8) || (r == half-1 && l >= (uint64_t)-8))
+    return 0;  /* Too close to the halfway point. */
+  x = (h >> sh) + (r >= half);
+  if (sh == 11) x += (uint64_t)(e + 1022) << 52;
+  o->u64 = neg ? x | U64x(80000000,00000000) : x;
+  return 1;
+}
+
 /* Parse decimal number. */
 static StrScanFmt strscan_dec(const uint8_t *p, TValue *o,
 			      StrScanFmt fmt, uint32_t opt,
@@ -184,6 +318,9 @@ static StrScanFmt strscan_dec(const uint8_t *p, TValue *o,
 {
   uint8_t xi[STRSCAN_DDIG], *xip = xi;
 
+  if (fmt <= STRSCAN_IMAG && dig && dig <= 19 &&
+      strscan_fastdec(p, o, ex10, neg, dig))
+    return fmt;
   if (dig) {
     uint32_t i = dig;
     if (i > STRSCAN_MAXDIG) {
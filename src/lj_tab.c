@@ -16,6 +16,85 @@
 
 /* -- Object hashing ------------------------------------------------------ */
 
+#if LJ_SWISSTAB
+/* Hashes for non-string keys. String hashes are precomputed when interned. */
+#define hashlohi(lo, hi)	hashrot((lo), (hi))
+#define hashnum(o)		hashlohi((o)->u32.lo, ((o)->u32.hi << 1))
+#if LJ_GC64
+#define hashgcref(r) \
+  hashlohi((uint32_t)gcrefu(r), (uint32_t)(gcrefu(r) >> 32))
+#else
+#define hashgcref(r)		hashlohi(gcrefu(r), gcrefu(r) + HASH_BIAS)
+#endif
+
+/* Hash an arbitrary key. Must match ir_khash() and asm_href(). */
+static uint32_t hashkey(cTValue *key)
+{
+  lua_assert(!tvisint(key));
+  if (tvisstr(key))
+    return strV(key)->hash;
+  else if (tvisnum(key))
+    return hashnum(key);
+  else if (tvisbool(key))
+    return boolV(key);
+  else
+    return hashgcref(key->gcr);
+}
+
+/* Probe state for the nodes whose control byte matches a hash. */
+typedef struct HashProbe {
+  Node *node;		/* Hash part. */
+  const uint8_t *ctrl;	/* Control bytes. */
+  uint32_t hmask;	/* Hash mask. */
+  uint32_t pos;		/* First node of the current group. */
+  uint32_t match;	/* Matching nodes left in the current group. */
+  uint32_t empty;	/* Empty nodes in the current group. */
+  __m128i h2;		/* Control byte to match, 16 times. */
+} HashProbe;
+
+static LJ_AINLINE void hprobe_group(HashProbe *hp)
+{
+  __m128i g = _mm_loadu_si128((const __m128i *)(hp->ctrl + hp->pos));
+  hp->match = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(g, hp->h2));
+  hp->empty = (uint32_t)_mm_movemask_epi8(g);
+}
+
+static LJ_AINLINE void hprobe_init(HashProbe *hp, const GCtab *t, uint32_t h)
+{
+  hp->node = noderef(t->node);
+  hp->hmask = t->hmask;
+  hp->ctrl = hctrl(hp->node, hp->hmask);
+  hp->pos = h & hp->hmask;
+  hp->h2 = _mm_set1_epi8((char)hctrl_h2(h));
+  hprobe_group(hp);
+}
+
+/* Get the next candidate node or NULL if the key is not present. */
+static LJ_AINLINE Node *hprobe_next(HashProbe *hp)
+{
+  uint32_t i;
+  while (!hp->match) {
+    if (hp->empty) return NULL;  /* The key would be before the empty node. */
+    hp->pos = (hp->pos + HCTRL_GROUP) & hp->hmask;
+    hprobe_group(hp);
+  }
+  i = (hp->pos + lj_ffs(hp->match)) & hp->hmask;
+  hp->match &= hp->match - 1;
+  return &hp->node[i];
+}
+
+/* Loop over the candidate nodes for the hash h. Needs a HashProbe hp. */
+#define hashloop(t, h, n) \
+  for (hprobe_init(&hp, (t), (h)); ((n) = hprobe_next(&hp)) != NULL; )
+
+/* Set a control byte and its copy in the trailing bytes. */
+static LJ_AINLINE void hctrl_set(uint8_t *ctrl, uint32_t hmask, uint32_t i,
+				 uint8_t c)
+{
+  for (ctrl[i] = c, i += hmask+1; i < hmask + HCTRL_GROUP; i += hmask+1)
+    ctrl[i] = c;
+}
+#else
 /* Hash values are masked with the table hash mask and used as an index. */
 static LJ_AINLINE Node *hashmask(const GCtab *t, uint32_t hash)
 {
@@ -50,6 +129,7 @@ static Node *hashkey(const GCtab *t, cTValue *key)
     return hashgcref(t, key->gcr);
   /* Only hash 32 bits of lightuserdata on a 64 bit CPU. Good enough? */
 }
+#endif
 
 /* -- Table creation and destruction -------------------------------------- */
 
@@ -62,9 +142,11 @@ static LJ_AINLINE void newhpart(lua_State *L, GCtab *t, uint32_t hbits)
   if (hbits > LJ_MAX_HBITS)
     lj_err_msg(L, LJ_ERR_TABOV);
   hsize = 1u << hbits;
-  node = lj_mem_newvec(L, hsize, Node);
+  node = (Node *)lj_mem_new(L, (GCSize)sizehpart(hsize-1));
   setmref(t->node, node);
+#if !LJ_SWISSTAB
   setfreetop(t, node, &node[hsize]);
+#endif
   t->hmask = hsize-1;
 }
 
@@ -82,10 +164,16 @@ static LJ_AINLINE void clearhpart(GCtab *t)
   lua_assert(t->hmask != 0);
   for (i = 0; i <= hmask; i++) {
     Node *n = &node[i];
+#if !LJ_SWISSTAB
     setmref(n->next, NULL);
+#endif
     setnilV(&n->key);
     setnilV(&n->val);
   }
+#if LJ_SWISSTAB
+  memset(hctrl(node, hmask), HCTRL_EMPTY, hmask + HCTRL_GROUP);
+  *hfreeref(node, hmask) = hfreemax(hmask);
+#endif
 }
 
 /* Clear array part of table. */
@@ -115,8 +203,14 @@ static GCtab *newtab(lua_State *L, uint32_t asize, uint32_t hbits)
     t->hmask = 0;
     nilnode = &G(L)->nilnode;
     setmref(t->node, nilnode);
-#if LJ_GC64
+#if LJ_GC64 && !LJ_SWISSTAB
     setmref(t->freetop, nilnode);
+#endif
+#if LJ_TABSHAPE
+    setgcrefnull(t->shape);
+#endif
+#if LJ_NUMARRAY
+    t->numarr = 1;
 #endif
   } else {  /* Otherwise separately allocate the array part. */
     Node *nilnode;
@@ -130,8 +224,14 @@ static GCtab *newtab(lua_State *L, uint32_t asize, uint32_t hbits)
     t->hmask = 0;
     nilnode = &G(L)->nilnode;
     setmref(t->node, nilnode);
-#if LJ_GC64
+#if LJ_GC64 && !LJ_SWISSTAB
     setmref(t->freetop, nilnode);
+#endif
+#if LJ_TABSHAPE
+    setgcrefnull(t->shape);
+#endif
+#if LJ_NUMARRAY
+    t->numarr = 1;
 #endif
     if (asize > 0) {
       if (asize > LJ_MAX_ASIZE)
@@ -189,6 +289,13 @@ GCtab * LJ_FASTCALL lj_tab_dup(lua_State *L, const GCtab *kt)
   t = newtab(L, kt->asize, kt->hmask > 0 ? lj_fls(kt->hmask)+1 : 0);
   lua_assert(kt->asize == t->asize && kt->hmask == t->hmask);
   t->nomm = 0;  /* Keys with metamethod names may be present. */
+#if LJ_TABSHAPE
+  /* Templates are never changed once duplicated, see rec_idx_bump(). */
+  setgcref(t->shape, obj2gco(kt));
+#endif
+#if LJ_NUMARRAY
+  t->numarr = (uint8_t)(kt->numarr == 1);
+#endif
   asize = kt->asize;
   if (asize > 0) {
     TValue *array = tvref(t->array);
@@ -202,6 +309,11 @@ GCtab * LJ_FASTCALL lj_tab_dup(lua_State *L, const GCtab *kt)
     }
   }
   hmask = kt->hmask;
+#if LJ_SWISSTAB
+  /* Nodes are not linked, so the hash part is copied as a whole. */
+  if (hmask > 0)
+    memcpy(noderef(t->node), noderef(kt->node), sizehpart(hmask));
+#else
   if (hmask > 0) {
     uint32_t i;
     Node *node = noderef(t->node);
@@ -217,6 +329,7 @@ GCtab * LJ_FASTCALL lj_tab_dup(lua_State *L, const GCtab *kt)
       setmref(n->next, next == NULL? next : (Node *)((char *)next + d));
     }
   }
+#endif
   return t;
 }
 
@@ -224,9 +337,17 @@ GCtab * LJ_FASTCALL lj_tab_dup(lua_State *L, const GCtab *kt)
 void LJ_FASTCALL lj_tab_clear(GCtab *t)
 {
   clearapart(t);
+#if LJ_NUMARRAY
+  t->numarr = 1;
+#endif
   if (t->hmask > 0) {
+#if LJ_TABSHAPE
+    setgcrefnull(t->shape);
+#endif
+#if !LJ_SWISSTAB
     Node *node = noderef(t->node);
     setfreetop(t, node, &node[t->hmask+1]);
+#endif
     clearhpart(t);
   }
 }
@@ -235,7 +356,7 @@ void LJ_FASTCALL lj_tab_clear(GCtab *t)
 void LJ_FASTCALL lj_tab_free(global_State *g, GCtab *t)
 {
   if (t->hmask > 0)
-    lj_mem_freevec(g, noderef(t->node), t->hmask+1, Node);
+    lj_mem_free(g, noderef(t->node), sizehpart(t->hmask));
   if (t->asize > 0 && LJ_MAX_COLOSIZE != 0 && t->colo <= 0)
     lj_mem_freevec(g, tvref(t->array), t->asize, TValue);
   if (LJ_MAX_COLOSIZE != 0 && t->colo)
@@ -252,6 +373,10 @@ void lj_tab_resize(lua_State *L, GCtab *t, uint32_t asize, uint32_t hbits)
   Node *oldnode = noderef(t->node);
   uint32_t oldasize = t->asize;
   uint32_t oldhmask = t->hmask;
+  lj_gc_barriermove(L, t);
+#if LJ_TABSHAPE
+  setgcrefnull(t->shape);
+#endif
   if (asize > oldasize) {  /* Array part grows? */
     TValue *array;
     uint32_t i;
@@ -280,7 +405,7 @@ void lj_tab_resize(lua_State *L, GCtab *t, uint32_t asize, uint32_t hbits)
   } else {
     global_State *g = G(L);
     setmref(t->node, &g->nilnode);
-#if LJ_GC64
+#if LJ_GC64 && !LJ_SWISSTAB
     setmref(t->freetop, &g->nilnode);
 #endif
     t->hmask = 0;
@@ -306,7 +431,7 @@ void lj_tab_resize(lua_State *L, GCtab *t, uint32_t asize, uint32_t hbits)
 	copyTV(L, lj_tab_set(L, t, &n->key), &n->val);
     }
     g = G(L);
-    lj_mem_freevec(g, oldnode, oldhmask+1, Node);
+    lj_mem_free(g, oldnode, sizehpart(oldhmask));
   }
 }
 
@@ -405,22 +530,38 @@ cTValue * LJ_FASTCALL lj_tab_getinth(GCtab *t, int32_t key)
 {
   TValue k;
   Node *n;
+#if LJ_SWISSTAB
+  HashProbe hp;
+  k.n = (lua_Number)key;
+  hashloop(t, hashnum(&k), n)
+    if (tvisnum(&n->key) && n->key.n == k.n)
+      return &n->val;
+#else
   k.n = (lua_Number)key;
   n = hashnum(t, &k);
   do {
     if (tvisnum(&n->key) && n->key.n == k.n)
       return &n->val;
   } while ((n = nextnode(n)));
+#endif
   return NULL;
 }
 
 cTValue *lj_tab_getstr(GCtab *t, GCstr *key)
 {
+#if LJ_SWISSTAB
+  HashProbe hp;
+  Node *n;
+  hashloop(t, key->hash, n)
+    if (tvisstr(&n->key) && strV(&n->key) == key)
+      return &n->val;
+#else
   Node *n = hashstr(t, key);
   do {
     if (tvisstr(&n->key) && strV(&n->key) == key)
       return &n->val;
   } while ((n = nextnode(n)));
+#endif
   return NULL;
 }
 
@@ -446,18 +587,49 @@ cTValue *lj_tab_get(lua_State *L, GCtab *t, cTValue *key)
     }
   } else if (!tvisnil(key)) {
     Node *n;
+#if LJ_SWISSTAB
+    HashProbe hp;
+  genlookup:
+    hashloop(t, hashkey(key), n)
+      if (lj_obj_equal(&n->key, key))
+	return &n->val;
+#else
   genlookup:
     n = hashkey(t, key);
     do {
       if (lj_obj_equal(&n->key, key))
 	return &n->val;
     } while ((n = nextnode(n)));
+#endif
   }
   return niltv(L);
 }
 
 /* -- Table setters ------------------------------------------------------- */
 
+#if LJ_SWISSTAB
+/* Insert new key into the first empty node after its main position. */
+TValue *lj_tab_newkey(lua_State *L, GCtab *t, cTValue *key)
+{
+  Node *node = noderef(t->node), *n;
+  uint32_t hmask = t->hmask, h, pos, m;
+  uint8_t *ctrl;
+  if (hmask == 0 || *hfreeref(node, hmask) == 0) {  /* No free node left? */
+    rehashtab(L, t, key);  /* Rehash table. */
+    return lj_tab_set(L, t, key);  /* Retry key insertion. */
+  }
+  h = hashkey(key);
+  ctrl = hctrl(node, hmask);
+  for (pos = h & hmask; ; pos = (pos + HCTRL_GROUP) & hmask) {
+    m = (uint32_t)_mm_movemask_epi8(
+      _mm_loadu_si128((const __m128i *)(ctrl + pos)));
+    if (m) break;
+  }
+  pos = (pos + lj_ffs(m)) & hmask;
+  hctrl_set(ctrl, hmask, pos, hctrl_h2(h));
+  (*hfreeref(node, hmask))--;
+  n = &node[pos];
+#else
 /* Insert new key. Use Brent's variation to optimize the chain length. */
 TValue *lj_tab_newkey(lua_State *L, GCtab *t, cTValue *key)
 {
@@ -466,6 +638,7 @@ TValue *lj_tab_newkey(lua_State *L, GCtab *t, cTValue *key)
     Node *nodebase = noderef(t->node);
     Node *collide, *freenode = getfreetop(t, nodebase);
     lua_assert(freenode >= nodebase && freenode <= nodebase+t->hmask+1);
+    lj_gc_barriermove(L, t);
     do {
       if (freenode == nodebase) {  /* No free node found? */
 	rehashtab(L, t, key);  /* Rehash table. */
@@ -503,6 +676,10 @@ TValue *lj_tab_newkey(lua_State *L, GCtab *t, cTValue *key)
       n = freenode;
     }
   }
+#endif
+#if LJ_TABSHAPE
+  setgcrefnull(t->shape);  /* Key layout has changed. */
+#endif
   n->key.u64 = key->u64;
   if (LJ_UNLIKELY(tvismzero(&n->key)))
     n->key.u64 = 0;
@@ -515,23 +692,39 @@ TValue *lj_tab_setinth(lua_State *L, GCtab *t, int32_t key)
 {
   TValue k;
   Node *n;
+#if LJ_SWISSTAB
+  HashProbe hp;
+  k.n = (lua_Number)key;
+  hashloop(t, hashnum(&k), n)
+    if (tvisnum(&n->key) && n->key.n == k.n)
+      return &n->val;
+#else
   k.n = (lua_Number)key;
   n = hashnum(t, &k);
   do {
     if (tvisnum(&n->key) && n->key.n == k.n)
       return &n->val;
   } while ((n = nextnode(n)));
+#endif
   return lj_tab_newkey(L, t, &k);
 }
 
 TValue *lj_tab_setstr(lua_State *L, GCtab *t, GCstr *key)
 {
   TValue k;
+#if LJ_SWISSTAB
+  HashProbe hp;
+  Node *n;
+  hashloop(t, key->hash, n)
+    if (tvisstr(&n->key) && strV(&n->key) == key)
+      return &n->val;
+#else
   Node *n = hashstr(t, key);
   do {
     if (tvisstr(&n->key) && strV(&n->key) == key)
       return &n->val;
   } while ((n = nextnode(n)));
+#endif
   setstrV(L, &k, key);
   return lj_tab_newkey(L, t, &k);
 }
@@ -539,6 +732,9 @@ TValue *lj_tab_setstr(lua_State *L, GCtab *t, GCstr *key)
 TValue *lj_tab_set(lua_State *L, GCtab *t, cTValue *key)
 {
   Node *n;
+#if LJ_SWISSTAB
+  HashProbe hp;
+#endif
   t->nomm = 0;  /* Invalidate negative metamethod cache. */
   if (tvisstr(key)) {
     return lj_tab_setstr(L, t, strV(key));
@@ -555,11 +751,17 @@ TValue *lj_tab_set(lua_State *L, GCtab *t, cTValue *key)
   } else if (tvisnil(key)) {
     lj_err_msg(L, LJ_ERR_NILIDX);
   }
+#if LJ_SWISSTAB
+  hashloop(t, hashkey(key), n)
+    if (lj_obj_equal(&n->key, key))
+      return &n->val;
+#else
   n = hashkey(t, key);
   do {
     if (lj_obj_equal(&n->key, key))
       return &n->val;
   } while ((n = nextnode(n)));
+#endif
   return lj_tab_newkey(L, t, key);
 }
 
@@ -582,13 +784,21 @@ static uint32_t keyindex(lua_State *L, GCtab *t, cTValue *key)
       return (uint32_t)k;  /* Array key indexes: [0..t->asize-1] */
   }
   if (!tvisnil(key)) {
+#if LJ_SWISSTAB
+    HashProbe hp;
+    Node *n;
+    hashloop(t, hashkey(key), n)
+      if (lj_obj_equal(&n->key, key))
+	return t->asize + (uint32_t)(n - noderef(t->node));
+#else
     Node *n = hashkey(t, key);
     do {
       if (lj_obj_equal(&n->key, key))
 	return t->asize + (uint32_t)(n - noderef(t->node));
 	/* Hash key indexes: [t->asize..t->asize+t->nmask] */
     } while ((n = nextnode(n)));
-    if (key->u32.hi == 0xfffe7fff)  /* ITERN was despecialized while running. */
+#endif
+    if (key->u32.hi == LJ_KEYINDEX)  /* ITERN despecialized while running. */
       return key->u32.lo - 1;
     lj_err_msg(L, LJ_ERR_NEXTIDX);
     return 0;  /* unreachable */
@@ -596,25 +806,37 @@ static uint32_t keyindex(lua_State *L, GCtab *t, cTValue *key)
   return ~0u;  /* A nil key starts the traversal. */
 }
 
+/* Find the next non-nil slot of a table traversal, starting at index i.
+** Array slots [0..t->asize-1] come first, followed by the hash slots.
+** Returns the index of the slot or -1 at the end of the traversal.
+*/
+int32_t LJ_FASTCALL lj_tab_nexti(GCtab *t, uint32_t i)
+{
+  for (; i < t->asize; i++)  /* First traverse the array keys. */
+    if (!tvisnil(arrayslot(t, i)))
+      return (int32_t)i;
+  for (i -= t->asize; i <= t->hmask; i++)  /* Then traverse the hash keys. */
+    if (!tvisnil(&noderef(t->node)[i].val))
+      return (int32_t)(t->asize + i);
+  return -1;
+}
+
 /* Advance to the next step in a table traversal. */
 int lj_tab_next(lua_State *L, GCtab *t, TValue *key)
 {
   uint32_t i = keyindex(L, t, key);  /* Find predecessor key index. */
-  for (i++; i < t->asize; i++)  /* First traverse the array keys. */
-    if (!tvisnil(arrayslot(t, i))) {
-      setintV(key, i);
-      copyTV(L, key+1, arrayslot(t, i));
-      return 1;
-    }
-  for (i -= t->asize; i <= t->hmask; i++) {  /* Then traverse the hash keys. */
-    Node *n = &noderef(t->node)[i];
-    if (!tvisnil(&n->val)) {
-      copyTV(L, key, &n->key);
-      copyTV(L, key+1, &n->val);
-      return 1;
-    }
+  int32_t n = lj_tab_nexti(t, i+1);
+  if (n < 0)
+    return 0;  /* End of traversal. */
+  if ((uint32_t)n < t->asize) {
+    setintV(key, n);
+    copyTV(L, key+1, arrayslot(t, n));
+  } else {
+    Node *node = &noderef(t->node)[n - t->asize];
+    copyTV(L, key, &node->key);
+    copyTV(L, key+1, &node->val);
   }
-  return 0;  /* End of traversal. */
+  return 1;
 }
 
 /* -- Table length calculation -------------------------------------------- */
@@ -8,6 +8,10 @@
 
 #include "lj_obj.h"
 
+#if LJ_SWISSTAB
+#include <emmintrin.h>
+#endif
+
 /* Hash constants. Tuned using a brute force search. */
 #define HASH_BIAS	(-0x04c11db7)
 #define HASH_ROT1	14
@@ -31,7 +35,40 @@ static LJ_AINLINE uint32_t hashrot(uint32_t lo, uint32_t hi)
   return hi;
 }
 
+#if LJ_SWISSTAB
+/*
+** The hash part is an open-addressing table. The nodes are followed by one
+** control byte per node, a copy of the first 15 control bytes (so any
+** group of 16 can be loaded at once) and the number of free nodes left.
+** A control byte is either empty or holds the top 7 bits of the hash.
+** Keys are never deleted, except by a rehash. So a lookup may stop at the
+** first group with an empty node.
+*/
+#define HCTRL_EMPTY	0x80
+#define HCTRL_GROUP	16
+#define hctrl_h2(h)	((uint8_t)((h) >> 25))
+#define hctrl(n, hmask)	((uint8_t *)((n) + (hmask) + 1))
+#define hfreeref(n, hmask) \
+  ((uint32_t *)(hctrl((n), (hmask)) + (((hmask) + 20) & ~3u)))
+#define sizehpart(hmask) \
+  (((hmask)+1)*sizeof(Node) + (((hmask) + 20) & ~3u) + 4)
+/* Keep at least 1/8 of the nodes empty to bound the probe length. */
+#define hfreemax(hmask)	((hmask) - ((hmask) >> 3))
+#define hsize2hbits_(s)	((s) ? ((s)==1 ? 1 : 1+lj_fls((uint32_t)((s)-1))) : 0)
+#define hsize2hbits(s)	hsize2hbits_((s) + ((s)+6)/7)
+
+/* Get the mask of used nodes in the group starting at node i. */
+static LJ_AINLINE uint32_t hctrl_used(const Node *node, uint32_t hmask,
+				      uint32_t i)
+{
+  __m128i g = _mm_loadu_si128((const __m128i *)(hctrl(node, hmask) + i));
+  uint32_t m = ~(uint32_t)_mm_movemask_epi8(g) & 0xffffu;
+  return hmask < HCTRL_GROUP-1 ? m & ((2u << hmask) - 1) : m;
+}
+#else
+#define sizehpart(hmask)	(((hmask)+1)*sizeof(Node))
 #define hsize2hbits(s)	((s) ? ((s)==1 ? 1 : 1+lj_fls((uint32_t)((s)-1))) : 0)
+#endif
 
 LJ_FUNCA GCtab *lj_tab_new(lua_State *L, uint32_t asize, uint32_t hbits);
 LJ_FUNC GCtab *lj_tab_new_ah(lua_State *L, int32_t a, int32_t h);
@@ -62,12 +99,20 @@ LJ_FUNC TValue *lj_tab_set(lua_State *L, GCtab *t, cTValue *key);
 
 #define inarray(t, key)		((MSize)(key) < (MSize)(t)->asize)
 #define arrayslot(t, i)		(&tvref((t)->array)[(i)])
+/* Writes to the array part may store anything, so drop the numeric flag. */
+#if LJ_NUMARRAY
+#define clearnumarr(t)		((t)->numarr = 0)
+#else
+#define clearnumarr(t)		UNUSED(t)
+#endif
 #define lj_tab_getint(t, key) \
   (inarray((t), (key)) ? arrayslot((t), (key)) : lj_tab_getinth((t), (key)))
 #define lj_tab_setint(L, t, key) \
-  (inarray((t), (key)) ? arrayslot((t), (key)) : lj_tab_setinth(L, (t), (key)))
+  (inarray((t), (key)) ? (clearnumarr((t)), arrayslot((t), (key))) : \
+			 lj_tab_setinth(L, (t), (key)))
 
 LJ_FUNCA int lj_tab_next(lua_State *L, GCtab *t, TValue *key);
+LJ_FUNC int32_t LJ_FASTCALL lj_tab_nexti(GCtab *t, uint32_t i);
 LJ_FUNCA MSize LJ_FASTCALL lj_tab_len(GCtab *t);
 
 #endif
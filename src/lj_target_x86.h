@@ -280,6 +280,9 @@ typedef enum {
   XO_MOVSXd =	XO_(63),
   XO_BSWAP =	XO_0f(c8),
   XO_CMOV =	XO_0f(40),
+  XO_BSF =	XO_0f(bc),
+  XO_BTR =	XO_0f(b3),
+  XO_PREFETCH =	XO_0f(18), XOg_PREFETCHT0 = 1,
 
   XO_MOVSD =	XO_f20f(10),
   XO_MOVSDto =	XO_f20f(11),
@@ -307,6 +310,10 @@ typedef enum {
   XO_ADDSS =	XO_f30f(58),
   XO_MOVD =	XO_660f(6e),
   XO_MOVDto =	XO_660f(7e),
+  XO_MOVDQU =	XO_f30f(6f),
+  XO_PCMPEQB =	XO_660f(74),
+  XO_PMOVMSKB =	XO_660f(d7),
+  XO_PSHUFD =	XO_660f(70),
 
   XO_FLDd =	XO_(d9), XOg_FLDd = 0,
   XO_FLDq =	XO_(dd), XOg_FLDq = 0,
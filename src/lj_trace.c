@@ -14,6 +14,7 @@
 #include "lj_err.h"
 #include "lj_debug.h"
 #include "lj_str.h"
+#include "lj_tab.h"
 #include "lj_frame.h"
 #include "lj_state.h"
 #include "lj_bc.h"
@@ -213,7 +214,8 @@ static void trace_unpatch(jit_State *J, GCtrace *T)
     break;
   case BC_JITERL:
   case BC_JLOOP:
-    lua_assert(op == BC_ITERL || op == BC_LOOP || bc_isret(op));
+    lua_assert(op == BC_ITERL || op == BC_ITERN || op == BC_LOOP ||
+	       bc_isret(op));
     *pc = T->startins;
     break;
   case BC_JMP:
@@ -361,8 +363,14 @@ void lj_trace_freestate(global_State *g)
 /* Blacklist a bytecode instruction. */
 static void blacklist_pc(GCproto *pt, BCIns *pc)
 {
-  setbc_op(pc, (int)bc_op(*pc)+(int)BC_ILOOP-(int)BC_LOOP);
-  pt->flags |= PROTO_ILOOP;
+  if (bc_op(*pc) == BC_ITERN) {
+    /* There's no IITERN. Despecialize the loop to the ITERC/JMP pair. */
+    setbc_op(pc, BC_ITERC);
+    setbc_op(pc+1+bc_j(pc[1]), BC_JMP);
+  } else {
+    setbc_op(pc, (int)bc_op(*pc)+(int)BC_ILOOP-(int)BC_LOOP);
+    pt->flags |= PROTO_ILOOP;
+  }
 }
 
 /* Penalize a bytecode instruction. */
@@ -402,9 +410,9 @@ static void trace_start(jit_State *J)
     if (J->parent == 0 && J->exitno == 0) {
       /* Lazy bytecode patching to disable hotcount events. */
       lua_assert(bc_op(*J->pc) == BC_FORL || bc_op(*J->pc) == BC_ITERL ||
-		 bc_op(*J->pc) == BC_LOOP || bc_op(*J->pc) == BC_FUNCF);
-      setbc_op(J->pc, (int)bc_op(*J->pc)+(int)BC_ILOOP-(int)BC_LOOP);
-      J->pt->flags |= PROTO_ILOOP;
+		 bc_op(*J->pc) == BC_ITERN || bc_op(*J->pc) == BC_LOOP ||
+		 bc_op(*J->pc) == BC_FUNCF);
+      blacklist_pc(J->pt, (BCIns *)J->pc);
     }
     J->state = LJ_TRACE_IDLE;  /* Silently ignored. */
     return;
@@ -476,6 +484,9 @@ static void trace_stop(jit_State *J)
     J->cur.nextroot = pt->trace;
     pt->trace = (TraceNo1)traceno;
     break;
+  case BC_ITERN:
+    *pc = BCINS_AD(BC_JLOOP, bc_a(J->cur.startins), traceno);
+    goto addroot;
   case BC_RET:
   case BC_RET0:
   case BC_RET1:
@@ -814,6 +825,29 @@ static TraceNo trace_exit_find(jit_State *J, MCode *pc)
 }
 #endif
 
+/* Perform the ITERN step a root trace was started at.
+** Returning to the JLOOP would just re-enter the trace and take the same exit.
+*/
+static const BCIns *trace_exit_itern(lua_State *L, const BCIns *pc,
+				     BCIns ins)
+{
+  TValue *o = L->base + bc_a(ins);
+  GCtab *t = tabV(o-2);
+  int32_t n = lj_tab_nexti(t, (o-1)->u32.lo);
+  if (n < 0)
+    return pc+2;  /* End of traversal. Continue after ITERL. */
+  if ((uint32_t)n < t->asize) {
+    setintV(o, n);
+    copyTV(L, o+1, arrayslot(t, n));
+  } else {
+    Node *node = &noderef(t->node)[n - t->asize];
+    copyTV(L, o, &node->key);
+    copyTV(L, o+1, &node->val);
+  }
+  (o-1)->u32.lo = (uint32_t)n+1;  /* Update control var. */
+  return pc+2+bc_j(pc[1]);  /* Jump to target of ITERL. */
+}
+
 /* A trace exited. Restore interpreter state. */
 int LJ_FASTCALL lj_trace_exit(jit_State *J, void *exptr)
 {
@@ -865,12 +899,15 @@ int LJ_FASTCALL lj_trace_exit(jit_State *J, void *exptr)
   }
   if (bc_op(*pc) == BC_JLOOP) {
     BCIns *retpc = &traceref(J, bc_d(*pc))->startins;
-    if (bc_isret(bc_op(*retpc))) {
+    if (bc_isret(bc_op(*retpc)) || bc_op(*retpc) == BC_ITERN) {
       if (J->state == LJ_TRACE_RECORD) {
 	J->patchins = *pc;
 	J->patchpc = (BCIns *)pc;
 	*J->patchpc = *retpc;
 	J->bcskip = 1;
+      } else if (bc_op(*retpc) == BC_ITERN) {
+	pc = trace_exit_itern(L, pc, *retpc);
+	setcframe_pc(cf, pc);
       } else {
 	pc = retpc;
 	setcframe_pc(cf, pc);
@@ -881,7 +918,7 @@ int LJ_FASTCALL lj_trace_exit(jit_State *J, void *exptr)
   ERRNO_RESTORE
   switch (bc_op(*pc)) {
   case BC_CALLM: case BC_CALLMT:
-    return (int)((BCReg)(L->top - L->base) - bc_a(*pc) - bc_c(*pc) + LJ_FR2);
+    return (int)((BCReg)(L->top - L->base) - bc_a(*pc) - bc_c(*pc) - LJ_FR2);
   case BC_RETM:
     return (int)((BCReg)(L->top - L->base) + 1 - bc_a(*pc) - bc_d(*pc));
   case BC_TSETM:
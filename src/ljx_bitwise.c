@@ -1,27 +1,65 @@
+/*
+** LJX: Lua 5.3 integer division and bitwise operators.
+**
+** A TValue has no room for an unboxed 64 bit integer. Integers are kept as
+** plain numbers as long as they are exactly representable (|i| <= 2^53) and
+** only spill over to int64 cdata beyond that. A cdata operand turns the
+** operation into 64 bit FFI arithmetic with a cdata result of the same rank.
+*/
+
+#define ljx_bitwise_c
+#define LUA_CORE
+
 #include "lj_obj.h"
+
+#if LJ_53
+
+#include "lj_err.h"
+#include "lj_state.h"
 #include "lj_strscan.h"
 #if LJ_HASFFI
 #include "lj_ctype.h"
 #include "lj_cdata.h"
 #include "lj_cconv.h"
+#include "lj_carith.h"
+#include "lualib.h"
 #endif
-#include "ljx_bitwise.h"
-#include "lj_crecord.h"
-#include "lj_dispatch.h"
+#if LJ_HASJIT
+#include "lj_ir.h"
+#include "lj_jit.h"
+#include "lj_ircall.h"
 #include "lj_iropt.h"
+#include "lj_trace.h"
+#if LJ_HASFFI
+#include "lj_crecord.h"
+#endif
+#endif
+#include "ljx_bitwise.h"
 
-#if LJ_53
-/* Decode arguments for interpreter dispatch */
-static int get_arg(lua_State *L, cTValue *o, int64_t *res)
+/* -- Integer conversions ------------------------------------------------- */
+
+/* Convert a number to an integer. Fails for fractional or huge numbers. */
+static int bit_num2int(lua_Number n, int64_t *res)
+{
+  if (n >= -9223372036854775808.0 && n < 9223372036854775808.0) {
+    int64_t i = (int64_t)n;
+    if ((lua_Number)i == n) {
+      *res = i;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Decode an operand. Returns -1 on failure, else 0 or the cdata type ID. */
+static int bit_arg(lua_State *L, cTValue *o, int64_t *res)
 {
   TValue tmp;
 #if LJ_HASFFI
-  CTypeID id = 0;
-  *res = 0;
   if (tviscdata(o)) {
     CTState *cts = ctype_cts(L);
     uint8_t *sp = (uint8_t *)cdataptr(cdataV(o));
-    CTypeID sid = cdataV(o)->ctypeid;
+    CTypeID sid = cdataV(o)->ctypeid, id;
     CType *s = ctype_get(cts, sid);
     if (ctype_isref(s->info)) {
       sp = *(void **)sp;
@@ -30,150 +68,312 @@ static int get_arg(lua_State *L, cTValue *o, int64_t *res)
     s = ctype_raw(cts, sid);
     if (ctype_isenum(s->info)) s = ctype_child(cts, s);
     if ((s->info & (CTMASK_NUM|CTF_BOOL|CTF_FP|CTF_UNSIGNED)) ==
-        CTINFO(CT_NUM, CTF_UNSIGNED) && s->size == 8)
+	CTINFO(CT_NUM, CTF_UNSIGNED) && s->size == 8)
       id = CTID_UINT64;  /* Use uint64_t, since it has the highest rank. */
     else
       id = CTID_INT64;  /* Use int64_t, unless already set. */
     if (lj_cconv_ct_ct(cts, ctype_get(cts, id), s,
-		   (uint8_t *)res, sp, CCF_NOERROR) < 0)
+		       (uint8_t *)res, sp, CCF_NOERROR) < 0)
       return -1;
-    return id;
-  } else
+    return (int)id;
+  }
+#else
+  UNUSED(L);
 #endif
   if (tvisstr(o)) {
     if (!lj_strscan_number(strV(o), &tmp))
       return -1;
     o = &tmp;
   }
-  if (LJ_LIKELY(tvisint(o))) {
-    *res = (uint32_t)intV(o);
-    return 0;
-  } 
-  if (LJ_LIKELY(tvisnumber(o))) {
-    *res = (uint32_t)lj_num2bit(numV(o));
+  if (tvisint(o)) {
+    *res = intV(o);
     return 0;
   }
+  if (tvisnum(o) && bit_num2int(numV(o), res))
+    return 0;
   return -1;
 }
 
-#define B_METHODS(_) \
-_(bnot,=~x) _(idiv, /=y) _(band, &=y) _(bor, |=y) \
-_(bxor, ^=y) _(shl, <<=y) _(shr, >>=y)
-#define CASE(name, suff) \
-  case MM_##name: x suff; break;
+/* Convert a value to a 64 bit integer. Used by the C API. */
+int ljx_toint64(lua_State *L, cTValue *o, int64_t *res)
+{
+  return bit_arg(L, o, res) >= 0;
+}
 
-int ljx_vm_foldbit(lua_State *L, TValue *ra, cTValue *rb, cTValue *rc,
-		      MMS mm)
-{
-  int id1, id2;
-  int64_t a,b;
-
-  if (((id1 = get_arg(L, rb, &a)) == -1) || ((id2 = get_arg(L, rc, &b)) == -1))
-    return -1; /* call metamethod */
-  /* expand to common type, with the exception of shifts */
-  if (mm < MM_shl && id2 > id1)
-    id1 = id2;
-  /* int32 */
-  if (!id1) {
-    uint32_t x = a;
-    uint32_t y = b;
-    switch (mm) {
-      B_METHODS(CASE)
-      default: return -1;
-    }
-    setintV(ra, x);
+#if LJ_HASFFI
+/* Store a 64 bit integer cdata. The slot must be on the Lua stack. */
+static void bit_setcdata(lua_State *L, TValue *o, CTypeID id, uint64_t x)
+{
+  GCcdata *cd;
+  if (!ctype_ctsG(G(L))) {
+    ptrdiff_t oldtop = savestack(L, L->top), ofs = savestack(L, o);
+    luaopen_ffi(L);  /* Load FFI library on-demand. */
+    L->top = restorestack(L, oldtop);
+    o = restorestack(L, ofs);
   }
+  cd = lj_cdata_new_(L, id, 8);
+  *(uint64_t *)cdataptr(cd) = x;
+  setcdataV(L, o, cd);
+}
+#endif
+
+/* Store an integer result. The slot must be on the Lua stack. */
+void ljx_setint64(lua_State *L, TValue *o, int64_t i)
+{
 #if LJ_HASFFI
-  else {
-    uint64_t x = a;
-    uint64_t y = b;
-    GCcdata *cd;
-    switch (mm) {
-      B_METHODS(CASE)
-      default: return -1;
-    }
-    cd = lj_cdata_new_(L, id1, 8);
-    *(uint64_t *)cdataptr(cd) = x;
-    setcdataV(L, ra, cd);
+  if (!ljx_isint53(i)) {
+    bit_setcdata(L, o, CTID_INT64, (uint64_t)i);
+    return;
   }
+#else
+  UNUSED(L);
 #endif
-  return id1;
+  setint64V(o, i);
+}
+
+/* -- Integer arithmetic -------------------------------------------------- */
+
+/* Logical shift left. Negative counts shift right, 64 or more give zero. */
+static uint64_t bit_shl(uint64_t x, int64_t n)
+{
+  if (n < 0)
+    return n <= -64 ? 0 : x >> (int)-n;
+  return n >= 64 ? 0 : x << (int)n;
+}
+
+/* Logical shift right. Negative counts shift left, 64 or more give zero. */
+static uint64_t bit_shr(uint64_t x, int64_t n)
+{
+  if (n < 0)
+    return n <= -64 ? 0 : x << (int)-n;
+  return n >= 64 ? 0 : x >> (int)n;
+}
+
+/* Perform an integer op. The divisor for IDIV must not be zero. */
+static uint64_t bit_arith(uint64_t x, uint64_t y, MMS mm, int id)
+{
+  switch (mm) {
+  case MM_bnot: return ~x;
+  case MM_band: return x & y;
+  case MM_bor: return x | y;
+  case MM_bxor: return x ^ y;
+  case MM_shl: return bit_shl(x, (int64_t)y);
+  case MM_shr: return bit_shr(x, (int64_t)y);
+#if LJ_HASFFI
+  case MM_idiv:
+    if (id == CTID_UINT64)
+      return lj_carith_divu64(x, y);
+    return (uint64_t)lj_carith_idivi64((int64_t)x, (int64_t)y);
+#endif
+  default: UNUSED(id); lua_assert(0); return 0;
+  }
 }
 
+/* Resulting type of an op: 0 for plain integers or the cdata type ID. */
+static LJ_AINLINE int bit_restype(MMS mm, int id1, int id2)
+{
+  /* The count of a shift never widens the result. */
+  return (mm >= MM_shl || id1 >= id2) ? id1 : id2;
+}
+
+/* Integer division and bitwise ops for the interpreter. Integer division of
+** plain numbers is handled by lj_meta_arith. Returns -1 for a metamethod.
+*/
+int ljx_vm_foldbit(lua_State *L, TValue *ra, cTValue *rb, cTValue *rc,
+		   MMS mm)
+{
+  int id1, id2, id;
+  int64_t a, b = 0;
+  uint64_t x;
+  if ((id1 = bit_arg(L, rb, &a)) < 0 || (id2 = bit_arg(L, rc, &b)) < 0)
+    return -1;
+  id = bit_restype(mm, id1, id2);
+  lua_assert(mm != MM_idiv || id);
+  if (mm == MM_idiv && b == 0)
+    lj_err_msg(L, LJ_ERR_IDIVZERO);
+  x = bit_arith((uint64_t)a, (uint64_t)b, mm, id);
+#if LJ_HASFFI
+  if (id) {
+    bit_setcdata(L, ra, (CTypeID)id, x);
+    return id;
+  }
+#endif
+  ljx_setint64(L, ra, (int64_t)x);
+  return 0;
+}
+
+/* -- Recording ----------------------------------------------------------- */
+
+#if LJ_HASJIT
+
 #define emitir(ot, a, b)	(lj_ir_set(J, (ot), (a), (b)), lj_opt_fold(J))
 #define emitconv(a, dt, st, flags) \
   emitir(IRT(IR_CONV, (dt)), (a), (st)|((dt) << 5)|(flags))
 
-/* Same as lj_opt_narrow_tobit, but does not raise trace error. */
-static TRef bit_narrow_int(jit_State *J, TRef r)
+/* Convert a plain operand to a 64 bit integer. Guards for integerness. */
+static TRef bit_rec_int64(jit_State *J, TRef tr)
 {
-  if (tref_isstr(r))
-    r = emitir(IRTG(IR_STRTO, IRT_NUM), r, 0);
-  if (tref_isnum(r))  /* Conversion may be narrowed, too. See above. */
-    return emitir(IRTI(IR_TOBIT), r, lj_ir_knum_tobit(J));
-  if (!tref_isinteger(r))
-    return 0;
-  return lj_opt_narrow_stripov(J, r, IR_SUBOV, (IRT_INT<<5)|IRT_INT|IRCONV_TOBIT);
+  if (tref_isstr(tr))
+    tr = emitir(IRTG(IR_STRTO, IRT_NUM), tr, 0);
+  if (tref_isinteger(tr))
+    return emitconv(tr, IRT_I64, IRT_INT, IRCONV_SEXT);
+  if (tref_isnum(tr)) {
+    IROp op = (IROp)J->cur.ir[tref_ref(tr)].o;
+    TRef tri;
+    lj_ir_set(J, IRT(IR_CONV, IRT_I64), tr,
+	      IRT_NUM|(IRT_I64<<5)|IRCONV_ANY);
+    /* Don't narrow across FP ADD/SUB. It would ignore their rounding. */
+    tri = (op == IR_ADD || op == IR_SUB) ? lj_ir_emit(J) : lj_opt_fold(J);
+    emitir(IRTG(IR_EQ, IRT_NUM), emitconv(tri, IRT_NUM, IRT_I64, 0), tr);
+    return tri;
+  }
+  return 0;
 }
 
-/* Narrow to specified type. */
-static TRef bit_narrow_id(jit_State *J, CTypeID wantid, TRef tr, cTValue *o)
+/* Convert an operand to a 64 bit integer of the given type. */
+static TRef bit_rec_arg(jit_State *J, int id, TRef tr, cTValue *o)
 {
-  CTState *cts = ctype_ctsG(J2G(J));
-  if (!wantid)
-    return bit_narrow_int(J, tr);
-#if LJ_HASJIT && LJ_HASFFI
-  return lj_crec_ct_tv(J, ctype_get(cts, wantid), 0, tr, o);
+#if LJ_HASFFI
+  if (tviscdata(o)) {
+    CTState *cts = ctype_ctsG(J2G(J));
+    return lj_crec_ct_tv(J, ctype_get(cts, id ? id : CTID_INT64), 0, tr,
+			 (TValue *)o);
+  }
 #else
-  return 0;
+  UNUSED(id); UNUSED(o);
 #endif
+  return bit_rec_int64(J, tr);
 }
 
-/* Record. */
-TRef ljx_rec_bitwise(jit_State *J, TRef rb, TRef rc, cTValue *rbv, cTValue *rcv, MMS mm)
+/* Check whether an I64 ref lies within [-bias, lim-bias]. Guards for it. */
+static int bit_rec_inrange(jit_State *J, TRef tr, int64_t i,
+			   uint64_t bias, uint64_t lim)
 {
-  CTState *cts = ctype_ctsG(J2G(J));
-  TRef r1, r2 = 0;
-  CTypeID id1 = 0, id2 = 0;
-#if LJ_HASJIT && LJ_HASFFI
-  id1 = lj_crec_bit64_type(cts, rbv);
-  id2 = lj_crec_bit64_type(cts, rcv);
-#endif
-  /* For shifts, the shift arg might stay as int */
-  if (mm >= MM_shl) {
-    if (id2) {
-      r2 = bit_narrow_id(J, CTID_INT64, rc, rcv);
-      if (!tref_isinteger(r2))
-        r2 = emitconv(r2, IRT_INT, tref_type(r2), 0);
-    } else {
-      r2 = bit_narrow_int(J, rc);
-      if (!r2) return 0; /* Not even int? Bail. */
+  int in = (uint64_t)i + bias <= lim;
+  TRef tmp = emitir(IRT(IR_ADD, IRT_U64), tr, lj_ir_kint64(J, bias));
+  emitir(IRTG(in ? IR_ULE : IR_UGT, IRT_U64), tmp, lj_ir_kint64(J, lim));
+  return in;
+}
+
+/* Check whether an I64 ref is known to be exactly representable. */
+static int bit_rec_isint53(jit_State *J, TRef tr)
+{
+  IRIns *ir = &J->cur.ir[tref_ref(tr)], *irk;
+  if (ir->o == IR_KINT64)
+    return ljx_isint53(ir_k64(ir)->u64);
+  if (!(ir->o == IR_BAND || ir->o == IR_BSHR) || !irref_isk(ir->op2))
+    return 0;
+  irk = &J->cur.ir[ir->op2];
+  if (ir->o == IR_BAND)  /* i & k, 0 <= k <= 2^53 */
+    return ir_k64(irk)->u64 <= U64x(00200000,00000000);
+  else  /* i >>> k, k >= 11 */
+    return (irk->i & 63) >= 11;
+}
+
+/* Record a shift. Specialized to the runtime range of the shift count. */
+static TRef bit_rec_shift(jit_State *J, IRType t, IROp op, TRef r1, TRef r2,
+			  int64_t n)
+{
+  if ((uint64_t)n < 64) {
+    emitir(IRTG(IR_ULT, IRT_U64), r2, lj_ir_kint64(J, 64));
+    r2 = emitconv(r2, IRT_INT, IRT_I64, 0);
+  } else {
+    TRef tmp = emitir(IRT(IR_ADD, IRT_U64), r2, lj_ir_kint64(J, 63));
+    if ((uint64_t)n + 63 > 126) {  /* |n| >= 64 always gives zero. */
+      emitir(IRTG(IR_UGT, IRT_U64), tmp, lj_ir_kint64(J, 126));
+      return lj_ir_kint64(J, 0);
     }
-    id2 = 0; /* The arg is never widest */
-  }
-  if (id2 > id1) /* Determine widest type */
-    id1 = id2;
-  r1 = bit_narrow_id(J, id1, rb, rbv); /* And resolve those */
-  if (!r1) return 0;
-
-  if (!r2 && mm != MM_bnot) { /* Only if not shift or unary */
-    r2 = bit_narrow_id(J, id1, rc, rcv);
-    if (!r2) return 0;
+    /* -64 < n < 0 shifts into the other direction. */
+    emitir(IRTG(IR_ULT, IRT_U64), tmp, lj_ir_kint64(J, 63));
+    r2 = emitir(IRTI(IR_SUB), lj_ir_kint(J, 0),
+		emitconv(r2, IRT_INT, IRT_I64, 0));
+    op = op == IR_BSHL ? IR_BSHR : IR_BSHL;
   }
+  return emitir(IRT(op, t), r1, r2);
+}
 
-  /* All set now. id1 holds the output type (or 0 if INT). */
-  uint32_t irop = IR_BNOT + mm - MM_bnot;
-  if (mm == MM_idiv)
-    irop = IR_DIV;
-  /* Type-specific and boxed? */
-#if LJ_HASJIT && LJ_HASFFI
-  if (id1) {
-    TRef tr = emitir(IRT(irop, id1-CTID_INT64+IRT_I64), r1, r2);
-    return emitir(IRTG(IR_CNEWI, IRT_CDATA), lj_ir_kint(J, id1), tr);
+/* Record integer division and bitwise ops. Returns 0 if not applicable. */
+TRef ljx_rec_bitwise(jit_State *J, TRef rb, TRef rc, TValue *rbv, TValue *rcv,
+		     MMS mm)
+{
+  lua_State *L = J->L;
+  int id1, id2, id;
+  int64_t a, b = 0;
+  uint64_t x;
+  IRType t;
+  TRef r1, r2 = 0, tr;
+  if (mm == MM_idiv && !tviscdata(rbv) && !tviscdata(rcv)) {
+    if (!(tref_isnumber_str(rb) && tref_isnumber_str(rc)))
+      return 0;
+    return lj_opt_narrow_idiv(J, rb, rc, rbv, rcv);
+  }
+  if (!(LJ_64 || LJ_HASFFI) ||
+      (id1 = bit_arg(L, rbv, &a)) < 0 || (id2 = bit_arg(L, rcv, &b)) < 0)
+    return 0;
+  id = bit_restype(mm, id1, id2);
+  lj_needsplit(J);
+  r1 = bit_rec_arg(J, id, rb, rbv);
+  if (mm != MM_bnot)
+    r2 = bit_rec_arg(J, mm >= MM_shl ? 0 : id, rc, rcv);
+  if (!r1 || (mm != MM_bnot && !r2))
+    return 0;
+  t = id == CTID_UINT64 ? IRT_U64 : IRT_I64;
+  x = bit_arith((uint64_t)a, (uint64_t)b, mm, id);
+  switch (mm) {
+  case MM_bnot:
+    tr = emitir(IRT(IR_BNOT, t), r1, 0);
+    break;
+  case MM_band: case MM_bor: case MM_bxor:
+    tr = emitir(IRT((int)mm - (int)MM_band + (int)IR_BAND, t), r1, r2);
+    break;
+  case MM_shl: case MM_shr:
+    tr = bit_rec_shift(J, t, mm == MM_shl ? IR_BSHL : IR_BSHR, r1, r2, b);
+    break;
+#if LJ_HASFFI
+  case MM_idiv:
+    if (b == 0) {  /* Leave the error to the interpreter. */
+      setintV(&J->errinfo, BC_IDIV);
+      lj_trace_err_info(J, LJ_TRERR_NYIBC);
+    }
+    if (tref_isk(r2) && b > 0 && (b & (b-1)) == 0) {  /* i // 2^k ==> i >> k */
+      int32_t sh = (uint32_t)b ? (int32_t)lj_ffs((uint32_t)b) :
+				 32 + (int32_t)lj_ffs((uint32_t)(b >> 32));
+      tr = emitir(IRT(t == IRT_U64 ? IR_BSHR : IR_BSAR, t), r1,
+		  lj_ir_kint(J, sh));
+      break;
+    }
+    emitir(IRTG(IR_NE, t), r2, lj_ir_kint64(J, 0));
+    if (t == IRT_U64)
+      tr = emitir(IRT(IR_DIV, IRT_U64), r1, r2);
+    else
+      tr = lj_ir_call(J, IRCALL_lj_carith_idivi64, r1, r2);
+    break;
+#endif
+  default:
+    return 0;
   }
+#if LJ_HASFFI
+  if (id)
+    return emitir(IRTG(IR_CNEWI, IRT_CDATA), lj_ir_kint(J, id), tr);
+#endif
+  /* Specialize a plain result to a number or int64 cdata. A number is
+  ** marked as an exact conversion, so the next bitwise op folds it back
+  ** to the unboxed int64 and a chain of ops never leaves the registers.
+  */
+  if (bit_rec_isint53(J, tr) ||
+      bit_rec_inrange(J, tr, (int64_t)x, U64x(00200000,00000000),
+		      U64x(00400000,00000000)))
+    return emitconv(tr, IRT_NUM, IRT_I64, IRCONV_CHECK);
+#if LJ_HASFFI
+  return emitir(IRTG(IR_CNEWI, IRT_CDATA), lj_ir_kint(J, CTID_INT64), tr);
+#else
+  return 0;
 #endif
-  /* Otherwise plain I32 */
-  return emitir(IRTI(irop), r1, r2);
 }
 
+#undef emitir
+#undef emitconv
+
+#endif
+
 #endif
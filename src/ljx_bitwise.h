@@ -4,11 +4,20 @@
 #include "lj_obj.h"
 #include "lj_ir.h"
 #include "lj_jit.h"
-LJ_FUNC TRef ljx_rec_bitwise(jit_State *J, TRef rb, TRef rc, cTValue *rbv,
-                      cTValue *rcv, MMS mm);
-LJ_FUNC int ljx_vm_foldbit(lua_State *L, TValue *ra, cTValue *rb, cTValue *rc,
-		      MMS mm);
 
-#endif
+#if LJ_53
+/* Integers in this range are exactly representable as numbers. */
+#define ljx_isint53(i) \
+  ((uint64_t)(i) + U64x(00200000,00000000) <= U64x(00400000,00000000))
 
+LJ_FUNC int ljx_toint64(lua_State *L, cTValue *o, int64_t *res);
+LJ_FUNC void ljx_setint64(lua_State *L, TValue *o, int64_t i);
+LJ_FUNC int ljx_vm_foldbit(lua_State *L, TValue *ra, cTValue *rb, cTValue *rc,
+			   MMS mm);
+#if LJ_HASJIT
+LJ_FUNC TRef ljx_rec_bitwise(jit_State *J, TRef rb, TRef rc, TValue *rbv,
+			     TValue *rcv, MMS mm);
+#endif
+#endif
 
+#endif
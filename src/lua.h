@@ -361,6 +361,8 @@ LUA_API int  (lua_status) (lua_State *L);
 #define LUA_GCISRUNNING         9
 #define LUA_GCGEN               10
 #define LUA_GCINC               11
+#define LUA_GCSTEPUSEC          12
+#define LUA_GCMAXPAUSE          13
 
 LUA_API int (lua_gc) (lua_State *L, int what, int data);
 
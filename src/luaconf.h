@@ -112,6 +112,8 @@
 #define LUAI_MAXCFRAME (1*1024*1024) /* Max C stack, between 0.5-8MB. */
 #define LUAI_GCPAUSE	200	/* Pause GC until memory is at 200%. */
 #define LUAI_GCMUL	200	/* Run GC at 200% of allocation speed. */
+#define LUAI_GCMAJOR	200	/* Major GC when the old heap is at 200%. */
+#define LUAI_GCMINOR	20	/* Minor GC after allocating 20% of the heap. */
 #define LUA_MAXCAPTURES	32	/* Max. pattern captures. */
 
 /* Compatibility with older library function names. */